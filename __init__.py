@@ -4,7 +4,7 @@ from .python.serial import PandaSerial  # noqa: F401
 from .python.utils import logger # noqa: F401
 from .python import (Panda, PandaDFU, # noqa: F401
                      pack_can_buffer, unpack_can_buffer, calculate_checksum,
-                     DLC_TO_LEN, LEN_TO_DLC, CANPACKET_HEAD_SIZE)
+                     DLC_TO_LEN, LEN_TO_DLC, CANPACKET_HEAD_SIZE, CANPACKET_TS_SIZE)
 
 # panda jungle
 from .board.jungle import PandaJungle, PandaJungleDFU # noqa: F401
@@ -6,71 +6,161 @@
   * comms_can_read outputs this buffer in chunks of a specified length.
     chunks are always the given length, except the last one.
   * comms_can_write reads in this buffer in chunks.
-  * both functions maintain an overflow buffer for a partial CANPacket_t that
+  * the RX queues store packets in wire format, comms_can_read drains them
+    weighted-fair and keeps track of the packet spanning multiple
+    transfers/chunks.
+  * comms_can_write maintains an overflow buffer for a partial CANPacket_t that
     spans multiple transfers/chunks.
-  * the overflow buffers are reset by a dedicated control transfer handler,
+  * the partial packet state is reset by a dedicated control transfer handler,
     which is sent by the host on each start of a connection.
 */
 
 typedef struct {
   uint32_t ptr;
   uint32_t tail_size;
-  uint8_t data[72];
+  uint8_t data[CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE + 64U];
 } asm_buffer;
 
-static asm_buffer can_read_buffer = {.ptr = 0U, .tail_size = 0U};
+// packets moved to/from the queues per batch
+#define CAN_COMMS_BATCH_SIZE 8U
+
+// The per-bus RX queues are drained with deficit round-robin. Each round a bus
+// may send up to its weight in quanta, a quantum fits the largest packet.
+#define CAN_RX_QUANTUM (CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE + CANPACKET_DATA_SIZE_MAX)
+uint8_t can_rx_weight[CAN_RX_QUEUES_ARRAY_SIZE] = {1U, 1U, 1U};
+static uint32_t can_rx_deficit[CAN_RX_QUEUES_ARRAY_SIZE] = {0U, 0U, 0U};
+
+// bus of the packet that's currently being sent
+static uint8_t can_read_bus = 0U;
+// bytes still to be sent of the packet that was split between reads
+static uint32_t can_read_remaining = 0U;
+// bytes behind that packet that were cleared while it was in flight
+static uint32_t can_read_skip = 0U;
+
+// picks the bus to send from next, returns the packet's length or 0 if all queues are empty
+static uint32_t can_read_next(void) {
+  uint32_t pckt_len = 0U;
+  // one full round is enough, a bus' first packet after its turn always fits
+  for (uint8_t i = 0U; i <= CAN_RX_QUEUES_ARRAY_SIZE; i++) {
+    pckt_len = can_packed_head_len(can_rx_queues[can_read_bus]);
+    if (pckt_len == 0U) {
+      // an idle bus doesn't save up credit
+      can_rx_deficit[can_read_bus] = 0U;
+    } else if (pckt_len <= can_rx_deficit[can_read_bus]) {
+      break;
+    } else {
+      // wait for the next round
+    }
+    pckt_len = 0U;
+    can_read_bus = (can_read_bus + 1U) % CAN_RX_QUEUES_ARRAY_SIZE;
+    can_rx_deficit[can_read_bus] += (uint32_t)can_rx_weight[can_read_bus] * CAN_RX_QUANTUM;
+  }
+  return pckt_len;
+}
 
 int comms_can_read(uint8_t *data, uint32_t max_len) {
   uint32_t pos = 0U;
 
-  // Send tail of previous message if it is in buffer
-  if (can_read_buffer.ptr > 0U) {
-    uint32_t overflow_len = MIN(max_len - pos, can_read_buffer.ptr);
-    (void)memcpy(&data[pos], can_read_buffer.data, overflow_len);
-    pos += overflow_len;
-    (void)memcpy(can_read_buffer.data, &can_read_buffer.data[overflow_len], can_read_buffer.ptr - overflow_len);
-    can_read_buffer.ptr -= overflow_len;
-  }
-
-  if (can_read_buffer.ptr == 0U) {
-    // Fill rest of buffer with new data
-    CANPacket_t can_packet;
-    while ((pos < max_len) && can_pop(&can_rx_q, &can_packet)) {
-      uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[can_packet.data_len_code];
-      if ((pos + pckt_len) <= max_len) {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, pckt_len);
-        pos += pckt_len;
-      } else {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, max_len - pos);
-        can_read_buffer.ptr += pckt_len - (max_len - pos);
-        // cppcheck-suppress objectIndex
-        (void)memcpy(can_read_buffer.data, &((uint8_t*)&can_packet)[(max_len - pos)], can_read_buffer.ptr);
-        pos = max_len;
+  while (pos < max_len) {
+    if (can_read_remaining == 0U) {
+      can_read_remaining = can_read_next();
+      if (can_read_remaining == 0U) {
+        break;
       }
+      can_rx_deficit[can_read_bus] -= can_read_remaining;
+      can_packed_set_checksum(can_rx_queues[can_read_bus], can_read_remaining);
+    }
+
+    // the queues already hold the wire format, so this is a plain copy
+    uint32_t len = can_packed_read(can_rx_queues[can_read_bus], &data[pos], MIN(can_read_remaining, max_len - pos));
+    can_read_remaining -= len;
+    pos += len;
+
+    if ((can_read_remaining == 0U) && (can_read_skip > 0U)) {
+      // the split packet is out, now drop what was cleared behind it
+      can_packed_commit(can_rx_queues[can_read_bus], can_read_skip);
+      can_read_skip = 0U;
     }
   }
 
   return pos;
 }
 
+// drop all packets queued for the host, except one that's already partially sent
+void comms_can_rx_clear(void) {
+  for (uint8_t i = 0U; i < CAN_RX_QUEUES_ARRAY_SIZE; i++) {
+    uint32_t used = can_packed_used(can_rx_queues[i]);
+    if ((i == can_read_bus) && (can_read_remaining > 0U)) {
+      can_read_skip = used - can_read_remaining;
+    } else {
+      can_packed_commit(can_rx_queues[i], used);
+    }
+  }
+}
+
 static asm_buffer can_write_buffer = {.ptr = 0U, .tail_size = 0U};
 
+// The checksum of host packets is checked here once, copies inside the firmware don't carry one.
+// The wire format without the v5 timestamp is the packet's memory layout.
+static bool comms_can_parse(const uint8_t *src, uint32_t len, CANPacket_t *pkt) {
+  bool ret = (calculate_checksum(src, len) == 0U);
+  if (ret) {
+    uint32_t head_len = can_wire_head_size();
+    (void)memset(pkt, 0, sizeof(CANPacket_t));
+    (void)memcpy((uint8_t *)pkt, src, CANPACKET_HEAD_SIZE);
+    (void)memcpy(pkt->data, &src[head_len], MIN(len - head_len, CANPACKET_DATA_SIZE_MAX));
+    if (head_len > CANPACKET_HEAD_SIZE) {
+      BYTE_ARRAY_TO_WORD(pkt->timestamp, &src[CANPACKET_HEAD_SIZE]);
+    }
+  } else {
+    uint8_t bus_number = (src[0] >> 1U) & 0x7U;
+    if (bus_number < PANDA_BUS_CNT) {
+      can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_checksum_error_cnt += 1U;
+    }
+  }
+  return ret;
+}
+
+// buses the host wrote to, and when it last did
+static uint8_t comms_can_tx_buses = 0U;
+static uint32_t comms_can_tx_ts[CAN_QUEUES_ARRAY_SIZE];
+
+// a burst that's loading takes the host's packets instead of the TX queues
+static void comms_can_send_batch(CANPacket_t *batch, uint32_t cnt) {
+  if (can_burst_loading()) {
+    can_burst_stage(batch, cnt);
+  } else {
+    uint32_t now = microsecond_timer_get();
+    for (uint32_t i = 0U; i < cnt; i++) {
+      can_tx_deadline_from_host(&batch[i]);
+      if (batch[i].bus < PANDA_BUS_CNT) {
+        comms_can_tx_buses |= (1U << batch[i].bus);
+        comms_can_tx_ts[batch[i].bus] = now;
+      }
+    }
+    can_send_many(batch, cnt, false);
+  }
+}
+
 // send on CAN
 void comms_can_write(const uint8_t *data, uint32_t len) {
   uint32_t pos = 0U;
 
+  CANPacket_t batch[CAN_COMMS_BATCH_SIZE];
+  uint32_t batch_cnt = 0U;
+
   // Assembling can message with data from buffer
   if (can_write_buffer.ptr != 0U) {
     if (can_write_buffer.tail_size <= (len - pos)) {
       // we have enough data to complete the buffer
-      CANPacket_t to_push = {0};
       (void)memcpy(&can_write_buffer.data[can_write_buffer.ptr], &data[pos], can_write_buffer.tail_size);
       can_write_buffer.ptr += can_write_buffer.tail_size;
       pos += can_write_buffer.tail_size;
 
-      // send out
-      (void)memcpy((uint8_t*)&to_push, can_write_buffer.data, can_write_buffer.ptr);
-      can_send(&to_push, to_push.bus, false);
+      // queue up for sending
+      if (comms_can_parse(can_write_buffer.data, can_write_buffer.ptr, &batch[batch_cnt])) {
+        batch_cnt += 1U;
+      }
 
       // reset overflow buffer
       can_write_buffer.ptr = 0U;
@@ -87,12 +177,17 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
 
   // rest of the message
   while (pos < len) {
-    uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[(data[pos] >> 4U)];
+    uint32_t pckt_len = can_wire_head_size() + dlc_to_len[(data[pos] >> 4U)];
     if ((pos + pckt_len) <= len) {
-      CANPacket_t to_push = {0};
-      (void)memcpy((uint8_t*)&to_push, &data[pos], pckt_len);
-      can_send(&to_push, to_push.bus, false);
+      if (comms_can_parse(&data[pos], pckt_len, &batch[batch_cnt])) {
+        batch_cnt += 1U;
+      }
       pos += pckt_len;
+
+      if (batch_cnt == CAN_COMMS_BATCH_SIZE) {
+        comms_can_send_batch(batch, batch_cnt);
+        batch_cnt = 0U;
+      }
     } else {
       (void)memcpy(can_write_buffer.data, &data[pos], len - pos);
       can_write_buffer.ptr = len - pos;
@@ -101,22 +196,58 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
     }
   }
 
+  if (batch_cnt > 0U) {
+    comms_can_send_batch(batch, batch_cnt);
+  }
+
   refresh_can_tx_slots_available();
 }
 
 void comms_can_reset(void) {
   can_write_buffer.ptr = 0U;
   can_write_buffer.tail_size = 0U;
-  can_read_buffer.ptr = 0U;
-  can_read_buffer.tail_size = 0U;
+  // the host starts over at a packet boundary, drop the rest of a split packet
+  can_packed_commit(can_rx_queues[can_read_bus], can_read_remaining + can_read_skip);
+  can_read_remaining = 0U;
+  can_read_skip = 0U;
+}
+
+// The host asks for the newest CAN packet version it speaks, hosts from before v5 send 0.
+// Everything queued is in the old format, so switching drops it.
+uint8_t comms_can_set_packet_version(uint32_t host_version) {
+  uint8_t version = (host_version >= (uint32_t)CAN_PACKET_VERSION) ? CAN_PACKET_VERSION : CAN_PACKET_VERSION_MIN;
+  if (version != can_packet_version) {
+    can_packet_version = version;
+    comms_can_reset();
+    comms_can_rx_clear();
+  }
+  return can_packet_version;
+}
+
+// Only the buses the host wrote to lately can hold back its writes, so a bus it has
+// stopped sending on doesn't block the others.
+static bool comms_can_slots_free(uint32_t min) {
+  bool ret;
+  if (can_burst_loading()) {
+    ret = (can_burst_slots_empty() >= min);
+  } else {
+    uint32_t now = microsecond_timer_get();
+    for (uint8_t bus = 0U; bus < PANDA_BUS_CNT; bus++) {
+      if (get_ts_elapsed(now, comms_can_tx_ts[bus]) >= CAN_TX_STALL_TIMEOUT) {
+        comms_can_tx_buses &= ~(1U << bus);
+      }
+    }
+    ret = can_tx_check_min_slots_free(min, comms_can_tx_buses);
+  }
+  return ret;
 }
 
 // TODO: make this more general!
 void refresh_can_tx_slots_available(void) {
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
+  if (comms_can_slots_free(MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
     can_tx_comms_resume_usb();
   }
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
+  if (comms_can_slots_free(MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
     can_tx_comms_resume_spi();
   }
 }
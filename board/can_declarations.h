@@ -1,9 +1,15 @@
 #pragma once
 
 // bump this when changing the CAN packet
-#define CAN_PACKET_VERSION 4
+#define CAN_PACKET_VERSION 5
+// oldest version still spoken, with hosts that don't ask for a newer one
+#define CAN_PACKET_VERSION_MIN 4
 
 #define CANPACKET_HEAD_SIZE 6U
+// XOR of the whole packet on the wire, internal copies don't carry it
+#define CANPACKET_CHECKSUM_POS 5U
+// v5: little endian microsecond timestamp following the header
+#define CANPACKET_TS_SIZE 4U
 
 #if !defined(STM32F4)
   #define CANFD
@@ -22,6 +28,7 @@ typedef struct {
   unsigned int addr : 29;
   unsigned char checksum;
   unsigned char data[CANPACKET_DATA_SIZE_MAX];
+  uint32_t timestamp;  // microsecond_timer_get() on RX/echo
 } __attribute__((packed, aligned(4))) CANPacket_t;
 
 #define GET_BUS(msg) ((msg)->bus)
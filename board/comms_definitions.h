@@ -10,3 +10,5 @@ void comms_endpoint2_write(const uint8_t *data, uint32_t len);
 void comms_can_write(const uint8_t *data, uint32_t len);
 int comms_can_read(uint8_t *data, uint32_t max_len);
 void comms_can_reset(void);
+void comms_can_rx_clear(void);
+uint8_t comms_can_set_packet_version(uint32_t host_version);
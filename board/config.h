@@ -12,6 +12,8 @@
 
 #define CAN_INIT_TIMEOUT_MS 500U
 #define USBPACKET_MAX_SIZE 0x40U
+// control IN responses longer than a packet go out over several EP0 packets
+#define CONTROL_RESP_MAX_SIZE 0x80U
 #define MAX_CAN_MSGS_PER_USB_BULK_TRANSFER 51U
 #define MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER 170U
 
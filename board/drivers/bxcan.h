@@ -20,7 +20,8 @@ bool can_set_speed(uint8_t can_number) {
     CANx,
     bus_config[bus_number].can_speed,
     can_loopback,
-    (unsigned int)(can_silent) & (1U << can_number)
+    (unsigned int)(can_silent) & (1U << can_number),
+    bus_config[bus_number].tx_id_priority
   );
   return ret;
 }
@@ -50,6 +51,10 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
   can_health[can_number].irq0_call_rate = interrupts[can_irq_number[can_number][0]].call_rate;
   can_health[can_number].irq1_call_rate = interrupts[can_irq_number[can_number][1]].call_rate;
   can_health[can_number].irq2_call_rate = interrupts[can_irq_number[can_number][2]].call_rate;
+  can_health[can_number].irq0_max_time = MIN(interrupts[can_irq_number[can_number][0]].max_duration, 0xFFFFU);
+  can_health[can_number].irq1_max_time = MIN(interrupts[can_irq_number[can_number][1]].max_duration, 0xFFFFU);
+  can_health[can_number].irq2_max_time = MIN(interrupts[can_irq_number[can_number][2]].max_duration, 0xFFFFU);
+  can_health[can_number].rx_bottom_half_max_time = MIN(interrupts[CAN_RX_SWI_IRQ].max_duration, 0xFFFFU);
 
   if (ir_reg != 0U) {
     can_health[can_number].total_error_cnt += 1U;
@@ -69,6 +74,102 @@ static void can_sce(uint8_t can_number) {
   update_can_health_pkt(can_number, 1U);
 }
 
+// mailboxes that are loaded, in the order they were requested. Lets the TX
+// echoes go out in send order, which ID priority mode might not keep
+static uint8_t can_tx_pending[CAN_ARRAY_SIZE][CAN_TX_MAILBOX_CNT];
+static uint8_t can_tx_pending_cnt[CAN_ARRAY_SIZE] = {0U, 0U, 0U};
+
+static void can_tx_load(uint8_t can_number, uint8_t mb, const CANPacket_t *to_send) {
+  CAN_TypeDef *CANx = CANIF_FROM_CAN_NUM(can_number);
+  can_health[can_number].total_tx_cnt += 1U;
+  // only send if we have received a packet
+  CANx->sTxMailBox[mb].TIR = ((to_send->extended != 0U) ? (to_send->addr << 3) : (to_send->addr << 21)) | (to_send->extended << 2);
+  CANx->sTxMailBox[mb].TDTR = to_send->data_len_code;
+  BYTE_ARRAY_TO_WORD(CANx->sTxMailBox[mb].TDLR, &to_send->data[0]);
+  BYTE_ARRAY_TO_WORD(CANx->sTxMailBox[mb].TDHR, &to_send->data[4]);
+  // Send request TXRQ
+  CANx->sTxMailBox[mb].TIR |= 0x1U;
+
+  if (can_tx_pending_cnt[can_number] < CAN_TX_MAILBOX_CNT) {
+    can_tx_pending[can_number][can_tx_pending_cnt[can_number]] = mb;
+    can_tx_pending_cnt[can_number] += 1U;
+  }
+}
+
+// echoes the mailboxes that are done, in send order. Has to run before a mailbox is
+// reloaded, the send request clears its completion flags
+static void can_tx_complete(uint8_t can_number) {
+  CAN_TypeDef *CANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+
+  // TSR flags are rc_w1, only write the ones of the mailbox being handled
+  uint8_t still_pending = 0U;
+  for (uint8_t i = 0U; i < can_tx_pending_cnt[can_number]; i++) {
+    uint8_t mb = can_tx_pending[can_number][i];
+    uint32_t shift = 8U * mb;
+    if ((CANx->TSR & ((CAN_TSR_TERR0 | CAN_TSR_ALST0) << shift)) != 0U) { // last TX failed due to error arbitration lost
+      can_health[can_number].total_tx_lost_cnt += 1U;
+      CANx->TSR = ((CAN_TSR_TERR0 | CAN_TSR_ALST0) << shift);
+    }
+
+    uint32_t tsr = CANx->TSR;
+    if ((tsr & (CAN_TSR_TME0 << mb)) == 0U) {
+      can_tx_pending[can_number][still_pending] = mb;
+      still_pending += 1U;
+    } else if ((tsr & (CAN_TSR_RQCP0 << shift)) != 0U) {
+      // add successfully transmitted message to my fifo
+      if ((tsr & (CAN_TSR_TXOK0 << shift)) != 0U) {
+        CANPacket_t to_push;
+        to_push.fd = 0U;
+        to_push.returned = 1U;
+        to_push.rejected = 0U;
+        to_push.extended = (CANx->sTxMailBox[mb].TIR >> 2) & 0x1U;
+        to_push.addr = (to_push.extended != 0U) ? (CANx->sTxMailBox[mb].TIR >> 3) : (CANx->sTxMailBox[mb].TIR >> 21);
+        to_push.data_len_code = CANx->sTxMailBox[mb].TDTR & 0xFU;
+        to_push.bus = bus_number;
+        to_push.timestamp = microsecond_timer_get();
+        WORD_TO_BYTE_ARRAY(&to_push.data[0], CANx->sTxMailBox[mb].TDLR);
+        WORD_TO_BYTE_ARRAY(&to_push.data[4], CANx->sTxMailBox[mb].TDHR);
+        can_bus_load_add(can_number, &to_push, false);
+
+        can_rx_stage(&to_push);
+      }
+
+      // clear interrupt, also clears TXOK, ALST and TERR
+      // careful, this can also be cleared by requesting a transmission
+      CANx->TSR = (CAN_TSR_RQCP0 << shift);
+    } else {
+      // emptied without a request completing, e.g. by a core reset
+    }
+  }
+  can_tx_pending_cnt[can_number] = still_pending;
+}
+
+bool can_tx_direct(uint8_t bus_number, const CANPacket_t *to_send) {
+  bool ret = false;
+  if (bus_number < PANDA_BUS_CNT) {
+    ENTER_CRITICAL();
+    uint8_t can_number = CAN_NUM_FROM_BUS_NUM(bus_number);
+    CAN_TypeDef *CANx = CANIF_FROM_CAN_NUM(can_number);
+    // frames already queued for the bus go out first
+    if ((can_tx_queued(bus_number) == 0U) && can_tx_shaper_ready(bus_number)) {
+      // a TX complete interrupt might be pending, its mailboxes are echoed before one is reused
+      can_tx_complete(can_number);
+      uint8_t mailbox_cnt = MIN(bus_config[bus_number].tx_buf_cnt, CAN_TX_MAILBOX_CNT);
+      for (uint8_t mb = 0U; mb < mailbox_cnt; mb++) {
+        if ((CANx->TSR & (CAN_TSR_TME0 << mb)) != 0U) {
+          can_tx_shaper_charge(bus_number, to_send);
+          can_tx_load(can_number, mb, to_send);
+          ret = true;
+          break;
+        }
+      }
+    }
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
 // CANx_TX IRQ Handler
 void process_can(uint8_t can_number) {
   if (can_number != 0xffU) {
@@ -78,54 +179,26 @@ void process_can(uint8_t can_number) {
     CAN_TypeDef *CANx = CANIF_FROM_CAN_NUM(can_number);
     uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
 
-    // check for empty mailbox
-    CANPacket_t to_send;
-    if ((CANx->TSR & (CAN_TSR_TERR0 | CAN_TSR_ALST0)) != 0U) { // last TX failed due to error arbitration lost
-      can_health[can_number].total_tx_lost_cnt += 1U;
-      CANx->TSR |= (CAN_TSR_TERR0 | CAN_TSR_ALST0);
-    }
-    if ((CANx->TSR & CAN_TSR_TME0) == CAN_TSR_TME0) {
-      // add successfully transmitted message to my fifo
-      if ((CANx->TSR & CAN_TSR_RQCP0) == CAN_TSR_RQCP0) {
-        if ((CANx->TSR & CAN_TSR_TXOK0) == CAN_TSR_TXOK0) {
-          CANPacket_t to_push;
-          to_push.fd = 0U;
-          to_push.returned = 1U;
-          to_push.rejected = 0U;
-          to_push.extended = (CANx->sTxMailBox[0].TIR >> 2) & 0x1U;
-          to_push.addr = (to_push.extended != 0U) ? (CANx->sTxMailBox[0].TIR >> 3) : (CANx->sTxMailBox[0].TIR >> 21);
-          to_push.data_len_code = CANx->sTxMailBox[0].TDTR & 0xFU;
-          to_push.bus = bus_number;
-          WORD_TO_BYTE_ARRAY(&to_push.data[0], CANx->sTxMailBox[0].TDLR);
-          WORD_TO_BYTE_ARRAY(&to_push.data[4], CANx->sTxMailBox[0].TDHR);
-          can_set_checksum(&to_push);
-
-          rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
-        }
-
-        // clear interrupt
-        // careful, this can also be cleared by requesting a transmission
-        CANx->TSR |= CAN_TSR_RQCP0;
-      }
+    can_tx_complete(can_number);
 
-      if (can_pop(can_queues[bus_number], &to_send)) {
-        if (can_check_checksum(&to_send)) {
-          can_health[can_number].total_tx_cnt += 1U;
-          // only send if we have received a packet
-          CANx->sTxMailBox[0].TIR = ((to_send.extended != 0U) ? (to_send.addr << 3) : (to_send.addr << 21)) | (to_send.extended << 2);
-          CANx->sTxMailBox[0].TDTR = to_send.data_len_code;
-          BYTE_ARRAY_TO_WORD(CANx->sTxMailBox[0].TDLR, &to_send.data[0]);
-          BYTE_ARRAY_TO_WORD(CANx->sTxMailBox[0].TDHR, &to_send.data[4]);
-          // Send request TXRQ
-          CANx->sTxMailBox[0].TIR |= 0x1U;
-        } else {
-          can_health[can_number].total_tx_checksum_error_cnt += 1U;
+    // keep the mailboxes loaded, so the next frame is ready as soon as the bus is free
+    bool popped = false;
+    uint8_t mailbox_cnt = MIN(bus_config[bus_number].tx_buf_cnt, CAN_TX_MAILBOX_CNT);
+    for (uint8_t mb = 0U; mb < mailbox_cnt; mb++) {
+      if ((CANx->TSR & (CAN_TSR_TME0 << mb)) != 0U) {
+        CANPacket_t to_send;
+        if (!can_tx_pop(bus_number, &to_send)) {
+          break;
         }
-
-        refresh_can_tx_slots_available();
+        popped = true;
+        can_tx_load(can_number, mb, &to_send);
       }
     }
 
+    if (popped) {
+      refresh_can_tx_slots_available();
+    }
+
     EXIT_CRITICAL();
   }
 }
@@ -152,34 +225,13 @@ void can_rx(uint8_t can_number) {
     to_push.addr = (to_push.extended != 0U) ? (CANx->sFIFOMailBox[0].RIR >> 3) : (CANx->sFIFOMailBox[0].RIR >> 21);
     to_push.data_len_code = CANx->sFIFOMailBox[0].RDTR & 0xFU;
     to_push.bus = bus_number;
+    to_push.timestamp = microsecond_timer_get();
     WORD_TO_BYTE_ARRAY(&to_push.data[0], CANx->sFIFOMailBox[0].RDLR);
     WORD_TO_BYTE_ARRAY(&to_push.data[4], CANx->sFIFOMailBox[0].RDHR);
-    can_set_checksum(&to_push);
-
-    // forwarding (panda only)
-    int bus_fwd_num = safety_fwd_hook(bus_number, to_push.addr);
-    if (bus_fwd_num != -1) {
-      CANPacket_t to_send;
-
-      to_send.fd = 0U;
-      to_send.returned = 0U;
-      to_send.rejected = 0U;
-      to_send.extended = to_push.extended; // TXRQ
-      to_send.addr = to_push.addr;
-      to_send.bus = to_push.bus;
-      to_send.data_len_code = to_push.data_len_code;
-      (void)memcpy(to_send.data, to_push.data, dlc_to_len[to_push.data_len_code]);
-      can_set_checksum(&to_send);
-
-      can_send(&to_send, bus_fwd_num, true);
-      can_health[can_number].total_fwd_cnt += 1U;
-    }
-
-    safety_rx_invalid += safety_rx_hook(&to_push) ? 0U : 1U;
-    ignition_can_hook(&to_push);
+    can_bus_load_add(can_number, &to_push, false);
 
-    led_set(LED_BLUE, true);
-    rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+    // forwarding, the safety hooks and the host queues are left to the bottom half
+    can_rx_stage(&to_push);
 
     // next
     CANx->RF0R |= CAN_RF0R_RFOM0;
@@ -210,6 +262,9 @@ bool can_init(uint8_t can_number) {
   REGISTER_INTERRUPT(CAN3_TX_IRQn, CAN3_TX_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
   REGISTER_INTERRUPT(CAN3_RX0_IRQn, CAN3_RX0_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
   REGISTER_INTERRUPT(CAN3_SCE_IRQn, CAN3_SCE_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
+  REGISTER_INTERRUPT(CAN_RX_SWI_IRQ, can_rx_bottom_half, CAN_RX_SWI_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_RX_SWI)
+  NVIC_SetPriority(CAN_RX_SWI_IRQ, CAN_RX_SWI_PRIORITY);
+  NVIC_EnableIRQ(CAN_RX_SWI_IRQ);
 
   if (can_number != 0xffU) {
     CAN_TypeDef *CANx = CANIF_FROM_CAN_NUM(can_number);
@@ -6,6 +6,7 @@
 
 #define CAN_ARRAY_SIZE 3
 #define CAN_IRQS_ARRAY_SIZE 3
+#define CAN_TX_MAILBOX_CNT CAN_TX_BUF_CNT_MAX
 extern CAN_TypeDef *cans[CAN_ARRAY_SIZE];
 extern uint8_t can_irq_number[CAN_IRQS_ARRAY_SIZE][CAN_IRQS_ARRAY_SIZE];
 
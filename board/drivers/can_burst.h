@@ -0,0 +1,121 @@
+#include "can_burst_declarations.h"
+
+#ifdef STM32H7
+__attribute__((section(".axisram"))) can_buffer(burst_q, CAN_BURST_BUFFER_SIZE)
+#else
+can_buffer(burst_q, CAN_BURST_BUFFER_SIZE)
+#endif
+
+can_burst_stats_t can_burst_stats;
+
+// the host has uploaded the whole list
+static bool can_burst_ended = false;
+// the buffer ran dry, counted as one underrun until the next frame comes in
+static bool can_burst_underrun = false;
+static uint32_t can_burst_start_ts = 0U;
+
+static void can_burst_disarm(void) {
+  MICROSECOND_TIMER->DIER &= ~TIM_DIER_CC2IE;
+}
+
+// control requests come in through interrupts of the same priority as playback
+void can_burst_control(uint32_t op, uint32_t param) {
+  if ((op == CAN_BURST_OP_STOP) || (op == CAN_BURST_OP_LOAD)) {
+    can_burst_disarm();
+    can_clear(&can_burst_q);
+    (void)memset(&can_burst_stats, 0, sizeof(can_burst_stats));
+    can_burst_ended = false;
+    can_burst_underrun = false;
+    can_burst_stats.state = (op == CAN_BURST_OP_LOAD) ? CAN_BURST_STATE_LOADING : CAN_BURST_STATE_IDLE;
+  } else if ((op == CAN_BURST_OP_PLAY) && (can_burst_stats.state == CAN_BURST_STATE_LOADING)) {
+    can_burst_start_ts = microsecond_timer_get() + (param * 1000U);
+    can_burst_stats.state = CAN_BURST_STATE_PLAYING;
+    can_burst_run();
+  } else if ((op == CAN_BURST_OP_END) && ((can_burst_stats.state == CAN_BURST_STATE_LOADING) || (can_burst_stats.state == CAN_BURST_STATE_PLAYING))) {
+    can_burst_ended = true;
+    can_burst_run();
+  } else {
+  }
+  refresh_can_tx_slots_available();
+}
+
+// CAN writes from the host go to the staging buffer instead of the TX queues
+bool can_burst_loading(void) {
+  return (can_burst_stats.state == CAN_BURST_STATE_LOADING) || ((can_burst_stats.state == CAN_BURST_STATE_PLAYING) && !can_burst_ended);
+}
+
+uint32_t can_burst_slots_empty(void) {
+  return can_slots_empty(&can_burst_q);
+}
+
+void can_burst_stage(const CANPacket_t *pkts, uint32_t cnt) {
+  uint32_t pushed = can_push_many(&can_burst_q, pkts, cnt);
+  can_burst_stats.staged_cnt += pushed;
+  can_burst_stats.dropped_cnt += cnt - pushed;
+  if (pushed > 0U) {
+    can_burst_underrun = false;
+    if (can_burst_stats.state == CAN_BURST_STATE_PLAYING) {
+      can_burst_run();
+    }
+  }
+}
+
+// sends everything that's due and sets up the timer compare for the next frame
+void can_burst_run(void) {
+  bool pending = (can_burst_stats.state == CAN_BURST_STATE_PLAYING);
+  bool popped = false;
+  while (pending) {
+    uint32_t now = microsecond_timer_get();
+    const CANPacket_t *next = can_peek(&can_burst_q, 0U);
+    pending = false;
+
+    if (next == NULL) {
+      can_burst_disarm();
+      if (can_burst_ended) {
+        can_burst_stats.state = CAN_BURST_STATE_DONE;
+      } else if (!can_burst_underrun) {
+        can_burst_underrun = true;
+        can_burst_stats.underrun_cnt += 1U;
+      } else {
+      }
+    } else {
+      uint32_t due_ts = can_burst_start_ts + next->timestamp;
+      int32_t late = (int32_t)(now - due_ts);
+      if ((late + (int32_t)CAN_BURST_GRANULARITY) > 0) {
+        CANPacket_t to_send = *next;
+        can_commit(&can_burst_q, 1U);
+        popped = true;
+
+        if (late > 0) {
+          can_burst_stats.max_late = MAX(can_burst_stats.max_late, (uint32_t)late);
+          if ((uint32_t)late > CAN_BURST_LATE_THRESHOLD) {
+            can_burst_stats.late_cnt += 1U;
+          }
+        }
+        // no TX flags, the timestamp was the offset
+        to_send.timestamp = 0U;
+        to_send.returned = 0U;
+        to_send.rejected = 0U;
+        can_send(&to_send, to_send.bus, false);
+        can_burst_stats.sent_cnt += 1U;
+        pending = true;
+      } else {
+        MICROSECOND_TIMER->CCR2 = due_ts;
+        MICROSECOND_TIMER->DIER |= TIM_DIER_CC2IE;
+        // the compare only fires on an exact match, go again if the frame got due meanwhile
+        pending = ((int32_t)(microsecond_timer_get() - due_ts) >= 0);
+      }
+    }
+  }
+
+  if (popped) {
+    // let the host refill the buffer
+    refresh_can_tx_slots_available();
+  }
+}
+
+void can_burst_irq_handler(void) {
+  // status bits are rc_w0
+  MICROSECOND_TIMER->SR = (uint32_t)~TIM_SR_CC2IF;
+  can_burst_run();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// ********************* timed burst playback *********************
+// The host uploads a list of frames that go out at fixed offsets from the start of
+// playback, e.g. to replay a log with its original timing. The frames come in over the
+// regular CAN bulk endpoint while a burst is loading, the v5 timestamp of each one holds
+// its offset in us. They are staged in order and released into the TX queues from a
+// timer compare interrupt, each still goes through the safety TX hook. The list can be
+// longer than the staging buffer, the host keeps uploading while it plays and marks the
+// end of the list once it's all out. The burst is controlled through CAN_BURST_OP_*.
+#define CAN_BURST_BUFFER_SIZE 256U
+// frames due this close together go out from the same interrupt
+#define CAN_BURST_GRANULARITY 50U // us
+#define CAN_BURST_INTERRUPT_RATE (1000000U / CAN_BURST_GRANULARITY)
+// a frame that goes out later than this counts as late
+#define CAN_BURST_LATE_THRESHOLD 100U // us
+
+#define CAN_BURST_OP_STOP 0U  // drop the burst, CAN writes go to the TX queues again
+#define CAN_BURST_OP_LOAD 1U  // start staging a new burst
+#define CAN_BURST_OP_PLAY 2U  // start playback, param is the delay to the start in ms
+#define CAN_BURST_OP_END 3U   // the whole list is uploaded
+
+#define CAN_BURST_STATE_IDLE 0U
+#define CAN_BURST_STATE_LOADING 1U
+#define CAN_BURST_STATE_PLAYING 2U
+#define CAN_BURST_STATE_DONE 3U
+
+typedef struct __attribute__((packed)) {
+  uint8_t state;
+  uint32_t staged_cnt;
+  uint32_t sent_cnt;
+  uint32_t dropped_cnt;   // staged while the buffer was full
+  uint32_t late_cnt;      // went out more than CAN_BURST_LATE_THRESHOLD late
+  uint32_t max_late;      // us
+  uint32_t underrun_cnt;  // times the buffer ran dry before the end of the list
+} can_burst_stats_t;
+
+extern can_burst_stats_t can_burst_stats;
+
+void can_burst_control(uint32_t op, uint32_t param);
+bool can_burst_loading(void);
+uint32_t can_burst_slots_empty(void);
+void can_burst_stage(const CANPacket_t *pkts, uint32_t cnt);
+void can_burst_run(void);
+void can_burst_irq_handler(void);
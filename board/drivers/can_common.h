@@ -22,66 +22,94 @@ bool can_loopback = false;
   extern can_ring can_##x; \
   can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = (size), .elems = (CANPacket_t *)&(elems_##x) };
 
-#define CAN_RX_BUFFER_SIZE 4096U
+#define can_packed_buffer(x, len) \
+  static uint8_t data_##x[len]; \
+  extern can_packed_ring can_##x; \
+  can_packed_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .size = (len), .data = (uint8_t *)&(data_##x) };
+
+// in bytes per bus, together the same footprint as 4096 full size packets
+#define CAN_RX_BUFFER_SIZE ((4096U * (CANPACKET_HEAD_SIZE + CANPACKET_DATA_SIZE_MAX)) / CAN_RX_QUEUES_ARRAY_SIZE)
 #define CAN_TX_BUFFER_SIZE 416U
+#define CAN_TX_HP_BUFFER_SIZE 32U
 
 #ifdef STM32H7
 // ITCM RAM and DTCM RAM are the fastest for Cortex-M7 core access
-__attribute__((section(".axisram"))) can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
+__attribute__((section(".axisram"))) can_packed_buffer(rx1_q, CAN_RX_BUFFER_SIZE)
+__attribute__((section(".axisram"))) can_packed_buffer(rx2_q, CAN_RX_BUFFER_SIZE)
+__attribute__((section(".axisram"))) can_packed_buffer(rx3_q, CAN_RX_BUFFER_SIZE)
 __attribute__((section(".itcmram"))) can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
 __attribute__((section(".itcmram"))) can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
+// AXI SRAM is taken up by the RX, burst and echo buffers, SRAM1/2 has room
+__attribute__((section(".sram12"))) can_buffer(tx1_hp_q, CAN_TX_HP_BUFFER_SIZE)
+__attribute__((section(".sram12"))) can_buffer(tx2_hp_q, CAN_TX_HP_BUFFER_SIZE)
+__attribute__((section(".sram12"))) can_buffer(tx3_hp_q, CAN_TX_HP_BUFFER_SIZE)
 #else
-can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
+// the RAM below the stack is 128K, SRAM2 is free
+__attribute__((section(".sram2"))) can_packed_buffer(rx1_q, CAN_RX_BUFFER_SIZE)
+__attribute__((section(".sram2"))) can_packed_buffer(rx2_q, CAN_RX_BUFFER_SIZE)
+__attribute__((section(".sram2"))) can_packed_buffer(rx3_q, CAN_RX_BUFFER_SIZE)
 can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
 can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
+can_buffer(tx1_hp_q, CAN_TX_HP_BUFFER_SIZE)
+can_buffer(tx2_hp_q, CAN_TX_HP_BUFFER_SIZE)
+can_buffer(tx3_hp_q, CAN_TX_HP_BUFFER_SIZE)
 #endif
 can_buffer(tx3_q, CAN_TX_BUFFER_SIZE)
 
 // FIXME:
 // cppcheck-suppress misra-c2012-9.3
 can_ring *can_queues[CAN_QUEUES_ARRAY_SIZE] = {&can_tx1_q, &can_tx2_q, &can_tx3_q};
+// cppcheck-suppress misra-c2012-9.3
+can_ring *can_hp_queues[CAN_QUEUES_ARRAY_SIZE] = {&can_tx1_hp_q, &can_tx2_hp_q, &can_tx3_hp_q};
+// cppcheck-suppress misra-c2012-9.3
+can_packed_ring *can_rx_queues[CAN_RX_QUEUES_ARRAY_SIZE] = {&can_rx1_q, &can_rx2_q, &can_rx3_q};
 
-// ********************* interrupt safe queue *********************
-bool can_pop(can_ring *q, CANPacket_t *elem) {
-  bool ret = 0;
+// ********************* lock-free SPSC queue *********************
+static uint32_t can_ring_used(const can_ring *q, uint32_t r_ptr, uint32_t w_ptr) {
+  return (w_ptr >= r_ptr) ? (w_ptr - r_ptr) : (q->fifo_size - r_ptr + w_ptr);
+}
 
-  ENTER_CRITICAL();
-  if (q->w_ptr != q->r_ptr) {
-    *elem = q->elems[q->r_ptr];
-    if ((q->r_ptr + 1U) == q->fifo_size) {
-      q->r_ptr = 0;
-    } else {
-      q->r_ptr += 1U;
-    }
-    ret = 1;
-  }
-  EXIT_CRITICAL();
+uint32_t can_pop_many(can_ring *q, CANPacket_t *elems, uint32_t max_cnt) {
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t w_ptr = q->w_ptr;
+  // don't read any elements before the w_ptr that published them
+  __DMB();
 
-  return ret;
+  uint32_t cnt = MIN(can_ring_used(q, r_ptr, w_ptr), max_cnt);
+  if (cnt > 0U) {
+    // copy out in at most two contiguous spans
+    uint32_t first = MIN(cnt, q->fifo_size - r_ptr);
+    (void)memcpy(elems, &q->elems[r_ptr], first * sizeof(CANPacket_t));
+    (void)memcpy(&elems[first], q->elems, (cnt - first) * sizeof(CANPacket_t));
+
+    // elements have to be read out before the slots are handed back
+    __DMB();
+    q->r_ptr = ((r_ptr + cnt) >= q->fifo_size) ? (r_ptr + cnt - q->fifo_size) : (r_ptr + cnt);
+  }
+  return cnt;
 }
 
-bool can_push(can_ring *q, const CANPacket_t *elem) {
-  bool ret = false;
-  uint32_t next_w_ptr;
+uint32_t can_push_many(can_ring *q, const CANPacket_t *elems, uint32_t cnt) {
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t r_ptr = q->r_ptr;
+  // don't overwrite any slots before the r_ptr that freed them
+  __DMB();
 
-  ENTER_CRITICAL();
-  if ((q->w_ptr + 1U) == q->fifo_size) {
-    next_w_ptr = 0;
-  } else {
-    next_w_ptr = q->w_ptr + 1U;
-  }
-  if (next_w_ptr != q->r_ptr) {
-    q->elems[q->w_ptr] = *elem;
-    q->w_ptr = next_w_ptr;
-    ret = true;
+  uint32_t pushed = MIN(q->fifo_size - 1U - can_ring_used(q, r_ptr, w_ptr), cnt);
+  if (pushed > 0U) {
+    uint32_t first = MIN(pushed, q->fifo_size - w_ptr);
+    (void)memcpy(&q->elems[w_ptr], elems, first * sizeof(CANPacket_t));
+    (void)memcpy(q->elems, &elems[first], (pushed - first) * sizeof(CANPacket_t));
+
+    // elements have to be written before they are published
+    __DMB();
+    q->w_ptr = ((w_ptr + pushed) >= q->fifo_size) ? (w_ptr + pushed - q->fifo_size) : (w_ptr + pushed);
   }
-  EXIT_CRITICAL();
-  if (!ret) {
+
+  if (pushed != cnt) {
     #ifdef DEBUG
       print("can_push to ");
-      if (q == &can_rx_q) {
-        print("can_rx_q");
-      } else if (q == &can_tx1_q) {
+      if (q == &can_tx1_q) {
         print("can_tx1_q");
       } else if (q == &can_tx2_q) {
         print("can_tx2_q");
@@ -93,23 +121,458 @@ bool can_push(can_ring *q, const CANPacket_t *elem) {
       print(" failed!\n");
     #endif
   }
-  return ret;
+  return pushed;
+}
+
+bool can_pop(can_ring *q, CANPacket_t *elem) {
+  return can_pop_many(q, elem, 1U) == 1U;
+}
+
+bool can_push(can_ring *q, const CANPacket_t *elem) {
+  return can_push_many(q, elem, 1U) == 1U;
 }
 
 uint32_t can_slots_empty(const can_ring *q) {
-  uint32_t ret = 0;
+  return q->fifo_size - 1U - can_ring_used(q, q->r_ptr, q->w_ptr);
+}
 
+uint32_t can_slots_used(const can_ring *q) {
+  return can_ring_used(q, q->r_ptr, q->w_ptr);
+}
+
+// returns the idx-th oldest element, or NULL if there are not that many queued.
+// the element stays valid until it's committed
+const CANPacket_t *can_peek(const can_ring *q, uint32_t idx) {
+  const CANPacket_t *ret = NULL;
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t w_ptr = q->w_ptr;
+  // don't read the element before the w_ptr that published it
+  __DMB();
+
+  if (idx < can_ring_used(q, r_ptr, w_ptr)) {
+    uint32_t ptr = r_ptr + idx;
+    ret = &q->elems[(ptr >= q->fifo_size) ? (ptr - q->fifo_size) : ptr];
+  }
+  return ret;
+}
+
+// hands the cnt oldest elements back to the producer
+void can_commit(can_ring *q, uint32_t cnt) {
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t n = MIN(cnt, can_ring_used(q, r_ptr, q->w_ptr));
+
+  // elements have to be read out before the slots are handed back
+  __DMB();
+  q->r_ptr = ((r_ptr + n) >= q->fifo_size) ? (r_ptr + n - q->fifo_size) : (r_ptr + n);
+}
+
+static uint32_t can_packed_ring_used(const can_packed_ring *q, uint32_t r_ptr, uint32_t w_ptr) {
+  return (w_ptr >= r_ptr) ? (w_ptr - r_ptr) : (q->size - r_ptr + w_ptr);
+}
+
+// CAN packet version spoken with the host, it picks one through the packet versions request
+uint8_t can_packet_version = CAN_PACKET_VERSION_MIN;
+
+// header length on the wire, including the timestamp from v5 on
+uint32_t can_wire_head_size(void) {
+  return (can_packet_version >= 5U) ? (CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE) : CANPACKET_HEAD_SIZE;
+}
+
+static uint32_t can_packed_write(can_packed_ring *q, uint32_t w_ptr, const uint8_t *src, uint32_t len) {
+  uint32_t first = MIN(len, q->size - w_ptr);
+  (void)memcpy(&q->data[w_ptr], src, first);
+  (void)memcpy(q->data, &src[first], len - first);
+  return ((w_ptr + len) >= q->size) ? (w_ptr + len - q->size) : (w_ptr + len);
+}
+
+bool can_packed_push(can_packed_ring *q, const CANPacket_t *elem) {
+  bool ret = false;
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t r_ptr = q->r_ptr;
+  // don't overwrite any bytes before the r_ptr that freed them
+  __DMB();
+
+  // the packet's memory layout is its v4 wire format, v5 adds the timestamp after the header
+  uint32_t head_len = can_wire_head_size();
+  uint32_t data_len = dlc_to_len[elem->data_len_code];
+  if ((q->size - 1U - can_packed_ring_used(q, r_ptr, w_ptr)) >= (head_len + data_len)) {
+    uint8_t head[CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE];
+    (void)memcpy(head, (const uint8_t *)elem, CANPACKET_HEAD_SIZE);
+    if (head_len > CANPACKET_HEAD_SIZE) {
+      WORD_TO_BYTE_ARRAY(&head[CANPACKET_HEAD_SIZE], elem->timestamp);
+    }
+    w_ptr = can_packed_write(q, w_ptr, head, head_len);
+    w_ptr = can_packed_write(q, w_ptr, elem->data, data_len);
+
+    // the whole packet has to be written before it's published
+    __DMB();
+    q->w_ptr = w_ptr;
+    ret = true;
+  }
+  return ret;
+}
+
+// returns the length of the oldest packet, 0 if there is none
+uint32_t can_packed_head_len(const can_packed_ring *q) {
+  uint32_t ret = 0U;
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t w_ptr = q->w_ptr;
+  // don't read the header before the w_ptr that published it
+  __DMB();
+
+  if (r_ptr != w_ptr) {
+    ret = can_wire_head_size() + dlc_to_len[(q->data[r_ptr] >> 4U)];
+  }
+  return ret;
+}
+
+// copies out and commits up to max_len bytes. packets are only published as
+// a whole, but may be split between two reads
+uint32_t can_packed_read(can_packed_ring *q, uint8_t *dst, uint32_t max_len) {
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t w_ptr = q->w_ptr;
+  // don't read any bytes before the w_ptr that published them
+  __DMB();
+
+  uint32_t len = MIN(can_packed_ring_used(q, r_ptr, w_ptr), max_len);
+  if (len > 0U) {
+    uint32_t first = MIN(len, q->size - r_ptr);
+    (void)memcpy(dst, &q->data[r_ptr], first);
+    (void)memcpy(&dst[first], q->data, len - first);
+
+    // bytes have to be read out before they are handed back
+    __DMB();
+    q->r_ptr = ((r_ptr + len) >= q->size) ? (r_ptr + len - q->size) : (r_ptr + len);
+  }
+  return len;
+}
+
+// the checksum is only filled in once the oldest packet, len bytes long, is about to go out
+void can_packed_set_checksum(can_packed_ring *q, uint32_t len) {
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t first = MIN(len, q->size - r_ptr);
+  uint32_t pos = r_ptr + CANPACKET_CHECKSUM_POS;
+  pos = (pos >= q->size) ? (pos - q->size) : pos;
+
+  uint8_t checksum = calculate_checksum(&q->data[r_ptr], first) ^ calculate_checksum(q->data, len - first);
+  // leave out whatever was in the checksum byte
+  q->data[pos] ^= checksum;
+}
+
+uint32_t can_packed_used(const can_packed_ring *q) {
+  return can_packed_ring_used(q, q->r_ptr, q->w_ptr);
+}
+
+// drops the len oldest bytes
+void can_packed_commit(can_packed_ring *q, uint32_t len) {
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t n = MIN(len, can_packed_ring_used(q, r_ptr, q->w_ptr));
+  q->r_ptr = ((r_ptr + n) >= q->size) ? (r_ptr + n - q->size) : (r_ptr + n);
+}
+
+// ********************* change-only RX *********************
+uint16_t can_delta_refresh_ms[CAN_RX_QUEUES_ARRAY_SIZE] = {0U, 0U, 0U};
+static can_delta_entry_t can_delta_table[CAN_DELTA_TABLE_SIZE];
+// frames held back since the bus' last status packet
+static uint32_t can_delta_suppressed[CAN_RX_QUEUES_ARRAY_SIZE] = {0U, 0U, 0U};
+static uint32_t can_delta_report_ts[CAN_RX_QUEUES_ARRAY_SIZE] = {0U, 0U, 0U};
+
+// 0 turns delta mode off
+void can_delta_set(uint8_t bus_number, uint16_t refresh_ms) {
+  if (bus_number < CAN_RX_QUEUES_ARRAY_SIZE) {
+    ENTER_CRITICAL();
+    can_delta_refresh_ms[bus_number] = refresh_ms;
+    can_delta_suppressed[bus_number] = 0U;
+    // the bus' IDs are marked removed instead of freed, so the probe sequences of
+    // other IDs that run past them stay intact. Every ID on the bus gets sent once more.
+    for (uint32_t i = 0U; i < CAN_DELTA_TABLE_SIZE; i++) {
+      if ((can_delta_table[i].key >> 30U) == (bus_number + 1U)) {
+        can_delta_table[i].key = CAN_DELTA_KEY_REMOVED;
+      }
+    }
+    EXIT_CRITICAL();
+  }
+}
+
+// ID tables are keyed by ID | extended << 29 | (bus + 1) << 30, 0 is never a key
+static uint32_t can_rx_key(uint32_t addr, bool extended, uint8_t bus_number) {
+  return addr | ((extended ? 1U : 0U) << 29U) | ((uint32_t)(bus_number + 1U) << 30U);
+}
+
+// first slot to probe for a key, the caller masks it to the table size
+static uint32_t can_rx_key_idx(uint32_t key) {
+  return (key * 2654435761U) >> 16U;
+}
+
+// whether the host gets to see a received frame
+static bool can_delta_pass(const CANPacket_t *to_push, uint8_t bus_number) {
+  bool ret = true;
+  uint32_t refresh_us = (uint32_t)can_delta_refresh_ms[bus_number] * 1000U;
+  if ((refresh_us > 0U) && (to_push->returned == 0U) && (to_push->rejected == 0U)) {
+    uint32_t key = can_rx_key(to_push->addr, to_push->extended != 0U, bus_number);
+    uint32_t idx = can_rx_key_idx(key);
+    uint32_t len = dlc_to_len[to_push->data_len_code];
+
+    // the key's slot, or the first one it can take
+    can_delta_entry_t *entry = NULL;
+    bool found = false;
+    bool end = false;
+    for (uint32_t i = 0U; (i < CAN_DELTA_PROBE_MAX) && !found && !end; i++) {
+      can_delta_entry_t *slot = &can_delta_table[(idx + i) & (CAN_DELTA_TABLE_SIZE - 1U)];
+      if (slot->key == key) {
+        entry = slot;
+        found = true;
+      } else if (slot->key == 0U) {
+        entry = (entry == NULL) ? slot : entry;
+        end = true;
+      } else if ((entry == NULL) && (slot->key == CAN_DELTA_KEY_REMOVED)) {
+        entry = slot;
+      } else {
+        // another ID
+      }
+    }
+
+    if (entry != NULL) {
+      if (found && (len <= CAN_DELTA_DATA_SIZE) && (entry->data_len_code == to_push->data_len_code) &&
+          (memcmp(entry->data, to_push->data, len) == 0) && (get_ts_elapsed(to_push->timestamp, entry->sent_ts) < refresh_us)) {
+        ret = false;
+      } else {
+        entry->key = key;
+        entry->data_len_code = to_push->data_len_code;
+        (void)memcpy(entry->data, to_push->data, MIN(len, CAN_DELTA_DATA_SIZE));
+        entry->sent_ts = to_push->timestamp;
+      }
+    }
+  }
+  return ret;
+}
+
+// tells the host how many frames were held back, ahead of the next one it gets
+static void can_delta_report(uint8_t bus_number, uint32_t now) {
+  if ((can_delta_suppressed[bus_number] > 0U) && (get_ts_elapsed(now, can_delta_report_ts[bus_number]) >= CAN_DELTA_REPORT_INTERVAL)) {
+    CANPacket_t status = {0};
+    status.addr = CAN_DELTA_STATUS_ADDR;
+    status.bus = CAN_DELTA_STATUS_BUS + bus_number;
+    status.data_len_code = 4U;
+    status.timestamp = now;
+    WORD_TO_BYTE_ARRAY(status.data, can_delta_suppressed[bus_number]);
+    if (can_packed_push(can_rx_queues[bus_number], &status)) {
+      can_delta_suppressed[bus_number] = 0U;
+      can_delta_report_ts[bus_number] = now;
+    }
+  }
+}
+
+// ********************* RX subscriptions *********************
+// the host uploads into the staging table, the RX interrupts only see committed subscriptions
+static can_sub_t can_subs_staged[CAN_SUB_CNT_MAX];
+static can_sub_t can_sub_table[CAN_SUB_TABLE_SIZE];
+static uint32_t can_sub_cnt = 0U;
+static uint8_t can_sub_only_mask = 0U;
+
+// [selector, index of the first subscription, subscriptions...]
+void can_sub_write(const uint8_t *data, uint32_t len) {
+  if (len >= 2U) {
+    uint32_t idx = data[1];
+    for (uint32_t pos = 2U; ((pos + CAN_SUB_EP2_ENTRY_SIZE) <= len) && (idx < CAN_SUB_CNT_MAX); pos += CAN_SUB_EP2_ENTRY_SIZE) {
+      can_sub_t *sub = &can_subs_staged[idx];
+      uint32_t addr;
+      BYTE_ARRAY_TO_WORD(addr, &data[pos + 2U]);
+      sub->key = (data[pos + 1U] < PANDA_BUS_CNT) ? can_rx_key(addr & 0x1FFFFFFFU, (data[pos] & CAN_SUB_FLAG_EXTENDED) != 0U, data[pos + 1U]) : 0U;
+      sub->interval = (uint32_t)(data[pos + 6U] | (data[pos + 7U] << 8U)) * 1000U;
+      idx++;
+    }
+  }
+}
+
+// the slot holding key, or the free slot it would go into
+static can_sub_t *can_sub_find(uint32_t key) {
+  uint32_t idx = can_rx_key_idx(key);
+  can_sub_t *sub = &can_sub_table[idx & (CAN_SUB_TABLE_SIZE - 1U)];
+  while ((sub->key != key) && (sub->key != 0U)) {
+    idx++;
+    sub = &can_sub_table[idx & (CAN_SUB_TABLE_SIZE - 1U)];
+  }
+  return sub;
+}
+
+// activates the first cnt staged subscriptions, buses in only_mask drop everything else
+void can_subs_apply(uint32_t cnt, uint8_t only_mask) {
   ENTER_CRITICAL();
-  if (q->w_ptr >= q->r_ptr) {
-    ret = q->fifo_size - 1U - q->w_ptr + q->r_ptr;
-  } else {
-    ret = q->r_ptr - q->w_ptr - 1U;
+  (void)memset(can_sub_table, 0, sizeof(can_sub_table));
+  can_sub_cnt = 0U;
+  for (uint32_t i = 0U; i < MIN(cnt, CAN_SUB_CNT_MAX); i++) {
+    if (can_subs_staged[i].key != 0U) {
+      can_sub_t *sub = can_sub_find(can_subs_staged[i].key);
+      sub->key = can_subs_staged[i].key;
+      sub->interval = can_subs_staged[i].interval;
+      sub->sent = false;
+      can_sub_cnt += 1U;
+    }
   }
+  can_sub_only_mask = only_mask;
   EXIT_CRITICAL();
+}
 
+// whether the host is subscribed to a received frame
+static bool can_sub_pass(const CANPacket_t *to_push, uint8_t bus_number) {
+  bool ret = true;
+  if (((can_sub_cnt > 0U) || (can_sub_only_mask != 0U)) && (to_push->returned == 0U) && (to_push->rejected == 0U)) {
+    can_sub_t *sub = can_sub_find(can_rx_key(to_push->addr, to_push->extended != 0U, bus_number));
+    if (sub->key == 0U) {
+      ret = ((can_sub_only_mask >> bus_number) & 1U) == 0U;
+    } else if (sub->sent && (get_ts_elapsed(to_push->timestamp, sub->sent_ts) < sub->interval)) {
+      ret = false;
+    } else {
+      sub->sent = true;
+      sub->sent_ts = to_push->timestamp;
+    }
+  }
   return ret;
 }
 
+// queue a packet for the host, each bus has its own ring so a flooded bus
+// can't crowd out the others
+void can_rx_push(const CANPacket_t *to_push) {
+  uint8_t bus_number = GET_BUS(to_push);
+  bus_number = MIN(bus_number, CAN_RX_QUEUES_ARRAY_SIZE - 1U);
+#ifndef PANDA_JUNGLE
+  // ISO-TP channels take their frames, the host gets whole PDUs instead
+  bool taken = isotp_rx(to_push);
+#else
+  bool taken = false;
+#endif
+  if (taken || !can_sub_pass(to_push, bus_number)) {
+    // the host doesn't want it
+  } else if (can_delta_pass(to_push, bus_number)) {
+    can_delta_report(bus_number, to_push->timestamp);
+    if (!can_packed_push(can_rx_queues[bus_number], to_push)) {
+      rx_buffer_overflow += 1U;
+      can_health[bus_number].total_rx_overflow_cnt += 1U;
+      #ifdef DEBUG
+        print("can_push to can_rx"); puth(bus_number + 1U); print("_q failed!\n");
+      #endif
+    }
+  } else {
+    can_delta_suppressed[bus_number] += 1U;
+  }
+}
+
+// ********************* deferred RX *********************
+can_buffer(rx_stage_q, CAN_RX_STAGE_SIZE)
+
+uint8_t can_tx_report[CAN_RX_QUEUES_ARRAY_SIZE] = {CAN_TX_REPORT_FULL, CAN_TX_REPORT_FULL, CAN_TX_REPORT_FULL};
+
+void can_tx_report_set(uint8_t bus_number, uint8_t mode) {
+  if ((bus_number < CAN_RX_QUEUES_ARRAY_SIZE) && (mode <= CAN_TX_REPORT_NONE)) {
+    can_tx_report[bus_number] = mode;
+  }
+}
+
+// called from the CAN interrupts
+void can_rx_stage(const CANPacket_t *to_push) {
+  uint8_t tx_report = CAN_TX_REPORT_FULL;
+  if ((to_push->returned != 0U) && (to_push->bus < CAN_RX_QUEUES_ARRAY_SIZE)) {
+    tx_report = can_tx_report[to_push->bus];
+    if ((to_push->rejected != 0U) && (tx_report == CAN_TX_REPORT_NONE)) {
+      tx_report = CAN_TX_REPORT_COMPACT;
+    }
+  }
+
+  if (tx_report != CAN_TX_REPORT_NONE) {
+    bool pushed;
+    if (tx_report == CAN_TX_REPORT_COMPACT) {
+      CANPacket_t compact = *to_push;
+      compact.data_len_code = 0U;
+      pushed = can_push(&can_rx_stage_q, &compact);
+    } else {
+      pushed = can_push(&can_rx_stage_q, to_push);
+    }
+    if (!pushed) {
+      rx_buffer_overflow += 1U;
+      can_health[CAN_NUM_FROM_BUS_NUM(to_push->bus)].total_rx_lost_cnt += 1U;
+    }
+    NVIC_SetPendingIRQ(CAN_RX_SWI_IRQ);
+  }
+}
+
+// a TX safety check from the handling of a frame, e.g. an ISO-TP flow control frame,
+// comes after the frame it answers, the hooks don't catch up from in there
+static bool can_rx_handling = false;
+// frames at the head of the staging queue the safety and ignition hooks have seen already
+static uint32_t can_rx_stage_seen = 0U;
+
+static void can_rx_hooks(CANPacket_t *to_push, bool fast_path) {
+  uint8_t can_number = CAN_NUM_FROM_BUS_NUM(to_push->bus);
+  safety_rx_invalid += safety_rx_hook(to_push) ? 0U : 1U;
+  ignition_can_hook(to_push);
+
+  // from the frame coming out of the hardware to the safety hook having seen it
+  uint16_t latency = MIN(get_ts_elapsed(microsecond_timer_get(), to_push->timestamp), 0xFFFFU);
+  if (fast_path) {
+    can_health[can_number].rx_fifo1_max_latency = MAX(can_health[can_number].rx_fifo1_max_latency, latency);
+  } else {
+    can_health[can_number].rx_max_latency = MAX(can_health[can_number].rx_max_latency, latency);
+  }
+}
+
+// forwards a frame, runs the hooks on it unless they've seen it and queues it for the host
+static void can_rx_finish(CANPacket_t *to_push, bool fast_path, bool hooked) {
+  ENTER_CRITICAL();
+  can_rx_handling = true;
+  if (to_push->returned == 0U) {
+    can_forward(to_push, CAN_NUM_FROM_BUS_NUM(to_push->bus));
+    if (!hooked) {
+      can_rx_hooks(to_push, fast_path);
+    }
+    led_set(LED_BLUE, true);
+  }
+  can_rx_push(to_push);
+  can_rx_handling = false;
+  EXIT_CRITICAL();
+}
+
+void can_rx_handle(CANPacket_t *to_push, bool fast_path) {
+  can_rx_finish(to_push, fast_path, false);
+}
+
+// the software interrupt, taking a frame and handling it is one critical section
+void can_rx_bottom_half(void) {
+  bool pending = true;
+  while (pending) {
+    CANPacket_t to_push;
+    ENTER_CRITICAL();
+    pending = can_pop(&can_rx_stage_q, &to_push);
+    if (pending) {
+      bool hooked = (can_rx_stage_seen > 0U);
+      can_rx_stage_seen -= hooked ? 1U : 0U;
+      can_rx_finish(&to_push, false, hooked);
+    }
+    EXIT_CRITICAL();
+  }
+}
+
+// Run ahead of every TX safety check. Only the safety and ignition hooks run here, on the
+// frames staged before the check that they haven't seen yet, forwarding and queueing them
+// for the host is left to the bottom half.
+void can_rx_hooks_catch_up(void) {
+  ENTER_CRITICAL();
+  uint32_t cnt = can_rx_handling ? 0U : (can_slots_used(&can_rx_stage_q) - can_rx_stage_seen);
+  EXIT_CRITICAL();
+  for (uint32_t i = 0U; i < cnt; i++) {
+    ENTER_CRITICAL();
+    const CANPacket_t *staged = can_peek(&can_rx_stage_q, can_rx_stage_seen);
+    if (staged != NULL) {
+      CANPacket_t to_push = *staged;
+      if (to_push.returned == 0U) {
+        can_rx_hooks(&to_push, false);
+      }
+      can_rx_stage_seen += 1U;
+    }
+    EXIT_CRITICAL();
+  }
+}
+
 void can_clear(can_ring *q) {
   ENTER_CRITICAL();
   q->w_ptr = 0;
@@ -127,14 +590,17 @@ void can_clear(can_ring *q) {
 // bus_lookup: Translates from 'can number' to 'bus number'.
 // can_num_lookup: Translates from 'bus number' to 'can number'.
 // forwarding bus: If >= 0, forward all messages from this bus to the specified bus.
+// tx_id_priority: If true, pending hardware TX buffers go out by CAN ID priority instead of in queue order.
+// tx_buf_cnt: Hardware TX buffers kept loaded from the TX queue, 1 to CAN_TX_BUF_CNT_MAX.
+// rx_watermark: If > 0, RX interrupts are coalesced until this many frames wait or rx_coalesce_timeout us are over (FDCAN only).
 
 // Helpers
 // Panda:       Bus 0=CAN1   Bus 1=CAN2   Bus 2=CAN3
 bus_config_t bus_config[BUS_CONFIG_ARRAY_SIZE] = {
-  { .bus_lookup = 0U, .can_num_lookup = 0U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
-  { .bus_lookup = 1U, .can_num_lookup = 1U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
-  { .bus_lookup = 2U, .can_num_lookup = 2U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
-  { .bus_lookup = 0xFFU, .can_num_lookup = 0xFFU, .forwarding_bus = -1, .can_speed = 333U, .can_data_speed = 333U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
+  { .bus_lookup = 0U, .can_num_lookup = 0U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_id_priority = false, .tx_buf_cnt = CAN_TX_BUF_CNT_DEFAULT, .rx_watermark = 0U, .rx_coalesce_timeout = 0U },
+  { .bus_lookup = 1U, .can_num_lookup = 1U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_id_priority = false, .tx_buf_cnt = CAN_TX_BUF_CNT_DEFAULT, .rx_watermark = 0U, .rx_coalesce_timeout = 0U },
+  { .bus_lookup = 2U, .can_num_lookup = 2U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_id_priority = false, .tx_buf_cnt = CAN_TX_BUF_CNT_DEFAULT, .rx_watermark = 0U, .rx_coalesce_timeout = 0U },
+  { .bus_lookup = 0xFFU, .can_num_lookup = 0xFFU, .forwarding_bus = -1, .can_speed = 333U, .can_data_speed = 333U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_id_priority = false, .tx_buf_cnt = CAN_TX_BUF_CNT_DEFAULT, .rx_watermark = 0U, .rx_coalesce_timeout = 0U },
 };
 
 void can_init_all(void) {
@@ -142,7 +608,7 @@ void can_init_all(void) {
     if (!current_board->has_canfd) {
       bus_config[i].can_data_speed = 0U;
     }
-    can_clear(can_queues[i]);
+    can_tx_clear(i);
     (void)can_init(i);
   }
 }
@@ -160,6 +626,124 @@ void can_set_forwarding(uint8_t from, uint8_t to) {
 }
 #endif
 
+can_filter_config_t can_filter_config[BUS_CONFIG_ARRAY_SIZE];
+
+// the host uploads into the staging table, the RX interrupts only see committed routes
+static can_route_t can_routes_staged[CAN_ROUTE_CNT_MAX];
+static can_route_t can_routes[CAN_ROUTE_CNT_MAX];
+uint32_t can_route_cnt = 0U;
+uint32_t can_route_hits[CAN_ROUTE_CNT_MAX];
+
+// [selector, bus, index of the first element, elements...]
+void can_filter_write(const uint8_t *data, uint32_t len) {
+  if (len >= 3U) {
+    uint8_t bus_number = data[1];
+    uint32_t idx = data[2];
+    if (bus_number < BUS_CONFIG_ARRAY_SIZE) {
+      for (uint32_t pos = 3U; ((pos + CAN_FILTER_EP2_ENTRY_SIZE) <= len) && (idx < CAN_FILTER_CNT_MAX); pos += CAN_FILTER_EP2_ENTRY_SIZE) {
+        can_filter_t *filter = &can_filter_config[bus_number].filters[idx];
+        filter->flags = data[pos];
+        BYTE_ARRAY_TO_WORD(filter->id1, &data[pos + 1U]);
+        BYTE_ARRAY_TO_WORD(filter->id2, &data[pos + 5U]);
+        idx++;
+      }
+    }
+  }
+}
+
+// Frames forwarded to another bus can't be filtered, whatever is on the other side needs all of them.
+// The safety models only forward between bus 0 and 2.
+bool can_filter_bypassed(uint8_t bus_number) {
+  bool safety_fwd = (bus_number != 1U) &&
+                    (current_safety_mode != SAFETY_SILENT) &&
+                    (current_safety_mode != SAFETY_NOOUTPUT) &&
+                    (current_safety_mode != SAFETY_ELM327);
+  bool route_fwd = false;
+  for (uint32_t i = 0U; i < can_route_cnt; i++) {
+    route_fwd |= (can_routes[i].src_bus == bus_number) && ((can_routes[i].flags & CAN_ROUTE_FLAG_BLOCK) == 0U);
+  }
+  return safety_fwd || route_fwd || (bus_config[CAN_NUM_FROM_BUS_NUM(bus_number)].forwarding_bus != -1);
+}
+
+// [selector, index of the first route, routes...]
+void can_route_write(const uint8_t *data, uint32_t len) {
+  if (len >= 2U) {
+    uint32_t idx = data[1];
+    for (uint32_t pos = 2U; ((pos + CAN_ROUTE_EP2_ENTRY_SIZE) <= len) && (idx < CAN_ROUTE_CNT_MAX); pos += CAN_ROUTE_EP2_ENTRY_SIZE) {
+      can_route_t *route = &can_routes_staged[idx];
+      route->flags = data[pos];
+      route->src_bus = data[pos + 1U];
+      route->dst_bus = data[pos + 2U];
+      BYTE_ARRAY_TO_WORD(route->id, &data[pos + 3U]);
+      BYTE_ARRAY_TO_WORD(route->mask, &data[pos + 7U]);
+      // keeps its index, but can't match
+      bool blocking = (route->flags & CAN_ROUTE_FLAG_BLOCK) != 0U;
+      if ((route->src_bus >= PANDA_BUS_CNT) || (!blocking && (route->dst_bus >= PANDA_BUS_CNT))) {
+        route->src_bus = CAN_ROUTE_BUS_INVALID;
+      }
+      idx++;
+    }
+  }
+}
+
+// activates the first cnt staged routes and restarts their hit counters
+void can_routes_apply(uint32_t cnt) {
+  ENTER_CRITICAL();
+  can_route_cnt = MIN(cnt, CAN_ROUTE_CNT_MAX);
+  (void)memcpy(can_routes, can_routes_staged, can_route_cnt * sizeof(can_route_t));
+  (void)memset(can_route_hits, 0, sizeof(can_route_hits));
+  EXIT_CRITICAL();
+}
+
+static bool can_route_match(const can_route_t *route, uint8_t bus_number, const CANPacket_t *pkt) {
+  bool extended = (route->flags & CAN_ROUTE_FLAG_EXTENDED) != 0U;
+  return (route->src_bus == bus_number) && (extended == (pkt->extended != 0U)) &&
+         ((pkt->addr & route->mask) == (route->id & route->mask));
+}
+
+// forwarding (panda only), called from the RX interrupts for every received frame
+void can_forward(CANPacket_t *to_push, uint8_t can_number) {
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  int bus_fwd_num = safety_fwd_hook(bus_number, to_push->addr);
+  if (bus_fwd_num < 0) {
+    bus_fwd_num = bus_config[can_number].forwarding_bus;
+  }
+  bool allowed = true;
+
+  for (uint32_t i = 0U; i < can_route_cnt; i++) {
+    const can_route_t *route = &can_routes[i];
+    if (can_route_match(route, bus_number, to_push)) {
+      can_route_hits[i] += 1U;
+      if ((route->flags & CAN_ROUTE_FLAG_BLOCK) != 0U) {
+        bus_fwd_num = -1;
+      } else if ((int)route->dst_bus != bus_fwd_num) {
+        // anywhere the safety model doesn't forward to is checked like a frame from the host
+        CANPacket_t to_check = *to_push;
+        to_check.bus = route->dst_bus;
+        bus_fwd_num = route->dst_bus;
+        allowed = safety_tx_hook(&to_check) != 0;
+      } else {
+      }
+      break;
+    }
+  }
+
+  if (bus_fwd_num != -1) {
+    if (!allowed) {
+      safety_tx_blocked += 1U;
+    } else {
+      // skip the TX queue when the destination has a free hardware buffer
+      if (!can_tx_direct((uint8_t)bus_fwd_num, to_push)) {
+        can_send(to_push, (uint8_t)bus_fwd_num, true);
+      }
+      can_health[can_number].total_fwd_cnt += 1U;
+    }
+  }
+}
+
+// bus 0 frames ignition_can_hook looks at
+const uint32_t ignition_can_addrs[IGNITION_CAN_ADDRS_CNT] = {0x1F1U, 0x152U, 0x221U, 0x9EU};
+
 void ignition_can_hook(CANPacket_t *to_push) {
   int bus = GET_BUS(to_push);
   if (bus == 0) {
@@ -211,11 +795,102 @@ void ignition_can_hook(CANPacket_t *to_push) {
   }
 }
 
-bool can_tx_check_min_slots_free(uint32_t min) {
-  return
-    (can_slots_empty(&can_tx1_q) >= min) &&
-    (can_slots_empty(&can_tx2_q) >= min) &&
-    (can_slots_empty(&can_tx3_q) >= min);
+// ********************* bus load *********************
+static can_bus_load_t can_bus_load[CAN_HEALTH_ARRAY_SIZE];
+
+// bits of the frame on the wire before and after BRS, dynamic stuff bits are taken as half the worst case
+static void can_frame_bits(const CANPacket_t *pkt, uint32_t *nominal_bits, uint32_t *fast_bits) {
+  uint32_t data_bits = 8U * dlc_to_len[pkt->data_len_code];
+  if (pkt->fd == 0U) {
+    // SOF, arbitration and control fields, data and CRC are stuffed, the rest is fixed
+    uint32_t stuffed = ((pkt->extended != 0U) ? 54U : 34U) + data_bits;
+    *nominal_bits = stuffed + (stuffed / 8U) + CAN_FRAME_TAIL_BITS;
+    *fast_bits = 0U;
+  } else {
+    // up to BRS at the nominal rate. ESI, DLC and data are stuffed, then the stuff
+    // count and CRC have a fixed stuff bit every 4 bits
+    uint32_t arbitration = (pkt->extended != 0U) ? 36U : 17U;
+    uint32_t control = 5U + data_bits;
+    uint32_t crc = (dlc_to_len[pkt->data_len_code] > 16U) ? 32U : 27U;
+    *nominal_bits = arbitration + (arbitration / 8U) + CAN_FRAME_TAIL_BITS;
+    *fast_bits = control + (control / 8U) + crc;
+  }
+}
+
+// time the frame takes on the wire in 0.1 us
+static uint32_t can_frame_time(uint8_t bus_number, const CANPacket_t *pkt, bool brs) {
+  uint32_t nominal_bits;
+  uint32_t fast_bits;
+  can_frame_bits(pkt, &nominal_bits, &fast_bits);
+
+  uint32_t speed = bus_config[bus_number].can_speed;
+  uint32_t data_speed = brs ? bus_config[bus_number].can_data_speed : speed;
+  uint32_t ret = 0U;
+  if ((speed > 0U) && (data_speed > 0U)) {
+    // speeds are in 100 bps
+    ret = ((nominal_bits * 100000U) / speed) + ((fast_bits * 100000U) / data_speed);
+  }
+  return ret;
+}
+
+// closes the windows that are over, missed ones had an idle bus
+void can_bus_load_update(uint8_t can_number) {
+  can_bus_load_t *load = &can_bus_load[can_number];
+  uint32_t elapsed = get_ts_elapsed(microsecond_timer_get(), load->window_start) / CAN_BUS_LOAD_WINDOW;
+  if (elapsed > 0U) {
+    load->window_start += elapsed * CAN_BUS_LOAD_WINDOW;
+    for (uint32_t i = 0U; i < MIN(elapsed, CAN_BUS_LOAD_WINDOW_CNT); i++) {
+      load->window_idx = (load->window_idx + 1U) % CAN_BUS_LOAD_WINDOW_CNT;
+      load->windows[load->window_idx] = MIN(load->busy / (CAN_BUS_LOAD_WINDOW / 100U), 1000U);
+      load->busy = 0U;
+    }
+
+    uint32_t sum = 0U;
+    for (uint32_t i = 0U; i < CAN_BUS_LOAD_WINDOW_CNT; i++) {
+      sum += load->windows[i];
+    }
+    can_health_t *health = &can_health[can_number];
+    health->bus_load_100ms = load->windows[load->window_idx];
+    health->bus_load_1s = sum / CAN_BUS_LOAD_WINDOW_CNT;
+    health->bus_load_100ms_peak = MAX(health->bus_load_100ms_peak, health->bus_load_100ms);
+    health->bus_load_1s_peak = MAX(health->bus_load_1s_peak, health->bus_load_1s);
+  }
+}
+
+// brs: the data phase went at the data rate
+void can_bus_load_add(uint8_t can_number, const CANPacket_t *pkt, bool brs) {
+  can_bus_load_update(can_number);
+  can_bus_load[can_number].busy += can_frame_time(BUS_NUM_FROM_CAN_NUM(can_number), pkt, brs);
+}
+
+// last time the TX queues of each bus were empty or got a frame out
+static uint32_t can_tx_progress_r_ptr[CAN_QUEUES_ARRAY_SIZE];
+static uint32_t can_tx_progress_ts[CAN_QUEUES_ARRAY_SIZE];
+
+// A queue with frames that hasn't moved for CAN_TX_STALL_TIMEOUT is stuck, e.g. nothing on the bus ACKs
+bool can_tx_stalled(uint8_t bus_number) {
+  // the normal queue doesn't move while the high priority one drains
+  uint32_t r_ptr = can_queues[bus_number]->r_ptr | (can_hp_queues[bus_number]->r_ptr << 16);
+  uint32_t now = microsecond_timer_get();
+  if ((r_ptr != can_tx_progress_r_ptr[bus_number]) || (can_tx_queued(bus_number) == 0U)) {
+    can_tx_progress_r_ptr[bus_number] = r_ptr;
+    can_tx_progress_ts[bus_number] = now;
+  }
+  return get_ts_elapsed(now, can_tx_progress_ts[bus_number]) >= CAN_TX_STALL_TIMEOUT;
+}
+
+// Host writes are held back only while none of the buses in the mask can take a whole transfer,
+// or is stuck. A full bus doesn't hold back writes for the others, the frames that don't fit
+// its queue come back failed instead.
+bool can_tx_check_min_slots_free(uint32_t min, uint8_t buses) {
+  bool ret = (buses == 0U);
+  for (uint8_t bus_number = 0U; bus_number < CAN_QUEUES_ARRAY_SIZE; bus_number++) {
+    bool stalled = can_tx_stalled(bus_number);
+    if ((buses & (1U << bus_number)) != 0U) {
+      ret = ret || (can_slots_empty(can_queues[bus_number]) >= min) || stalled;
+    }
+  }
+  return ret;
 }
 
 uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
@@ -226,30 +901,363 @@ uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
   return checksum;
 }
 
-void can_set_checksum(CANPacket_t *packet) {
-  packet->checksum = 0U;
-  packet->checksum = calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet));
+// ********************* TX priority classes *********************
+static can_tx_prio_t can_tx_prios_staged[CAN_TX_PRIO_CNT_MAX];
+static can_tx_prio_t can_tx_prios[CAN_TX_PRIO_CNT_MAX];
+static uint32_t can_tx_prio_cnt = 0U;
+
+// [selector, index of the first range, ranges...]
+void can_tx_prio_write(const uint8_t *data, uint32_t len) {
+  if (len >= 2U) {
+    uint32_t idx = data[1];
+    for (uint32_t pos = 2U; ((pos + CAN_TX_PRIO_EP2_ENTRY_SIZE) <= len) && (idx < CAN_TX_PRIO_CNT_MAX); pos += CAN_TX_PRIO_EP2_ENTRY_SIZE) {
+      can_tx_prio_t *prio = &can_tx_prios_staged[idx];
+      prio->flags = data[pos];
+      prio->bus = data[pos + 1U];
+      BYTE_ARRAY_TO_WORD(prio->id_lo, &data[pos + 2U]);
+      BYTE_ARRAY_TO_WORD(prio->id_hi, &data[pos + 6U]);
+      idx++;
+    }
+  }
 }
 
-bool can_check_checksum(CANPacket_t *packet) {
-  return (calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet)) == 0U);
+void can_tx_prios_apply(uint32_t cnt) {
+  ENTER_CRITICAL();
+  can_tx_prio_cnt = MIN(cnt, CAN_TX_PRIO_CNT_MAX);
+  (void)memcpy(can_tx_prios, can_tx_prios_staged, can_tx_prio_cnt * sizeof(can_tx_prio_t));
+  EXIT_CRITICAL();
+}
+
+// the queue of the class a frame belongs to
+static can_ring *can_tx_queue(uint8_t bus_number, const CANPacket_t *pkt) {
+  can_ring *ret = can_queues[bus_number];
+  for (uint32_t i = 0U; i < can_tx_prio_cnt; i++) {
+    const can_tx_prio_t *prio = &can_tx_prios[i];
+    bool extended = (prio->flags & CAN_TX_PRIO_FLAG_EXTENDED) != 0U;
+    if ((prio->bus == bus_number) && (extended == (pkt->extended != 0U)) && (pkt->addr >= prio->id_lo) && (pkt->addr <= prio->id_hi)) {
+      ret = can_hp_queues[bus_number];
+      break;
+    }
+  }
+  return ret;
+}
+
+static void can_tx_overflow(uint8_t bus_number, const can_ring *q, uint32_t cnt) {
+  tx_buffer_overflow += cnt;
+  if (q == can_hp_queues[bus_number]) {
+    can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_hp_overflow_cnt += cnt;
+  } else {
+    can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_overflow_cnt += cnt;
+  }
+}
+
+uint32_t can_tx_queued(uint8_t bus_number) {
+  return can_slots_used(can_hp_queues[bus_number]) + can_slots_used(can_queues[bus_number]);
+}
+
+// a frame from the host that doesn't fit its TX queue comes back failed, like one a core reset drops
+static void can_tx_reject(CANPacket_t *to_push) {
+  to_push->returned = 1U;
+  to_push->rejected = 1U;
+  to_push->timestamp = microsecond_timer_get();
+  can_rx_push(to_push);
+}
+
+void can_tx_clear(uint8_t bus_number) {
+  can_clear(can_hp_queues[bus_number]);
+  can_clear(can_queues[bus_number]);
 }
 
 void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
+  if (!skip_tx_hook) {
+    can_rx_hooks_catch_up();
+  }
   if (skip_tx_hook || safety_tx_hook(to_push) != 0) {
     if (bus_number < PANDA_BUS_CNT) {
       // add CAN packet to send queue
-      tx_buffer_overflow += can_push(can_queues[bus_number], to_push) ? 0U : 1U;
+      can_ring *q = can_tx_queue(bus_number, to_push);
+      if (!can_push(q, to_push)) {
+        can_tx_overflow(bus_number, q, 1U);
+        if (!skip_tx_hook) {
+          can_tx_reject(to_push);
+        }
+      }
       process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
     }
   } else {
     safety_tx_blocked += 1U;
     to_push->returned = 0U;
     to_push->rejected = 1U;
+    to_push->timestamp = microsecond_timer_get();
+    can_rx_push(to_push);
+  }
+}
+
+// ********************* TX flags *********************
+static can_tx_latest_t can_tx_latest[CAN_QUEUES_ARRAY_SIZE][CAN_TX_LATEST_INDEX_SIZE];
 
-    // data changed
-    can_set_checksum(to_push);
-    rx_buffer_overflow += can_push(&can_rx_q, to_push) ? 0U : 1U;
+static uint32_t can_tx_latest_key(const CANPacket_t *pkt) {
+  return pkt->addr | ((uint32_t)pkt->extended << 29) | (1UL << 30);
+}
+
+// the index only points at a slot, the frame there is checked before it's replaced,
+// it might have gone out with the slot reused since
+static bool can_tx_push_latest(uint8_t bus_number, can_ring *q, const CANPacket_t *to_push) {
+  uint32_t key = can_tx_latest_key(to_push);
+  can_tx_latest_t *entry = &can_tx_latest[bus_number][(to_push->addr ^ (to_push->addr >> 5)) & (CAN_TX_LATEST_INDEX_SIZE - 1U)];
+  bool ret = false;
+
+  ENTER_CRITICAL();
+  if (entry->key == key) {
+    CANPacket_t *queued = &q->elems[entry->slot];
+    bool queued_yet = can_ring_used(q, q->r_ptr, entry->slot) < can_ring_used(q, q->r_ptr, q->w_ptr);
+    if (queued_yet && (queued->returned != 0U) && (can_tx_latest_key(queued) == key)) {
+      *queued = *to_push;
+      can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_replaced_cnt += 1U;
+      ret = true;
+    }
+  }
+  if (!ret) {
+    uint32_t slot = q->w_ptr;
+    ret = can_push(q, to_push);
+    if (ret) {
+      entry->key = key;
+      entry->slot = slot;
+    }
+  }
+  EXIT_CRITICAL();
+  return ret;
+}
+
+void can_tx_deadline_from_host(CANPacket_t *pkt) {
+  if (pkt->rejected != 0U) {
+    pkt->timestamp = microsecond_timer_get() + (MIN(pkt->timestamp, CAN_TX_DEADLINE_MAX) * 1000U);
+  }
+}
+
+// ********************* driver timer *********************
+// no sooner than CAN_TIMER_GRANULARITY from now, which bounds the interrupt rate
+static uint32_t can_timer_clamp(uint32_t now, uint32_t deadline) {
+  uint32_t earliest = now + CAN_TIMER_GRANULARITY;
+  return ((int32_t)(deadline - earliest) < 0) ? earliest : deadline;
+}
+
+// Deadlines are armed in a critical section and at least a granularity out,
+// they can't pass before they're armed
+static void can_timer_arm(uint32_t deadline) {
+  uint32_t ts = can_timer_clamp(microsecond_timer_get(), deadline);
+  bool earlier = (int32_t)(ts - MICROSECOND_TIMER->CCR4) < 0;
+  if (((MICROSECOND_TIMER->DIER & TIM_DIER_CC4IE) == 0U) || earlier) {
+    MICROSECOND_TIMER->CCR4 = ts;
+    MICROSECOND_TIMER->DIER |= TIM_DIER_CC4IE;
+  }
+}
+
+// keeps the earliest of the deadlines still ahead
+static void can_timer_next(bool *armed, uint32_t *next, uint32_t deadline) {
+  if (!*armed || ((int32_t)(deadline - *next) < 0)) {
+    *armed = true;
+    *next = deadline;
+  }
+}
+
+// ********************* TX shaping *********************
+static can_tx_shaper_t can_tx_shapers[CAN_QUEUES_ARRAY_SIZE];
+
+void can_tx_shaper_set(uint8_t bus_number, uint8_t unit, uint16_t rate) {
+  can_tx_shaper_t *shaper = &can_tx_shapers[bus_number];
+  ENTER_CRITICAL();
+  shaper->unit = unit;
+  shaper->rate = rate;
+  shaper->depth = 0U;
+  if (rate > 0U) {
+    shaper->depth = (unit == CAN_TX_SHAPER_KBPS) ? ((CAN_TX_SHAPER_BURST_BITS * 1000U) / rate) : (((CAN_TX_SHAPER_BURST_FRAMES - 1U) * 1000000U) / rate);
+  }
+  shaper->credit = (int32_t)shaper->depth;
+  shaper->last_ts = microsecond_timer_get();
+  shaper->held = false;
+  shaper->wake = false;
+  EXIT_CRITICAL();
+  process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
+}
+
+// refills the bucket, if there's no credit for the next frame the queue is restarted once there is
+static bool can_tx_shaper_ready(uint8_t bus_number) {
+  can_tx_shaper_t *shaper = &can_tx_shapers[bus_number];
+  bool ret = true;
+  if (shaper->rate > 0U) {
+    uint32_t now = microsecond_timer_get();
+    uint32_t elapsed = MIN(get_ts_elapsed(now, shaper->last_ts), shaper->depth + CAN_TX_SHAPER_GRANULARITY);
+    shaper->last_ts = now;
+    shaper->credit = MIN(shaper->credit + (int32_t)elapsed, (int32_t)shaper->depth);
+
+    ret = (shaper->credit + (int32_t)CAN_TX_SHAPER_GRANULARITY) > 0;
+    if (!ret && (can_tx_queued(bus_number) > 0U)) {
+      if (!shaper->held) {
+        shaper->held = true;
+        shaper->held_ts = now;
+      }
+      shaper->wake = true;
+      shaper->wake_ts = now + (uint32_t)(-shaper->credit);
+      can_timer_arm(shaper->wake_ts);
+    }
+  }
+  return ret;
+}
+
+// takes what the frame is worth at the set rate
+static void can_tx_shaper_charge(uint8_t bus_number, const CANPacket_t *pkt) {
+  can_tx_shaper_t *shaper = &can_tx_shapers[bus_number];
+  if (shaper->rate > 0U) {
+    uint32_t cost;
+    if (shaper->unit == CAN_TX_SHAPER_KBPS) {
+      uint32_t nominal_bits;
+      uint32_t fast_bits;
+      can_frame_bits(pkt, &nominal_bits, &fast_bits);
+      cost = (((nominal_bits + fast_bits) * 1000U) + shaper->rate - 1U) / shaper->rate;
+    } else {
+      cost = (1000000U + shaper->rate - 1U) / shaper->rate;
+    }
+    shaper->credit -= (int32_t)cost;
+
+    if (shaper->held) {
+      can_health_t *health = &can_health[CAN_NUM_FROM_BUS_NUM(bus_number)];
+      health->total_tx_shaped_cnt += 1U;
+      health->tx_shaper_max_delay = MAX(health->tx_shaper_max_delay, get_ts_elapsed(microsecond_timer_get(), shaper->held_ts));
+      shaper->held = false;
+    }
+  }
+}
+
+// restarts the queues whose wait is over
+static void can_tx_shaper_poll(uint32_t now, bool *armed, uint32_t *next) {
+  for (uint8_t bus_number = 0U; bus_number < CAN_QUEUES_ARRAY_SIZE; bus_number++) {
+    can_tx_shaper_t *shaper = &can_tx_shapers[bus_number];
+    if (shaper->wake && ((int32_t)(now - shaper->wake_ts) >= 0)) {
+      // a full TX buffer leaves it to the TX complete interrupt
+      shaper->wake = false;
+      process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
+    }
+    if (shaper->wake) {
+      can_timer_next(armed, next, shaper->wake_ts);
+    }
+  }
+}
+
+// MICROSECOND_TIMER CC4 IRQ Handler
+void can_timer_irq_handler(void) {
+  // status bits are rc_w0
+  MICROSECOND_TIMER->SR = (uint32_t)~TIM_SR_CC4IF;
+
+  bool pending = true;
+  while (pending) {
+    uint32_t now = microsecond_timer_get();
+    bool armed = false;
+    uint32_t next = 0U;
+    can_tx_shaper_poll(now, &armed, &next);
+#ifdef STM32H7
+    can_rx_coalesce_poll(now, &armed, &next);
+#endif
+
+    pending = false;
+    if (armed) {
+      next = can_timer_clamp(now, next);
+      MICROSECOND_TIMER->CCR4 = next;
+      // the compare only fires on an exact match, go again if the deadline passed meanwhile
+      pending = ((int32_t)(microsecond_timer_get() - next) >= 0);
+    } else {
+      MICROSECOND_TIMER->DIER &= ~TIM_DIER_CC4IE;
+    }
+  }
+}
+
+// pops the next frame for a bus, high priority first, dropping those past their deadline.
+// Nothing comes out while the bus' shaper holds it back.
+bool can_tx_pop(uint8_t bus_number, CANPacket_t *to_send) {
+  bool ret = false;
+  bool ready = can_tx_shaper_ready(bus_number);
+  while (ready && !ret && (can_pop(can_hp_queues[bus_number], to_send) || can_pop(can_queues[bus_number], to_send))) {
+    if ((to_send->rejected != 0U) && ((int32_t)(microsecond_timer_get() - to_send->timestamp) > 0)) {
+      can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_stale_cnt += 1U;
+    } else {
+      ret = true;
+    }
+  }
+  if (ret) {
+    can_tx_shaper_charge(bus_number, to_send);
+  }
+  return ret;
+}
+
+// send a batch of packets, each on its own bus. consecutive packets
+// for the same bus are queued together and each bus is kicked once
+void can_send_many(CANPacket_t *to_push, uint32_t cnt, bool skip_tx_hook) {
+  if (!skip_tx_hook) {
+    can_rx_hooks_catch_up();
+  }
+  uint32_t run_start = 0U;
+  uint32_t run_len = 0U;
+  uint8_t run_bus = 0U;
+  can_ring *run_q = NULL;
+  uint8_t pending_buses = 0U;
+
+  for (uint32_t i = 0U; i <= cnt; i++) {
+    bool allowed = false;
+    bool latest = false;
+    uint8_t bus_number = 0U;
+    can_ring *q = NULL;
+    if (i < cnt) {
+      bus_number = to_push[i].bus;
+      allowed = skip_tx_hook || (safety_tx_hook(&to_push[i]) != 0);
+      latest = (to_push[i].returned != 0U);
+      if (allowed && (bus_number < PANDA_BUS_CNT)) {
+        q = can_tx_queue(bus_number, &to_push[i]);
+      }
+    }
+
+    // flush the current run once it's interrupted
+    if ((run_len > 0U) && (!allowed || latest || (q != run_q))) {
+      uint32_t pushed = can_push_many(run_q, &to_push[run_start], run_len);
+      can_tx_overflow(run_bus, run_q, run_len - pushed);
+      for (uint32_t j = pushed; (j < run_len) && !skip_tx_hook; j++) {
+        can_tx_reject(&to_push[run_start + j]);
+      }
+      pending_buses |= (1U << run_bus);
+      run_len = 0U;
+    }
+
+    if (i < cnt) {
+      if (allowed) {
+        if ((bus_number < PANDA_BUS_CNT) && latest) {
+          if (!can_tx_push_latest(bus_number, q, &to_push[i])) {
+            can_tx_overflow(bus_number, q, 1U);
+            if (!skip_tx_hook) {
+              can_tx_reject(&to_push[i]);
+            }
+          }
+          pending_buses |= (1U << bus_number);
+        } else if (bus_number < PANDA_BUS_CNT) {
+          if (run_len == 0U) {
+            run_start = i;
+            run_bus = bus_number;
+            run_q = q;
+          }
+          run_len += 1U;
+        }
+      } else {
+        safety_tx_blocked += 1U;
+        to_push[i].returned = 0U;
+        to_push[i].rejected = 1U;
+        to_push[i].timestamp = microsecond_timer_get();
+        can_rx_push(&to_push[i]);
+      }
+    }
+  }
+
+  for (uint8_t bus_number = 0U; bus_number < PANDA_BUS_CNT; bus_number++) {
+    if ((pending_buses & (1U << bus_number)) != 0U) {
+      process_can(CAN_NUM_FROM_BUS_NUM(bus_number));
+    }
   }
 }
 
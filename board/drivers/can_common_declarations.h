@@ -7,6 +7,14 @@ typedef struct {
   CANPacket_t *elems;
 } can_ring;
 
+// byte ring holding packets back to back in wire format
+typedef struct {
+  volatile uint32_t w_ptr;
+  volatile uint32_t r_ptr;
+  uint32_t size;
+  uint8_t *data;
+} can_packed_ring;
+
 typedef struct {
   uint8_t bus_lookup;
   uint8_t can_num_lookup;
@@ -17,6 +25,10 @@ typedef struct {
   bool canfd_enabled;
   bool brs_enabled;
   bool canfd_non_iso;
+  bool tx_id_priority;
+  uint8_t tx_buf_cnt;
+  uint8_t rx_watermark;
+  uint16_t rx_coalesce_timeout;
 } bus_config_t;
 
 extern uint32_t safety_tx_blocked;
@@ -46,15 +58,40 @@ void process_can(uint8_t can_number);
 // ********************* instantiate queues *********************
 #define CAN_QUEUES_ARRAY_SIZE 3
 extern can_ring *can_queues[CAN_QUEUES_ARRAY_SIZE];
+// high priority class of each bus, always drained first
+extern can_ring *can_hp_queues[CAN_QUEUES_ARRAY_SIZE];
+#define CAN_RX_QUEUES_ARRAY_SIZE 3U
+extern can_packed_ring *can_rx_queues[CAN_RX_QUEUES_ARRAY_SIZE];
 
 // helpers
 #define WORD_TO_BYTE_ARRAY(dst8, src32) 0[dst8] = ((src32) & 0xFFU); 1[dst8] = (((src32) >> 8U) & 0xFFU); 2[dst8] = (((src32) >> 16U) & 0xFFU); 3[dst8] = (((src32) >> 24U) & 0xFFU)
 #define BYTE_ARRAY_TO_WORD(dst32, src8) ((dst32) = 0[src8] | (1[src8] << 8U) | (2[src8] << 16U) | (3[src8] << 24U))
 
-// ********************* interrupt safe queue *********************
+// ********************* lock-free SPSC queue *********************
+// Each ring has a single producer (owns w_ptr) and a single consumer (owns r_ptr).
+// All panda IRQs but the CAN RX bottom half run at the same NVIC priority and never
+// preempt each other, so every ISR pushing into a ring counts as the same producer.
+// Code running outside of them, the bottom half included, must enter a critical
+// section to push/pop.
 bool can_pop(can_ring *q, CANPacket_t *elem);
 bool can_push(can_ring *q, const CANPacket_t *elem);
+uint32_t can_pop_many(can_ring *q, CANPacket_t *elems, uint32_t max_cnt);
+uint32_t can_push_many(can_ring *q, const CANPacket_t *elems, uint32_t cnt);
 uint32_t can_slots_empty(const can_ring *q);
+// zero-copy consumer access: peek at queued elements in place, then commit them
+const CANPacket_t *can_peek(const can_ring *q, uint32_t idx);
+void can_commit(can_ring *q, uint32_t cnt);
+uint32_t can_slots_used(const can_ring *q);
+// packed rings only take up CANPACKET_HEAD_SIZE + data length per packet,
+// the consumer reads them out as a plain byte stream
+bool can_packed_push(can_packed_ring *q, const CANPacket_t *elem);
+uint32_t can_packed_read(can_packed_ring *q, uint8_t *dst, uint32_t max_len);
+uint32_t can_packed_used(const can_packed_ring *q);
+uint32_t can_packed_head_len(const can_packed_ring *q);
+extern uint8_t can_packet_version;
+uint32_t can_wire_head_size(void);
+void can_packed_commit(can_packed_ring *q, uint32_t len);
+void can_packed_set_checksum(can_packed_ring *q, uint32_t len);
 
 // assign CAN numbering
 // bus num: CAN Bus numbers in panda, sent to/from USB
@@ -64,6 +101,9 @@ uint32_t can_slots_empty(const can_ring *q);
 // bus_lookup: Translates from 'can number' to 'bus number'.
 // can_num_lookup: Translates from 'bus number' to 'can number'.
 // forwarding bus: If >= 0, forward all messages from this bus to the specified bus.
+// tx_id_priority: If true, pending hardware TX buffers go out by CAN ID priority instead of in queue order.
+// tx_buf_cnt: Hardware TX buffers kept loaded from the TX queue, 1 to CAN_TX_BUF_CNT_MAX.
+// rx_watermark: If > 0, RX interrupts are coalesced until this many frames wait or rx_coalesce_timeout us are over (FDCAN only).
 
 // Helpers
 // Panda:       Bus 0=CAN1   Bus 1=CAN2   Bus 2=CAN3
@@ -74,15 +114,270 @@ extern bus_config_t bus_config[BUS_CONFIG_ARRAY_SIZE];
 #define BUS_NUM_FROM_CAN_NUM(num) (bus_config[num].bus_lookup)
 #define CAN_NUM_FROM_BUS_NUM(num) (bus_config[num].can_num_lookup)
 
+// ********************* host acceptance filters *********************
+// The host uploads filter elements over endpoint 2 (selector byte CAN_FILTER_EP2_SELECTOR),
+// then commits how many of them a bus uses. IDs needed by the safety model and the
+// ignition detection are always accepted on top of the host list.
+#define CAN_FILTER_EP2_SELECTOR 0x80U
+#define CAN_FILTER_EP2_ENTRY_SIZE 9U // flags, id1 and id2 as little endian words
+#define CAN_FILTER_CNT_MAX 16U
+
+// flags: bits 0-1 type, then extended ID, reject matching frames and the fast path
+#define CAN_FILTER_TYPE_RANGE 0U // id1 <= ID <= id2
+#define CAN_FILTER_TYPE_DUAL 1U  // ID == id1 or ID == id2
+#define CAN_FILTER_TYPE_MASK 2U  // (ID & id2) == (id1 & id2)
+#define CAN_FILTER_TYPE_BITS 0x3U
+#define CAN_FILTER_FLAG_EXTENDED 0x4U
+#define CAN_FILTER_FLAG_REJECT 0x8U
+// matching frames go to RX FIFO 1 and reach the safety hooks ahead of the rest,
+// also on buses that aren't filtered otherwise
+#define CAN_FILTER_FLAG_FIFO1 0x10U
+
+typedef struct {
+  uint8_t flags;
+  uint32_t id1;
+  uint32_t id2;
+} can_filter_t;
+
+typedef struct {
+  can_filter_t filters[CAN_FILTER_CNT_MAX];
+  uint8_t cnt; // elements in use
+  bool reject_default; // drop frames no element accepts
+} can_filter_config_t;
+
+extern can_filter_config_t can_filter_config[BUS_CONFIG_ARRAY_SIZE];
+void can_filter_write(const uint8_t *data, uint32_t len);
+bool can_filter_bypassed(uint8_t bus_number);
+
+// ********************* routing table *********************
+// Routes pick the destination of received frames by (bus, ID/mask), the first match wins.
+// The host uploads them over endpoint 2 (selector byte CAN_ROUTE_EP2_SELECTOR), then
+// commits how many are active. A route overrides what the safety model or the jungle
+// forward: blocking is always allowed, other destinations have to pass the TX hook.
+// Routes naming a bus that doesn't exist never match.
+#define CAN_ROUTE_EP2_SELECTOR 0x81U
+#define CAN_ROUTE_EP2_ENTRY_SIZE 11U // flags, source bus, destination bus, id and mask as little endian words
+#define CAN_ROUTE_CNT_MAX 16U
+
+#define CAN_ROUTE_FLAG_EXTENDED 0x1U
+#define CAN_ROUTE_FLAG_BLOCK 0x2U // don't forward matching frames at all
+#define CAN_ROUTE_BUS_INVALID 0xFFU
+
+typedef struct {
+  uint8_t flags;
+  uint8_t src_bus;
+  uint8_t dst_bus;
+  uint32_t id;
+  uint32_t mask;
+} can_route_t;
+
+extern uint32_t can_route_cnt;
+extern uint32_t can_route_hits[CAN_ROUTE_CNT_MAX];
+void can_route_write(const uint8_t *data, uint32_t len);
+void can_routes_apply(uint32_t cnt);
+void can_forward(CANPacket_t *to_push, uint8_t can_number);
+// loads a frame straight into a free hardware TX buffer, if nothing is queued ahead of it
+// and the bus' TX shaper has credit for it
+bool can_tx_direct(uint8_t bus_number, const CANPacket_t *to_send);
+
+// ********************* change-only RX *********************
+// In delta mode a bus only sends a frame to the host when its payload differs from the
+// last one sent for that ID, or once the refresh interval since then is over. The
+// firmware keeps the length and the first CAN_DELTA_DATA_SIZE bytes of the last payload
+// per ID, longer frames can't be compared and are always sent. Safety and forwarding
+// still see every frame. How many frames were held back goes in-band: a status packet on bus
+// CAN_DELTA_STATUS_BUS + the bus, which is never a real one, with ID CAN_DELTA_STATUS_ADDR
+// and the count as a little endian word, at most every CAN_DELTA_REPORT_INTERVAL ahead
+// of the next frame that's sent.
+#define CAN_DELTA_TABLE_SIZE 512U // IDs tracked over all buses, a power of two
+#define CAN_DELTA_PROBE_MAX 8U    // IDs that don't find a slot this close are always sent
+#define CAN_DELTA_REPORT_INTERVAL 100000U // us
+#define CAN_DELTA_STATUS_BUS 4U
+#define CAN_DELTA_STATUS_ADDR 0U
+#define CAN_DELTA_DATA_SIZE 8U
+#define CAN_DELTA_KEY_REMOVED 1U // never a real key, the bus bits are 0
+
+typedef struct {
+  uint32_t key;   // ID | extended << 29 | (bus + 1) << 30, 0 for a free slot
+  uint32_t sent_ts;
+  uint8_t data_len_code;  // of the payload last sent
+  uint8_t data[CAN_DELTA_DATA_SIZE];
+} can_delta_entry_t;
+
+extern uint16_t can_delta_refresh_ms[CAN_RX_QUEUES_ARRAY_SIZE];
+void can_delta_set(uint8_t bus_number, uint16_t refresh_ms);
+
+// ********************* RX subscriptions *********************
+// Subscriptions pick which received frames go to the host and how often, safety and
+// forwarding still see every frame. A subscribed ID is delivered at most once per its
+// interval, 0 for every frame. Buses in the subscribed-only mask drop all other IDs,
+// the rest deliver them as usual. The host uploads subscriptions over endpoint 2
+// (selector byte CAN_SUB_EP2_SELECTOR), then commits how many are active.
+#define CAN_SUB_EP2_SELECTOR 0x83U
+#define CAN_SUB_EP2_ENTRY_SIZE 8U // flags, bus, id as little endian word, interval_ms as little endian half word
+#define CAN_SUB_CNT_MAX 128U
+#define CAN_SUB_TABLE_SIZE 256U // a power of two, at most half full so lookups end at a free slot
+
+#define CAN_SUB_FLAG_EXTENDED 0x1U
+
+typedef struct {
+  uint32_t key;      // same as can_delta_entry_t, 0 for a free slot
+  uint32_t interval; // us
+  uint32_t sent_ts;
+  bool sent;
+} can_sub_t;
+
+void can_sub_write(const uint8_t *data, uint32_t len);
+void can_subs_apply(uint32_t cnt, uint8_t only_mask);
+
+// ********************* TX priority classes *********************
+// Each bus has a small high priority TX queue next to the regular one. Frames in ID
+// ranges from a host table go there, whoever sends them, and go out ahead of anything
+// in the regular queue. The host uploads the ranges over endpoint 2 (selector byte
+// CAN_TX_PRIO_EP2_SELECTOR), then commits how many are active.
+#define CAN_TX_PRIO_EP2_SELECTOR 0x85U
+#define CAN_TX_PRIO_EP2_ENTRY_SIZE 10U // flags, bus, first and last id as little endian words
+#define CAN_TX_PRIO_CNT_MAX 16U
+
+#define CAN_TX_PRIO_FLAG_EXTENDED 0x1U
+
+typedef struct {
+  uint8_t flags;
+  uint8_t bus;
+  uint32_t id_lo;
+  uint32_t id_hi;
+} can_tx_prio_t;
+
+void can_tx_prio_write(const uint8_t *data, uint32_t len);
+void can_tx_prios_apply(uint32_t cnt);
+uint32_t can_tx_queued(uint8_t bus_number);
+void can_tx_clear(uint8_t bus_number);
+
+// ********************* TX flags *********************
+// Packets from the host use the returned and rejected bits as TX flags, they mean
+// nothing else on the way in:
+//   returned, latest value: replaces the payload of a frame with the same ID that's
+//     still in the bus' TX queue with this flag as well, otherwise it's queued as usual.
+//   rejected, deadline: the v5 timestamp is how many ms the frame may wait in the TX
+//     queue, up to CAN_TX_DEADLINE_MAX. It's dropped when it's still queued after that.
+// In the TX queues the deadline becomes a microsecond timestamp. Replaced and dropped
+// frames are counted in can_health.
+#define CAN_TX_DEADLINE_MAX 60000U // ms
+#define CAN_TX_LATEST_INDEX_SIZE 32U // latest value frames tracked per bus, a power of two
+
+typedef struct {
+  uint32_t key;  // ID | extended << 29 | 1 << 30, 0 for a free slot
+  uint32_t slot; // in the bus' TX queue
+} can_tx_latest_t;
+
+void can_tx_deadline_from_host(CANPacket_t *pkt);
+bool can_tx_pop(uint8_t bus_number, CANPacket_t *to_send);
+
+// ********************* bus load *********************
+// Every frame received or sent adds its estimated time on the wire to the bus' load,
+// from its ID type, length, a stuffing estimate and the rates in bus_config. The load
+// of the last full CAN_BUS_LOAD_WINDOW and the average over the last
+// CAN_BUS_LOAD_WINDOW_CNT windows go in can_health in 0.1 %, with their peaks.
+#define CAN_BUS_LOAD_WINDOW 100000U // us
+#define CAN_BUS_LOAD_WINDOW_CNT 10U
+#define CAN_FRAME_TAIL_BITS 13U // CRC delimiter, ACK, EOF and interframe space
+
+typedef struct {
+  uint32_t window_start;
+  uint32_t busy; // wire time in the current window, in 0.1 us
+  uint16_t windows[CAN_BUS_LOAD_WINDOW_CNT]; // load of the last full windows, in 0.1 %
+  uint8_t window_idx; // the latest one
+} can_bus_load_t;
+
+void can_bus_load_update(uint8_t can_number);
+void can_bus_load_add(uint8_t can_number, const CANPacket_t *pkt, bool brs);
+
+// ********************* TX shaping *********************
+// An optional token bucket per bus caps the rate frames leave its TX queues at, as
+// frames or kbit per second. The bucket fills with sending time, each frame takes the
+// time it's worth at the set rate and may leave the bucket in debt, the next one waits
+// until that's paid off. An idle bus saves up credit for a short burst. Held back
+// frames go out from compare channel 4 of the microsecond timer. Forwarded frames
+// take credit too, one that finds none is queued instead of loaded straight away.
+#define CAN_TX_SHAPER_FRAMES 0U // rate in frames per second
+#define CAN_TX_SHAPER_KBPS 1U   // rate in kbit per second, counted with stuff bits
+#define CAN_TX_SHAPER_BURST_FRAMES 4U
+#define CAN_TX_SHAPER_BURST_BITS 1024U
+// frames due this close go out right away
+#define CAN_TX_SHAPER_GRANULARITY 20U // us
+
+typedef struct {
+  uint8_t unit;
+  uint16_t rate;     // 0 is off
+  uint32_t depth;    // us, most credit that's saved up
+  int32_t credit;    // us
+  uint32_t last_ts;  // of the last refill
+  bool held;         // frames are waiting for credit
+  uint32_t held_ts;
+  bool wake;         // compare channel 4 is due to restart the queue
+  uint32_t wake_ts;
+} can_tx_shaper_t;
+
+void can_tx_shaper_set(uint8_t bus_number, uint8_t unit, uint16_t rate);
+
+// Compare channel 4 of the microsecond timer serves the CAN drivers' deadlines. It's never
+// armed closer than CAN_TIMER_GRANULARITY, a deadline due sooner waits for that much.
+#define CAN_TIMER_GRANULARITY 50U // us
+#define CAN_TIMER_INTERRUPT_RATE (1000000U / CAN_TIMER_GRANULARITY)
+void can_timer_irq_handler(void);
+#ifdef STM32H7
+// FDCAN RX interrupt coalescing
+void can_rx_coalesce_poll(uint32_t now, bool *armed, uint32_t *next);
+#endif
+
+// ********************* deferred RX *********************
+// The CAN RX interrupts only copy frames out of the hardware, with their timestamp, into
+// a staging queue. The bottom half then forwards them, runs the safety and ignition hooks
+// and queues them for the host. It's a software interrupt below every other priority, so
+// the hardware interrupts stay short. TX echoes are staged as well, so they keep their
+// order with the received frames. Each frame is handled in a critical section, for the
+// safety hooks and the queues it's the same as running in any other interrupt.
+// Every TX safety check first runs the safety and ignition hooks on the staged frames they
+// haven't seen, so the safety model has seen all frames received before it, as when they
+// were handled in the RX interrupts. That's all of the bottom half that runs in the
+// interrupt of the check, at most CAN_RX_STAGE_SIZE hook calls. The bottom half forwards
+// and queues those frames later without running the hooks again.
+// Frames the host steers into FDCAN RX FIFO 1 (CAN_FILTER_FLAG_FIFO1) skip the staging
+// and are handled right in their hardware interrupt, ahead of everything staged.
+#define CAN_RX_STAGE_SIZE 128U
+#define CAN_RX_SWI_PRIORITY 1U // the hardware interrupts are all at 0
+#define CAN_RX_SWI_INTERRUPT_RATE (3U * CAN_INTERRUPT_RATE)
+
+// How a bus reports frames that went out: a full echo, a compact record with the
+// echo's header and timestamp but no payload, or nothing. Frames that never went out
+// (returned and rejected) are reported in the none mode too, as compact records.
+#define CAN_TX_REPORT_FULL 0U
+#define CAN_TX_REPORT_COMPACT 1U
+#define CAN_TX_REPORT_NONE 2U
+
+void can_tx_report_set(uint8_t bus_number, uint8_t mode);
+void can_rx_stage(const CANPacket_t *to_push);
+void can_rx_handle(CANPacket_t *to_push, bool fast_path);
+void can_rx_bottom_half(void);
+void can_rx_hooks_catch_up(void);
+
 void can_init_all(void);
 void can_set_orientation(bool flipped);
 #ifdef PANDA_JUNGLE
 void can_set_forwarding(uint8_t from, uint8_t to);
+#else
+bool isotp_rx(const CANPacket_t *to_push);
 #endif
+#define IGNITION_CAN_ADDRS_CNT 4U
+extern const uint32_t ignition_can_addrs[IGNITION_CAN_ADDRS_CNT];
 void ignition_can_hook(CANPacket_t *to_push);
-bool can_tx_check_min_slots_free(uint32_t min);
+// shortest wait for more frames with RX interrupt coalescing
+#define CAN_RX_COALESCE_TIMEOUT_MIN 50U // us
+#define CAN_TX_STALL_TIMEOUT 100000U // us
+bool can_tx_stalled(uint8_t bus_number);
+bool can_tx_check_min_slots_free(uint32_t min, uint8_t buses);
 uint8_t calculate_checksum(const uint8_t *dat, uint32_t len);
-void can_set_checksum(CANPacket_t *packet);
-bool can_check_checksum(CANPacket_t *packet);
 void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook);
+void can_rx_push(const CANPacket_t *to_push);
+void can_send_many(CANPacket_t *to_push, uint32_t cnt, bool skip_tx_hook);
 bool is_speed_valid(uint32_t speed, const uint32_t *all_speeds, uint8_t len);
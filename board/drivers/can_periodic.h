@@ -0,0 +1,158 @@
+#include "can_periodic_declarations.h"
+
+can_periodic_t can_periodic[CAN_PERIODIC_CNT_MAX];
+
+static void can_periodic_config(can_periodic_t *slot, const uint8_t *data) {
+  uint32_t addr;
+  uint32_t period;
+  uint32_t phase;
+  BYTE_ARRAY_TO_WORD(addr, &data[6]);
+  BYTE_ARRAY_TO_WORD(period, &data[10]);
+  BYTE_ARRAY_TO_WORD(phase, &data[14]);
+  uint8_t dlc = data[5] & 0xFU;
+  uint8_t len = dlc_to_len[dlc];
+
+  // a new config always starts out stopped, an invalid one can't be started
+  slot->running = false;
+  slot->period = 0U;
+  if ((data[4] < PANDA_BUS_CNT) && (period >= CAN_PERIODIC_PERIOD_MIN) && (len > 0U)) {
+    slot->flags = data[3];
+    slot->bus = data[4];
+    slot->data_len_code = dlc;
+    slot->addr = addr;
+    slot->period = period;
+    slot->phase = phase;
+    slot->counter_pos = MIN(data[18], len - 1U);
+    slot->counter_shift = (data[19] >> 4U) & 0x7U;
+    slot->counter_bits = MIN(data[19] & 0xFU, 8U - slot->counter_shift);
+    slot->counter = 0U;
+    slot->checksum_pos = MIN(data[20], len - 1U);
+    slot->checksum_seed = data[21];
+    slot->expire_ms = (uint16_t)(data[22] | (data[23] << 8U));
+    slot->published_ts = microsecond_timer_get();
+    (void)memset(slot->data, 0, sizeof(slot->data));
+    (void)memset(slot->staged, 0, sizeof(slot->staged));
+  }
+}
+
+// endpoint 2 writes come in through interrupts of the same priority as the
+// scheduler, so a single write is never seen half done
+void can_periodic_write(const uint8_t *data, uint32_t len) {
+  if ((len >= 4U) && (data[1] < CAN_PERIODIC_CNT_MAX)) {
+    can_periodic_t *slot = &can_periodic[data[1]];
+    if (data[2] == CAN_PERIODIC_OP_CONFIG) {
+      if (len >= CAN_PERIODIC_CONFIG_SIZE) {
+        can_periodic_config(slot, data);
+      }
+    } else {
+      uint32_t offset = data[3];
+      if (offset < CANPACKET_DATA_SIZE_MAX) {
+        (void)memcpy(&slot->staged[offset], &data[4], MIN(len - 4U, CANPACKET_DATA_SIZE_MAX - offset));
+      }
+      if (data[2] == CAN_PERIODIC_OP_PUBLISH) {
+        (void)memcpy(slot->data, slot->staged, sizeof(slot->data));
+        slot->published_ts = microsecond_timer_get();
+      }
+    }
+  }
+}
+
+// slots in the mask run, the others stop. Slots that weren't running already
+// send their first frame phase us from now
+void can_periodic_set_running(uint32_t mask) {
+  uint32_t now = microsecond_timer_get();
+  for (uint32_t i = 0U; i < CAN_PERIODIC_CNT_MAX; i++) {
+    can_periodic_t *slot = &can_periodic[i];
+    bool run = (((mask >> i) & 1U) != 0U) && (slot->period >= CAN_PERIODIC_PERIOD_MIN);
+    if (run && !slot->running) {
+      slot->next_ts = now + slot->phase;
+      slot->published_ts = now;
+      slot->counter = 0U;
+    }
+    slot->running = run;
+  }
+  can_periodic_run();
+}
+
+void can_periodic_clear(void) {
+  can_periodic_set_running(0U);
+}
+
+static void can_periodic_send(can_periodic_t *slot, uint32_t now) {
+  bool expired = (slot->expire_ms > 0U) && (get_ts_elapsed(now, slot->published_ts) > (slot->expire_ms * 1000U));
+  if (!expired) {
+    CANPacket_t to_send;
+    uint8_t len = dlc_to_len[slot->data_len_code];
+
+    to_send.fd = ((slot->flags & CAN_PERIODIC_FLAG_FD) != 0U) ? 1U : 0U;
+    to_send.returned = 0U;
+    to_send.rejected = 0U;
+    to_send.extended = ((slot->flags & CAN_PERIODIC_FLAG_EXTENDED) != 0U) ? 1U : 0U;
+    to_send.addr = slot->addr;
+    to_send.bus = slot->bus;
+    to_send.data_len_code = slot->data_len_code;
+    to_send.timestamp = now;
+    (void)memcpy(to_send.data, slot->data, len);
+
+    if (slot->counter_bits > 0U) {
+      uint8_t mask = (uint8_t)(((1U << slot->counter_bits) - 1U) << slot->counter_shift);
+      to_send.data[slot->counter_pos] = (to_send.data[slot->counter_pos] & (uint8_t)~mask) | ((uint8_t)(slot->counter << slot->counter_shift) & mask);
+      slot->counter += 1U;
+    }
+
+    if ((slot->flags & (CAN_PERIODIC_FLAG_CHECKSUM_SUM | CAN_PERIODIC_FLAG_CHECKSUM_XOR)) != 0U) {
+      uint8_t checksum = slot->checksum_seed;
+      for (uint8_t i = 0U; i < len; i++) {
+        if (i != slot->checksum_pos) {
+          checksum = ((slot->flags & CAN_PERIODIC_FLAG_CHECKSUM_SUM) != 0U) ? (checksum + to_send.data[i]) : (checksum ^ to_send.data[i]);
+        }
+      }
+      to_send.data[slot->checksum_pos] = checksum;
+    }
+
+    can_send(&to_send, slot->bus, false);
+  }
+}
+
+// sends everything that's due and sets up the timer compare for the next frame
+void can_periodic_run(void) {
+  bool pending = true;
+  while (pending) {
+    uint32_t now = microsecond_timer_get();
+    uint32_t next_ts = 0U;
+    bool any = false;
+
+    for (uint32_t i = 0U; i < CAN_PERIODIC_CNT_MAX; i++) {
+      can_periodic_t *slot = &can_periodic[i];
+      if (slot->running) {
+        if (((int32_t)(now - slot->next_ts) + (int32_t)CAN_PERIODIC_GRANULARITY) > 0) {
+          can_periodic_send(slot, now);
+          slot->next_ts += slot->period;
+          // more than a period late, skip ahead instead of sending a burst
+          if ((int32_t)(now - slot->next_ts) >= 0) {
+            slot->next_ts = now + slot->period;
+          }
+        }
+        if (!any || ((int32_t)(slot->next_ts - next_ts) < 0)) {
+          next_ts = slot->next_ts;
+          any = true;
+        }
+      }
+    }
+
+    if (any) {
+      MICROSECOND_TIMER->CCR1 = next_ts;
+      MICROSECOND_TIMER->DIER |= TIM_DIER_CC1IE;
+    } else {
+      MICROSECOND_TIMER->DIER &= ~TIM_DIER_CC1IE;
+    }
+    // the compare only fires on an exact match, go again if the next frame got due meanwhile
+    pending = any && ((int32_t)(microsecond_timer_get() - next_ts) >= 0);
+  }
+}
+
+void can_periodic_irq_handler(void) {
+  // status bits are rc_w0
+  MICROSECOND_TIMER->SR = (uint32_t)~TIM_SR_CC1IF;
+  can_periodic_run();
+}
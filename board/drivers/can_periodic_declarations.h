@@ -0,0 +1,57 @@
+#pragma once
+
+// ********************* periodic TX scheduler *********************
+// The host uploads messages the firmware sends on its own at a fixed period, so their
+// timing doesn't depend on USB/SPI polling. Each frame still goes through the safety
+// TX hook. Uploads go over endpoint 2 (selector byte CAN_PERIODIC_EP2_SELECTOR):
+//   [selector, slot, CAN_PERIODIC_OP_CONFIG, flags, bus, dlc, addr, period_us, phase_us,
+//    counter_pos, counter shift << 4 | counter bits, checksum_pos, checksum_seed, expire_ms]
+//   [selector, slot, CAN_PERIODIC_OP_DATA or CAN_PERIODIC_OP_PUBLISH, offset, payload bytes...]
+// Words are little endian. Payload bytes are staged and only go out once they are
+// published, so a payload split across several writes never goes out half updated.
+// Each slot stages its own payload, uploads to different slots can be interleaved.
+#define CAN_PERIODIC_EP2_SELECTOR 0x82U
+#define CAN_PERIODIC_CNT_MAX 32U
+#define CAN_PERIODIC_PERIOD_MIN 1000U // us
+// frames due this close together go out from the same interrupt
+#define CAN_PERIODIC_GRANULARITY 100U // us
+#define CAN_PERIODIC_INTERRUPT_RATE (1000000U / CAN_PERIODIC_GRANULARITY)
+
+#define CAN_PERIODIC_OP_CONFIG 0U
+#define CAN_PERIODIC_OP_DATA 1U
+#define CAN_PERIODIC_OP_PUBLISH 2U
+#define CAN_PERIODIC_CONFIG_SIZE 24U
+
+#define CAN_PERIODIC_FLAG_EXTENDED 0x1U
+#define CAN_PERIODIC_FLAG_FD 0x2U
+#define CAN_PERIODIC_FLAG_CHECKSUM_SUM 0x4U // checksum byte is seed + all other payload bytes
+#define CAN_PERIODIC_FLAG_CHECKSUM_XOR 0x8U // checksum byte is seed ^ all other payload bytes
+
+typedef struct {
+  bool running;
+  uint8_t flags;
+  uint8_t bus;
+  uint8_t data_len_code;
+  uint32_t addr;
+  uint32_t period;
+  uint32_t phase;
+  uint8_t counter_pos;
+  uint8_t counter_shift;
+  uint8_t counter_bits; // 0 for no rolling counter
+  uint8_t counter;
+  uint8_t checksum_pos;
+  uint8_t checksum_seed;
+  uint16_t expire_ms; // stop sending if the payload isn't published for this long, 0 never expires
+  uint32_t published_ts; // also set on config and start, expiry counts from then
+  uint32_t next_ts;
+  uint8_t data[CANPACKET_DATA_SIZE_MAX];
+  uint8_t staged[CANPACKET_DATA_SIZE_MAX]; // payload bytes waiting to be published
+} can_periodic_t;
+
+extern can_periodic_t can_periodic[CAN_PERIODIC_CNT_MAX];
+
+void can_periodic_write(const uint8_t *data, uint32_t len);
+void can_periodic_set_running(uint32_t mask);
+void can_periodic_clear(void);
+void can_periodic_run(void);
+void can_periodic_irq_handler(void);
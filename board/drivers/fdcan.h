@@ -2,6 +2,11 @@
 
 FDCAN_GlobalTypeDef *cans[CANS_ARRAY_SIZE] = {FDCAN1, FDCAN2, FDCAN3};
 
+__attribute__((section(".axisram"))) static CANPacket_t can_tx_echo[CANS_ARRAY_SIZE][CAN_TX_ECHO_CNT];
+static bool can_tx_in_flight[CANS_ARRAY_SIZE][CAN_TX_ECHO_CNT];
+static uint8_t can_tx_echo_index[CANS_ARRAY_SIZE][CAN_TX_ECHO_CNT]; // TX element the frame went in
+static uint8_t can_tx_marker[CANS_ARRAY_SIZE]; // wraps around at a multiple of CAN_TX_ECHO_CNT
+
 static bool can_set_speed(uint8_t can_number) {
   bool ret = true;
   FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
@@ -18,6 +23,180 @@ static bool can_set_speed(uint8_t can_number) {
   return ret;
 }
 
+// IDs that must keep reaching the safety hooks go in as accepting dual-ID elements, two per element
+static void fdcan_filter_add_id(fdcan_filter_list_t *list, uint32_t addr) {
+  if (addr <= 0x7FFU) {
+    if (list->std_open) {
+      list->std_el[list->std_cnt - 1U] = (list->std_el[list->std_cnt - 1U] & ~0x7FFU) | addr;
+      list->std_open = false;
+    } else if (list->std_cnt < FDCAN_STD_FILTER_CNT) {
+      list->std_el[list->std_cnt] = FDCAN_STD_FILTER(CAN_FILTER_TYPE_DUAL, FDCAN_FILTER_EC_FIFO0, addr, addr);
+      list->std_cnt++;
+      list->std_open = true;
+    } else {
+      list->overflow = true;
+    }
+  } else {
+    if (list->ext_open) {
+      list->ext_el[(list->ext_cnt * 2U) - 1U] = FDCAN_EXT_FILTER_F1(CAN_FILTER_TYPE_DUAL, addr);
+      list->ext_open = false;
+    } else if (list->ext_cnt < FDCAN_EXT_FILTER_CNT) {
+      list->ext_el[list->ext_cnt * 2U] = FDCAN_EXT_FILTER_F0(FDCAN_FILTER_EC_FIFO0, addr);
+      list->ext_el[(list->ext_cnt * 2U) + 1U] = FDCAN_EXT_FILTER_F1(CAN_FILTER_TYPE_DUAL, addr);
+      list->ext_cnt++;
+      list->ext_open = true;
+    } else {
+      list->overflow = true;
+    }
+  }
+}
+
+static void fdcan_filter_add_host(fdcan_filter_list_t *list, const can_filter_t *filter) {
+  uint32_t type = filter->flags & CAN_FILTER_TYPE_BITS;
+  uint32_t ec = ((filter->flags & CAN_FILTER_FLAG_REJECT) != 0U) ? FDCAN_FILTER_EC_REJECT : FDCAN_FILTER_EC_FIFO0;
+  if ((filter->flags & CAN_FILTER_FLAG_FIFO1) != 0U) {
+    ec = FDCAN_FILTER_EC_FIFO1;
+  }
+  if ((filter->flags & CAN_FILTER_FLAG_EXTENDED) == 0U) {
+    if (list->std_cnt < FDCAN_STD_FILTER_CNT) {
+      list->std_el[list->std_cnt] = FDCAN_STD_FILTER(type, ec, filter->id1, filter->id2);
+      list->std_cnt++;
+      list->std_open = false;
+    } else {
+      list->overflow = true;
+    }
+  } else {
+    if (list->ext_cnt < FDCAN_EXT_FILTER_CNT) {
+      list->ext_el[list->ext_cnt * 2U] = FDCAN_EXT_FILTER_F0(ec, filter->id1);
+      list->ext_el[(list->ext_cnt * 2U) + 1U] = FDCAN_EXT_FILTER_F1(type, filter->id2);
+      list->ext_cnt++;
+      list->ext_open = false;
+    } else {
+      list->overflow = true;
+    }
+  }
+}
+
+// Host filters merged with everything the firmware itself listens to. Those go first,
+// so no host element can reject them. Filtering stays off if the merged list doesn't fit.
+// Host elements steering frames into FIFO 1 go before everything else, they only accept,
+// so they're kept even with filtering off.
+static bool can_set_filters(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  const can_filter_config_t *config = &can_filter_config[bus_number];
+  uint32_t host_cnt = MIN(config->cnt, CAN_FILTER_CNT_MAX);
+
+  fdcan_filter_list_t list;
+  (void)memset(&list, 0, sizeof(list));
+  bool enabled = ((config->cnt > 0U) || config->reject_default) && !can_filter_bypassed(bus_number);
+
+  for (uint32_t i = 0U; i < host_cnt; i++) {
+    if ((config->filters[i].flags & CAN_FILTER_FLAG_FIFO1) != 0U) {
+      fdcan_filter_add_host(&list, &config->filters[i]);
+    }
+  }
+  uint32_t fifo1_std_cnt = list.std_cnt;
+  uint32_t fifo1_ext_cnt = list.ext_cnt;
+
+  if (enabled) {
+    for (int i = 0; i < current_safety_config.rx_checks_len; i++) {
+      for (uint32_t j = 0U; j < MAX_ADDR_CHECK_MSGS; j++) {
+        const CanMsgCheck *msg = &current_safety_config.rx_checks[i].msg[j];
+        if ((msg->addr != 0) && (msg->bus == (int)bus_number)) {
+          fdcan_filter_add_id(&list, (uint32_t)msg->addr);
+        }
+      }
+    }
+    // relay malfunction detection looks for our own TX IDs coming from the car
+    for (int i = 0; i < current_safety_config.tx_msgs_len; i++) {
+      if (current_safety_config.tx_msgs[i].bus == (int)bus_number) {
+        fdcan_filter_add_id(&list, (uint32_t)current_safety_config.tx_msgs[i].addr);
+      }
+    }
+    if (bus_number == 0U) {
+      for (uint32_t i = 0U; i < IGNITION_CAN_ADDRS_CNT; i++) {
+        fdcan_filter_add_id(&list, ignition_can_addrs[i]);
+      }
+    }
+    for (uint32_t i = 0U; i < host_cnt; i++) {
+      if ((config->filters[i].flags & CAN_FILTER_FLAG_FIFO1) == 0U) {
+        fdcan_filter_add_host(&list, &config->filters[i]);
+      }
+    }
+
+    if (list.overflow) {
+      print(CAN_NAME_FROM_CANIF(FDCANx)); print(" too many filters, filtering disabled\n");
+      enabled = false;
+    }
+  }
+
+  if (!enabled) {
+    list.std_cnt = fifo1_std_cnt;
+    list.ext_cnt = fifo1_ext_cnt;
+  }
+  return llcan_set_filters(FDCANx, list.std_el, list.std_cnt, list.ext_el, list.ext_cnt, enabled && config->reject_default);
+}
+
+// a frame whose echo won't come from a TX event goes back to the host rejected
+static void can_tx_fail_echo(uint8_t can_number, uint32_t slot) {
+  can_tx_in_flight[can_number][slot] = false;
+  can_tx_echo[can_number][slot].rejected = 1U;
+  can_tx_echo[can_number][slot].timestamp = microsecond_timer_get();
+  can_rx_stage(&can_tx_echo[can_number][slot]);
+}
+
+// Echoes go to the host once a frame is out, from its TX event. The event has the start of
+// the frame in bit times of the 16 bit timestamp counter, which gives the echo's timestamp.
+// When the event FIFO overflowed, the frames that are out but still have no event once it's
+// drained lost theirs, their echoes come back rejected.
+static void can_tx_events(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+
+  uint32_t ir_reg = FDCANx->IR;
+  FDCANx->IR = (FDCAN_IR_TEFN | FDCAN_IR_TEFL);
+  // taken ahead of the events, a frame that's done by now has its event in the FIFO or lost it
+  uint32_t pending = FDCANx->TXBRP;
+  uint32_t TxEventFIFOSA = FDCAN_TX_EVENT_FIFO_SA(can_number);
+  while ((FDCANx->TXEFS & FDCAN_TXEFS_EFFL) != 0U) {
+    uint32_t event_idx = (FDCANx->TXEFS >> FDCAN_TXEFS_EFGI_Pos) & 0x1FU;
+    uint32_t event_1 = *(volatile uint32_t *)(TxEventFIFOSA + (((event_idx * FDCAN_TX_EVENT_FIFO_EL_W_SIZE) + 1U) * 4U));
+    uint32_t slot = (event_1 >> 24) % CAN_TX_ECHO_CNT;
+
+    if (can_tx_in_flight[can_number][slot]) {
+      can_tx_in_flight[can_number][slot] = false;
+      CANPacket_t *echo = &can_tx_echo[can_number][slot];
+      uint32_t bit_times = ((FDCANx->TSCV & FDCAN_TSCV_TSC) - (event_1 & 0xFFFFU)) & 0xFFFFU;
+      echo->timestamp = microsecond_timer_get() - ((bit_times * 10000U) / bus_config[bus_number].can_speed);
+      can_bus_load_add(can_number, echo, ((event_1 >> 20) & 0x1U) != 0U);
+      can_rx_stage(echo);
+    }
+    FDCANx->TXEFA = event_idx;
+  }
+
+  if ((ir_reg & FDCAN_IR_TEFL) != 0U) {
+    for (uint32_t i = 0U; i < CAN_TX_ECHO_CNT; i++) {
+      if (can_tx_in_flight[can_number][i] && ((pending & (1UL << can_tx_echo_index[can_number][i])) == 0U)) {
+        can_health[can_number].total_tx_event_lost_cnt += 1U;
+        can_tx_fail_echo(can_number, i);
+      }
+    }
+  }
+}
+
+// frames still in the hardware are dropped by a core reset, their echoes come back rejected
+static void can_tx_fail_in_flight(uint8_t can_number) {
+  ENTER_CRITICAL();
+  can_tx_events(can_number);
+  for (uint32_t i = 0U; i < CAN_TX_ECHO_CNT; i++) {
+    if (can_tx_in_flight[can_number][i]) {
+      can_tx_fail_echo(can_number, i);
+    }
+  }
+  EXIT_CRITICAL();
+}
+
 void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number) {
   static uint32_t last_reset = 0U;
   uint32_t time = microsecond_timer_get();
@@ -25,8 +204,10 @@ void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number) {
   // Resetting CAN core is a slow blocking operation, limit frequency
   if (get_ts_elapsed(time, last_reset) > 100000U) {  // 10 Hz
     can_health[can_number].can_core_reset_cnt += 1U;
-    can_health[can_number].total_tx_lost_cnt += (FDCAN_TX_FIFO_EL_CNT - (FDCANx->TXFQS & FDCAN_TXFQS_TFFL)); // TX FIFO msgs will be lost after reset
-    llcan_clear_send(FDCANx);
+    uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+    can_health[can_number].total_tx_lost_cnt += (bus_config[bus_number].tx_buf_cnt - (FDCANx->TXFQS & FDCAN_TXFQS_TFFL)); // TX FIFO msgs will be lost after reset
+    can_tx_fail_in_flight(can_number);
+    llcan_clear_send(FDCANx, bus_config[bus_number].tx_buf_cnt, bus_config[bus_number].tx_id_priority, bus_config[bus_number].rx_watermark);
     last_reset = time;
   }
 }
@@ -62,11 +243,13 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
 
   can_health[can_number].irq0_call_rate = interrupts[can_irq_number[can_number][0]].call_rate;
   can_health[can_number].irq1_call_rate = interrupts[can_irq_number[can_number][1]].call_rate;
-
+  can_health[can_number].irq0_max_time = MIN(interrupts[can_irq_number[can_number][0]].max_duration, 0xFFFFU);
+  can_health[can_number].irq1_max_time = MIN(interrupts[can_irq_number[can_number][1]].max_duration, 0xFFFFU);
+  can_health[can_number].rx_bottom_half_max_time = MIN(interrupts[CAN_RX_SWI_IRQ].max_duration, 0xFFFFU);
 
   if (ir_reg != 0U) {
     // Clear error interrupts
-    FDCANx->IR |= (FDCAN_IR_PED | FDCAN_IR_PEA | FDCAN_IR_EP | FDCAN_IR_BO | FDCAN_IR_RF0L);
+    FDCANx->IR = (FDCAN_IR_PED | FDCAN_IR_PEA | FDCAN_IR_EP | FDCAN_IR_BO | FDCAN_IR_RF0L);
     can_health[can_number].total_error_cnt += 1U;
     // Check for RX FIFO overflow
     if ((ir_reg & (FDCAN_IR_RF0L)) != 0U) {
@@ -83,6 +266,72 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
 }
 
 // ***************************** CAN *****************************
+// puts a frame in the next free TX FIFO element, its echo waits for the TX event
+static void can_tx_load(uint8_t can_number, const CANPacket_t *to_send) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  can_health[can_number].total_tx_cnt += 1U;
+
+  uint32_t TxFIFOSA = FDCAN_TX_FIFO_SA(can_number, bus_config[bus_number].tx_buf_cnt);
+  // get the index of the next free TX element (0 to tx_buf_cnt - 1)
+  uint32_t tx_index = (FDCANx->TXFQS >> FDCAN_TXFQS_TFQPI_Pos) & 0x1FU;
+  // only send if we have received a packet
+  canfd_fifo *fifo;
+  fifo = (canfd_fifo *)(TxFIFOSA + (tx_index * FDCAN_TX_FIFO_EL_SIZE));
+
+  fifo->header[0] = (to_send->extended << 30) | ((to_send->extended != 0U) ? (to_send->addr) : (to_send->addr << 18));
+
+  // If canfd_auto is set, outgoing packets will be automatically sent as CAN-FD if an incoming CAN-FD packet was seen
+  bool fd = bus_config[can_number].canfd_auto ? bus_config[can_number].canfd_enabled : (bool)(to_send->fd > 0U);
+  uint32_t canfd_enabled_header = fd ? (1UL << 21) : 0UL;
+
+  uint32_t brs_enabled_header = bus_config[can_number].brs_enabled ? (1UL << 20) : 0UL;
+  // message marker, and store a TX event
+  uint8_t marker = can_tx_marker[can_number];
+  can_tx_marker[can_number] += 1U;
+  uint32_t event_header = ((uint32_t)marker << 24) | (1UL << 23);
+  fifo->header[1] = event_header | (to_send->data_len_code << 16) | canfd_enabled_header | brs_enabled_header;
+
+  uint8_t data_len_w = (dlc_to_len[to_send->data_len_code] / 4U);
+  data_len_w += ((dlc_to_len[to_send->data_len_code] % 4U) > 0U) ? 1U : 0U;
+  for (unsigned int i = 0; i < data_len_w; i++) {
+    BYTE_ARRAY_TO_WORD(fifo->data_word[i], &to_send->data[i*4U]);
+  }
+
+  // Send back to USB once it's out
+  uint32_t slot = marker % CAN_TX_ECHO_CNT;
+  CANPacket_t *to_push = &can_tx_echo[can_number][slot];
+
+  to_push->fd = fd;
+  to_push->returned = 1U;
+  to_push->rejected = 0U;
+  to_push->extended = to_send->extended;
+  to_push->addr = to_send->addr;
+  to_push->bus = bus_number;
+  to_push->data_len_code = to_send->data_len_code;
+  (void)memcpy(to_push->data, to_send->data, dlc_to_len[to_push->data_len_code]);
+  can_tx_in_flight[can_number][slot] = true;
+  can_tx_echo_index[can_number][slot] = (uint8_t)tx_index;
+
+  FDCANx->TXBAR = (1UL << tx_index);
+}
+
+bool can_tx_direct(uint8_t bus_number, const CANPacket_t *to_send) {
+  bool ret = false;
+  if (bus_number < PANDA_BUS_CNT) {
+    ENTER_CRITICAL();
+    uint8_t can_number = CAN_NUM_FROM_BUS_NUM(bus_number);
+    // frames already queued for the bus go out first
+    if ((can_tx_queued(bus_number) == 0U) && ((CANIF_FROM_CAN_NUM(can_number)->TXFQS & FDCAN_TXFQS_TFQF) == 0U) && can_tx_shaper_ready(bus_number)) {
+      can_tx_shaper_charge(bus_number, to_send);
+      can_tx_load(can_number, to_send);
+      ret = true;
+    }
+    EXIT_CRITICAL();
+  }
+  return ret;
+}
+
 // FDFDCANx_IT1 IRQ Handler (TX)
 void process_can(uint8_t can_number) {
   if (can_number != 0xffU) {
@@ -90,64 +339,117 @@ void process_can(uint8_t can_number) {
 
     FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
     uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+    uint32_t tx_el_cnt = bus_config[bus_number].tx_buf_cnt;
 
-    FDCANx->IR |= FDCAN_IR_TFE; // Clear Tx FIFO Empty flag
-
-    if ((FDCANx->TXFQS & FDCAN_TXFQS_TFQF) == 0U) {
-      CANPacket_t to_send;
-      if (can_pop(can_queues[bus_number], &to_send)) {
-        if (can_check_checksum(&to_send)) {
-          can_health[can_number].total_tx_cnt += 1U;
-
-          uint32_t TxFIFOSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_SIZE);
-          // get the index of the next TX FIFO element (0 to FDCAN_TX_FIFO_EL_CNT - 1)
-          uint32_t tx_index = (FDCANx->TXFQS >> FDCAN_TXFQS_TFQPI_Pos) & 0x1FU;
-          // only send if we have received a packet
-          canfd_fifo *fifo;
-          fifo = (canfd_fifo *)(TxFIFOSA + (tx_index * FDCAN_TX_FIFO_EL_SIZE));
-
-          fifo->header[0] = (to_send.extended << 30) | ((to_send.extended != 0U) ? (to_send.addr) : (to_send.addr << 18));
-
-          // If canfd_auto is set, outgoing packets will be automatically sent as CAN-FD if an incoming CAN-FD packet was seen
-          bool fd = bus_config[can_number].canfd_auto ? bus_config[can_number].canfd_enabled : (bool)(to_send.fd > 0U);
-          uint32_t canfd_enabled_header = fd ? (1UL << 21) : 0UL;
-
-          uint32_t brs_enabled_header = bus_config[can_number].brs_enabled ? (1UL << 20) : 0UL;
-          fifo->header[1] = (to_send.data_len_code << 16) | canfd_enabled_header | brs_enabled_header;
-
-          uint8_t data_len_w = (dlc_to_len[to_send.data_len_code] / 4U);
-          data_len_w += ((dlc_to_len[to_send.data_len_code] % 4U) > 0U) ? 1U : 0U;
-          for (unsigned int i = 0; i < data_len_w; i++) {
-            BYTE_ARRAY_TO_WORD(fifo->data_word[i], &to_send.data[i*4U]);
-          }
-
-          FDCANx->TXBAR = (1UL << tx_index);
-
-          // Send back to USB
-          CANPacket_t to_push;
-
-          to_push.fd = fd;
-          to_push.returned = 1U;
-          to_push.rejected = 0U;
-          to_push.extended = to_send.extended;
-          to_push.addr = to_send.addr;
-          to_push.bus = bus_number;
-          to_push.data_len_code = to_send.data_len_code;
-          (void)memcpy(to_push.data, to_send.data, dlc_to_len[to_push.data_len_code]);
-          can_set_checksum(&to_push);
-
-          rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
-        } else {
-          can_health[can_number].total_tx_checksum_error_cnt += 1U;
-        }
+    FDCANx->IR = (FDCAN_IR_TFE | FDCAN_IR_TC); // Clear Tx FIFO Empty and Tx complete flags, leave the rest for can_rx
 
-        refresh_can_tx_slots_available();
-      }
+    // fill all free TX elements in one pass
+    bool popped = false;
+    CANPacket_t to_send;
+    while (((FDCANx->TXFQS & FDCAN_TXFQS_TFQF) == 0U) && can_tx_pop(bus_number, &to_send)) {
+      popped = true;
+      can_tx_load(can_number, &to_send);
+    }
+
+    // Tx FIFO empty alone would leave the bus idle while the FIFO gets refilled. In FIFO
+    // mode also interrupt once the middle pending frame is out, so there's time to top up.
+    uint32_t pending = tx_el_cnt - (FDCANx->TXFQS & FDCAN_TXFQS_TFFL);
+    if (!bus_config[bus_number].tx_id_priority && (pending >= 2U)) {
+      uint32_t get_index = (FDCANx->TXFQS >> FDCAN_TXFQS_TFGI_Pos) & 0x1FU;
+      FDCANx->TXBTIE = (1UL << ((get_index + (pending / 2U)) % tx_el_cnt));
+    } else {
+      FDCANx->TXBTIE = 0U;
+    }
+
+    if (popped) {
+      refresh_can_tx_slots_available();
     }
     EXIT_CRITICAL();
   }
 }
 
+// ***************************** RX interrupt coalescing *****************************
+// With a watermark set, the first frame into an empty FIFO turns off the new message
+// interrupt. The FIFO is then drained in one go once the watermark is reached or the
+// bus' timeout is over, whichever comes first, and the new message interrupt is back on.
+static bool can_rx_coalescing[CANS_ARRAY_SIZE];
+static uint32_t can_rx_coalesce_deadline[CANS_ARRAY_SIZE];
+
+static void can_rx_coalesce_start(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number, uint32_t timeout) {
+  FDCANx->IE &= ~FDCAN_IE_RF0NE;
+  can_rx_coalescing[can_number] = true;
+  can_rx_coalesce_deadline[can_number] = microsecond_timer_get() + timeout;
+  can_timer_arm(can_rx_coalesce_deadline[can_number]);
+}
+
+// copies a frame out of an RX FIFO element
+static void fdcan_rx_read(uint8_t can_number, const canfd_fifo *fifo, CANPacket_t *to_push) {
+  bool canfd_frame = ((fifo->header[1] >> 21) & 0x1U);
+  bool brs_frame = ((fifo->header[1] >> 20) & 0x1U);
+
+  to_push->fd = canfd_frame;
+  to_push->returned = 0U;
+  to_push->rejected = 0U;
+  to_push->extended = (fifo->header[0] >> 30) & 0x1U;
+  to_push->addr = ((to_push->extended != 0U) ? (fifo->header[0] & 0x1FFFFFFFU) : ((fifo->header[0] >> 18) & 0x7FFU));
+  to_push->bus = BUS_NUM_FROM_CAN_NUM(can_number);
+  to_push->data_len_code = ((fifo->header[1] >> 16) & 0xFU);
+  to_push->timestamp = microsecond_timer_get();
+
+  uint8_t data_len_w = (dlc_to_len[to_push->data_len_code] / 4U);
+  data_len_w += ((dlc_to_len[to_push->data_len_code] % 4U) > 0U) ? 1U : 0U;
+  for (unsigned int i = 0; i < data_len_w; i++) {
+    WORD_TO_BYTE_ARRAY(&to_push->data[i*4U], fifo->data_word[i]);
+  }
+  can_bus_load_add(can_number, to_push, brs_frame);
+
+  // Enable CAN FD and BRS if CAN FD message was received
+  if (!(bus_config[can_number].canfd_enabled) && (canfd_frame)) {
+    bus_config[can_number].canfd_enabled = true;
+  }
+  if (!(bus_config[can_number].brs_enabled) && (brs_frame)) {
+    bus_config[can_number].brs_enabled = true;
+  }
+}
+
+// FDFDCANx_IT1 IRQ Handler (RX FIFO 1)
+// The IDs steered into FIFO 1 skip the bottom half, they're forwarded and seen by the
+// safety hooks right here, ahead of whatever FIFO 0 has staged
+static void can_rx_fifo1(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+
+  uint32_t ir_reg = FDCANx->IR;
+  FDCANx->IR = (FDCAN_IR_RF1N | FDCAN_IR_RF1L);
+  if ((ir_reg & FDCAN_IR_RF1L) != 0U) {
+    can_health[can_number].total_rx_fifo1_lost_cnt += 1U;
+  }
+
+  while ((FDCANx->RXF1S & FDCAN_RXF1S_F1FL) != 0U) {
+    can_health[can_number].total_rx_cnt += 1U;
+    can_health[can_number].total_rx_fifo1_cnt += 1U;
+
+    // can is live
+    pending_can_live = 1;
+
+    uint32_t rx_fifo_idx = (uint8_t)((FDCANx->RXF1S >> FDCAN_RXF1S_F1GI_Pos) & 0x3FU);
+
+    // same as FIFO 0, skip the oldest element when full in overwrite mode
+    if ((FDCANx->RXF1S & FDCAN_RXF1S_F1F) == FDCAN_RXF1S_F1F) {
+      rx_fifo_idx = ((rx_fifo_idx + 1U) >= FDCAN_RX_FIFO_1_EL_CNT) ? 0U : (rx_fifo_idx + 1U);
+      can_health[can_number].total_rx_fifo1_lost_cnt += 1U;
+    }
+
+    uint32_t RxFIFO1SA = FDCAN_RX_FIFO_1_SA(can_number, bus_config[bus_number].tx_buf_cnt);
+    CANPacket_t to_push;
+    fdcan_rx_read(can_number, (const canfd_fifo *)(RxFIFO1SA + (rx_fifo_idx * FDCAN_RX_FIFO_1_EL_SIZE)), &to_push);
+    can_rx_handle(&to_push, true);
+
+    // update read index
+    FDCANx->RXF1A = rx_fifo_idx;
+  }
+}
+
 // FDFDCANx_IT0 IRQ Handler (RX and errors)
 // blink blue when we are receiving CAN messages
 void can_rx(uint8_t can_number) {
@@ -156,9 +458,21 @@ void can_rx(uint8_t can_number) {
 
   uint32_t ir_reg = FDCANx->IR;
 
-  // Clear all new messages from Rx FIFO 0
-  FDCANx->IR |= FDCAN_IR_RF0N;
-  while((FDCANx->RXF0S & FDCAN_RXF0S_F0FL) != 0U) {
+  // Clear all new messages from Rx FIFO 0, and the watermark flag when coalescing
+  FDCANx->IR = (FDCAN_IR_RF0N | FDCAN_IR_RF0W);
+
+  // same as the watermark llcan_init programs, a FIFO can't hold more than it
+  uint32_t rx_watermark = MIN(bus_config[bus_number].rx_watermark, FDCAN_RX_FIFO_0_EL_CNT(bus_config[bus_number].tx_buf_cnt));
+  uint32_t fill = FDCANx->RXF0S & FDCAN_RXF0S_F0FL;
+  if ((rx_watermark > 0U) && !can_rx_coalescing[can_number] && (fill > 0U) && (fill < rx_watermark)) {
+    can_rx_coalesce_start(FDCANx, can_number, bus_config[bus_number].rx_coalesce_timeout);
+  } else if (can_rx_coalescing[can_number]) {
+    can_rx_coalescing[can_number] = false;
+    FDCANx->IE |= FDCAN_IE_RF0NE;
+  } else {
+  }
+
+  while(!can_rx_coalescing[can_number] && ((FDCANx->RXF0S & FDCAN_RXF0S_F0FL) != 0U)) {
     can_health[can_number].total_rx_cnt += 1U;
 
     // can is live
@@ -169,70 +483,16 @@ void can_rx(uint8_t can_number) {
 
     // Recommended to offset get index by at least +1 if RX FIFO is in overwrite mode and full (datasheet)
     if((FDCANx->RXF0S & FDCAN_RXF0S_F0F) == FDCAN_RXF0S_F0F) {
-      rx_fifo_idx = ((rx_fifo_idx + 1U) >= FDCAN_RX_FIFO_0_EL_CNT) ? 0U : (rx_fifo_idx + 1U);
+      rx_fifo_idx = ((rx_fifo_idx + 1U) >= FDCAN_RX_FIFO_0_EL_CNT(bus_config[bus_number].tx_buf_cnt)) ? 0U : (rx_fifo_idx + 1U);
       can_health[can_number].total_rx_lost_cnt += 1U; // At least one message was lost
     }
 
-    uint32_t RxFIFO0SA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET);
+    uint32_t RxFIFO0SA = FDCAN_RX_FIFO_0_SA(can_number);
     CANPacket_t to_push;
-    canfd_fifo *fifo;
-
-    // getting address
-    fifo = (canfd_fifo *)(RxFIFO0SA + (rx_fifo_idx * FDCAN_RX_FIFO_0_EL_SIZE));
-
-    bool canfd_frame = ((fifo->header[1] >> 21) & 0x1U);
-    bool brs_frame = ((fifo->header[1] >> 20) & 0x1U);
-
-    to_push.fd = canfd_frame;
-    to_push.returned = 0U;
-    to_push.rejected = 0U;
-    to_push.extended = (fifo->header[0] >> 30) & 0x1U;
-    to_push.addr = ((to_push.extended != 0U) ? (fifo->header[0] & 0x1FFFFFFFU) : ((fifo->header[0] >> 18) & 0x7FFU));
-    to_push.bus = bus_number;
-    to_push.data_len_code = ((fifo->header[1] >> 16) & 0xFU);
-
-    uint8_t data_len_w = (dlc_to_len[to_push.data_len_code] / 4U);
-    data_len_w += ((dlc_to_len[to_push.data_len_code] % 4U) > 0U) ? 1U : 0U;
-    for (unsigned int i = 0; i < data_len_w; i++) {
-      WORD_TO_BYTE_ARRAY(&to_push.data[i*4U], fifo->data_word[i]);
-    }
-    can_set_checksum(&to_push);
-
-    // forwarding (panda only)
-    int bus_fwd_num = safety_fwd_hook(bus_number, to_push.addr);
-    if (bus_fwd_num < 0) {
-      bus_fwd_num = bus_config[can_number].forwarding_bus;
-    }
-    if (bus_fwd_num != -1) {
-      CANPacket_t to_send;
-
-      to_send.fd = to_push.fd;
-      to_send.returned = 0U;
-      to_send.rejected = 0U;
-      to_send.extended = to_push.extended;
-      to_send.addr = to_push.addr;
-      to_send.bus = to_push.bus;
-      to_send.data_len_code = to_push.data_len_code;
-      (void)memcpy(to_send.data, to_push.data, dlc_to_len[to_push.data_len_code]);
-      can_set_checksum(&to_send);
-
-      can_send(&to_send, bus_fwd_num, true);
-      can_health[can_number].total_fwd_cnt += 1U;
-    }
+    fdcan_rx_read(can_number, (const canfd_fifo *)(RxFIFO0SA + (rx_fifo_idx * FDCAN_RX_FIFO_0_EL_SIZE)), &to_push);
 
-    safety_rx_invalid += safety_rx_hook(&to_push) ? 0U : 1U;
-    ignition_can_hook(&to_push);
-
-    led_set(LED_BLUE, true);
-    rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
-
-    // Enable CAN FD and BRS if CAN FD message was received
-    if (!(bus_config[can_number].canfd_enabled) && (canfd_frame)) {
-      bus_config[can_number].canfd_enabled = true;
-    }
-    if (!(bus_config[can_number].brs_enabled) && (brs_frame)) {
-      bus_config[can_number].brs_enabled = true;
-    }
+    // forwarding, the safety hooks and the host queues are left to the bottom half
+    can_rx_stage(&to_push);
 
     // update read index
     FDCANx->RXF0A = rx_fifo_idx;
@@ -244,14 +504,27 @@ void can_rx(uint8_t can_number) {
   }
 }
 
+// drains the FIFOs whose timeout is over
+void can_rx_coalesce_poll(uint32_t now, bool *armed, uint32_t *next) {
+  for (uint8_t can_number = 0U; can_number < CANS_ARRAY_SIZE; can_number++) {
+    if (can_rx_coalescing[can_number]) {
+      if ((int32_t)(now - can_rx_coalesce_deadline[can_number]) >= 0) {
+        can_rx(can_number);
+      } else {
+        can_timer_next(armed, next, can_rx_coalesce_deadline[can_number]);
+      }
+    }
+  }
+}
+
 static void FDCAN1_IT0_IRQ_Handler(void) { can_rx(0); }
-static void FDCAN1_IT1_IRQ_Handler(void) { process_can(0); }
+static void FDCAN1_IT1_IRQ_Handler(void) { can_rx_fifo1(0); can_tx_events(0); process_can(0); }
 
 static void FDCAN2_IT0_IRQ_Handler(void) { can_rx(1); }
-static void FDCAN2_IT1_IRQ_Handler(void) { process_can(1); }
+static void FDCAN2_IT1_IRQ_Handler(void) { can_rx_fifo1(1); can_tx_events(1); process_can(1); }
 
 static void FDCAN3_IT0_IRQ_Handler(void) { can_rx(2);  }
-static void FDCAN3_IT1_IRQ_Handler(void) { process_can(2); }
+static void FDCAN3_IT1_IRQ_Handler(void) { can_rx_fifo1(2); can_tx_events(2); process_can(2); }
 
 bool can_init(uint8_t can_number) {
   bool ret = false;
@@ -262,11 +535,20 @@ bool can_init(uint8_t can_number) {
   REGISTER_INTERRUPT(FDCAN2_IT1_IRQn, FDCAN2_IT1_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_2)
   REGISTER_INTERRUPT(FDCAN3_IT0_IRQn, FDCAN3_IT0_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
   REGISTER_INTERRUPT(FDCAN3_IT1_IRQn, FDCAN3_IT1_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
+  REGISTER_INTERRUPT(CAN_RX_SWI_IRQ, can_rx_bottom_half, CAN_RX_SWI_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_RX_SWI)
+  NVIC_SetPriority(CAN_RX_SWI_IRQ, CAN_RX_SWI_PRIORITY);
+  NVIC_EnableIRQ(CAN_RX_SWI_IRQ);
 
   if (can_number != 0xffU) {
     FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+    // the init drops whatever is still pending
+    can_tx_fail_in_flight(can_number);
     ret &= can_set_speed(can_number);
-    ret &= llcan_init(FDCANx);
+    uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+    ret &= llcan_init(FDCANx, bus_config[bus_number].tx_buf_cnt, bus_config[bus_number].tx_id_priority, bus_config[bus_number].rx_watermark);
+    ret &= can_set_filters(can_number);
+    // the init turned the new message interrupt back on
+    can_rx_coalescing[can_number] = false;
     // in case there are queued up messages
     process_can(can_number);
   }
@@ -11,7 +11,22 @@ typedef struct {
   volatile uint32_t data_word[CANPACKET_DATA_SIZE_MAX/4U];
 } canfd_fifo;
 
+// filter elements of a bus, built before programming them in one go
+typedef struct {
+  uint32_t std_el[FDCAN_STD_FILTER_CNT];
+  uint32_t ext_el[FDCAN_EXT_FILTER_CNT * 2U];
+  uint32_t std_cnt;
+  uint32_t ext_cnt;
+  bool std_open; // last standard dual-ID element still has a free ID
+  bool ext_open;
+  bool overflow;
+} fdcan_filter_list_t;
+
 #define CANS_ARRAY_SIZE 3
+
+// Echoes of the frames handed to the hardware wait here, by message marker, for their TX
+// event. Frames in flight are at most every TX element plus every unread event.
+#define CAN_TX_ECHO_CNT 64U
 extern FDCAN_GlobalTypeDef *cans[CANS_ARRAY_SIZE];
 
 #define CAN_ACK_ERROR 3U
@@ -20,7 +35,7 @@ void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number);
 void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg);
 
 // ***************************** CAN *****************************
-// FDFDCANx_IT1 IRQ Handler (TX)
+// FDFDCANx_IT1 IRQ Handler (TX, TX events and RX FIFO 1)
 void process_can(uint8_t can_number);
 // FDFDCANx_IT0 IRQ Handler (RX and errors)
 // blink blue when we are receiving CAN messages
@@ -27,7 +27,10 @@ void handle_interrupt(IRQn_Type irq_type){
   EXIT_CRITICAL();
 
   interrupts[irq_type].call_counter++;
+  uint32_t start = microsecond_timer_get();
   interrupts[irq_type].handler();
+  // includes the time spent in interrupts preempting this one
+  interrupts[irq_type].duration_peak = MAX(interrupts[irq_type].duration_peak, get_ts_elapsed(microsecond_timer_get(), start));
 
   // Check that the interrupts don't fire too often
   if (check_interrupt_rate && (interrupts[irq_type].call_counter > interrupts[irq_type].max_call_rate)) {
@@ -56,6 +59,8 @@ void interrupt_timer_handler(void) {
       // Reset interrupt counters
       interrupts[i].call_rate = interrupts[i].call_counter;
       interrupts[i].call_counter = 0U;
+      interrupts[i].max_duration = interrupts[i].duration_peak;
+      interrupts[i].duration_peak = 0U;
     }
 
     // Calculate interrupt load
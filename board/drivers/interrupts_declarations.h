@@ -7,6 +7,8 @@ typedef struct interrupt {
   uint32_t call_rate;
   uint32_t max_call_rate;   // Call rate is defined as the amount of calls each second
   uint32_t call_rate_fault;
+  uint32_t duration_peak;  // us, longest run of the handler so far this second
+  uint32_t max_duration;   // us, longest run of the handler over the last second
 } interrupt;
 
 void interrupt_timer_init(void);
@@ -21,7 +23,9 @@ extern interrupt interrupts[NUM_INTERRUPTS];
   interrupts[irq_num].call_counter = 0U;   \
   interrupts[irq_num].call_rate = 0U;   \
   interrupts[irq_num].max_call_rate = (call_rate_max); \
-  interrupts[irq_num].call_rate_fault = (rate_fault);
+  interrupts[irq_num].call_rate_fault = (rate_fault); \
+  interrupts[irq_num].duration_peak = 0U; \
+  interrupts[irq_num].max_duration = 0U;
 
 extern float interrupt_load;
 
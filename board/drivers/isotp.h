@@ -0,0 +1,350 @@
+#include "isotp_declarations.h"
+
+isotp_channel_t isotp_channels[ISOTP_CHANNEL_CNT];
+
+// received PDUs and TX results waiting for the host
+static uint8_t isotp_stream[ISOTP_STREAM_SIZE];
+static uint32_t isotp_stream_w_ptr = 0U;
+static uint32_t isotp_stream_r_ptr = 0U;
+
+#define ISOTP_PCI_SF 0x00U
+#define ISOTP_PCI_FF 0x10U
+#define ISOTP_PCI_CF 0x20U
+#define ISOTP_PCI_FC 0x30U
+#define ISOTP_FC_CTS 0U
+#define ISOTP_FC_WAIT 1U
+#define ISOTP_FC_OVERFLOW 2U
+#define ISOTP_FC_OVERFLOW 2U
+
+// whole records only, a record that doesn't fit is dropped
+static bool isotp_event(uint8_t ch, uint8_t type, const uint8_t *data, uint32_t len) {
+  uint32_t used = (isotp_stream_w_ptr >= isotp_stream_r_ptr) ? (isotp_stream_w_ptr - isotp_stream_r_ptr) : (ISOTP_STREAM_SIZE - isotp_stream_r_ptr + isotp_stream_w_ptr);
+  bool ret = (used + ISOTP_EVENT_HEAD_SIZE + len) < ISOTP_STREAM_SIZE;
+  if (ret) {
+    uint8_t head[ISOTP_EVENT_HEAD_SIZE] = {ch, type, (uint8_t)(len & 0xFFU), (uint8_t)(len >> 8U)};
+    uint32_t w_ptr = isotp_stream_w_ptr;
+    for (uint32_t i = 0U; i < (ISOTP_EVENT_HEAD_SIZE + len); i++) {
+      isotp_stream[w_ptr] = (i < ISOTP_EVENT_HEAD_SIZE) ? head[i] : data[i - ISOTP_EVENT_HEAD_SIZE];
+      w_ptr = ((w_ptr + 1U) == ISOTP_STREAM_SIZE) ? 0U : (w_ptr + 1U);
+    }
+    isotp_stream_w_ptr = w_ptr;
+  }
+  return ret;
+}
+
+static void isotp_error(uint8_t ch, uint8_t error) {
+  (void)isotp_event(ch, ISOTP_EVENT_ERROR, &error, 1U);
+}
+
+// control requests come in through interrupts of the same priority as the writers
+uint32_t isotp_read(uint8_t *dst, uint32_t max_len) {
+  uint32_t len = 0U;
+  while ((len < max_len) && (isotp_stream_r_ptr != isotp_stream_w_ptr)) {
+    dst[len] = isotp_stream[isotp_stream_r_ptr];
+    isotp_stream_r_ptr = ((isotp_stream_r_ptr + 1U) == ISOTP_STREAM_SIZE) ? 0U : (isotp_stream_r_ptr + 1U);
+    len++;
+  }
+  return len;
+}
+
+// frames whose length isn't padded go out as short as possible
+static bool isotp_send_frame(isotp_channel_t *chan, const uint8_t *data, uint8_t len) {
+  CANPacket_t to_send = {0};
+  uint8_t frame_len = ((chan->flags & ISOTP_FLAG_PADDING) != 0U) ? 8U : len;
+  to_send.extended = ((chan->flags & ISOTP_FLAG_EXTENDED) != 0U) ? 1U : 0U;
+  to_send.addr = chan->tx_id;
+  to_send.bus = chan->bus;
+  to_send.data_len_code = frame_len;
+  (void)memset(to_send.data, chan->padding, frame_len);
+  (void)memcpy(to_send.data, data, len);
+
+  can_rx_hooks_catch_up();
+  bool allowed = (safety_tx_hook(&to_send) != 0);
+  if (allowed) {
+    can_send(&to_send, chan->bus, true);
+  } else {
+    safety_tx_blocked += 1U;
+  }
+  return allowed;
+}
+
+static void isotp_send_fc(isotp_channel_t *chan, uint8_t status) {
+  uint8_t fc[3] = {ISOTP_PCI_FC | status, chan->block_size, chan->stmin};
+  (void)isotp_send_frame(chan, fc, 3U);
+}
+
+// STmin as it's coded in flow control frames
+static uint32_t isotp_stmin_us(uint8_t stmin) {
+  uint32_t ret;
+  if (stmin <= 0x7FU) {
+    ret = (uint32_t)stmin * 1000U;
+  } else if ((stmin >= 0xF1U) && (stmin <= 0xF9U)) {
+    ret = ((uint32_t)stmin - 0xF0U) * 100U;
+  } else {
+    // reserved values are treated as the longest one
+    ret = 127000U;
+  }
+  return ret;
+}
+
+static void isotp_tx_start(uint8_t ch, isotp_channel_t *chan, uint16_t len) {
+  uint8_t frame[8];
+  chan->tx_len = len;
+  if (len <= 7U) {
+    frame[0] = ISOTP_PCI_SF | (uint8_t)len;
+    (void)memcpy(&frame[1], chan->buf, len);
+    chan->tx_state = ISOTP_STATE_IDLE;
+    if (isotp_send_frame(chan, frame, (uint8_t)(len + 1U))) {
+      (void)isotp_event(ch, ISOTP_EVENT_TX_DONE, NULL, 0U);
+    } else {
+      isotp_error(ch, ISOTP_ERROR_BLOCKED);
+    }
+  } else {
+    frame[0] = ISOTP_PCI_FF | (uint8_t)(len >> 8U);
+    frame[1] = (uint8_t)(len & 0xFFU);
+    (void)memcpy(&frame[2], chan->buf, 6U);
+    chan->tx_pos = 6U;
+    chan->tx_sn = 1U;
+    if (isotp_send_frame(chan, frame, 8U)) {
+      chan->tx_state = ISOTP_STATE_WAIT_FC;
+      chan->tx_deadline = microsecond_timer_get() + ISOTP_TIMEOUT;
+    } else {
+      chan->tx_state = ISOTP_STATE_IDLE;
+      isotp_error(ch, ISOTP_ERROR_BLOCKED);
+    }
+  }
+}
+
+static void isotp_config(isotp_channel_t *chan, const uint8_t *data) {
+  chan->open = false;
+  chan->tx_state = ISOTP_STATE_IDLE;
+  chan->rx_state = ISOTP_STATE_IDLE;
+  if (data[4] < PANDA_BUS_CNT) {
+    chan->flags = data[3];
+    chan->bus = data[4];
+    BYTE_ARRAY_TO_WORD(chan->tx_id, &data[5]);
+    BYTE_ARRAY_TO_WORD(chan->rx_id, &data[9]);
+    chan->tx_id &= 0x1FFFFFFFU;
+    chan->rx_id &= 0x1FFFFFFFU;
+    chan->stmin = data[13];
+    chan->block_size = data[14];
+    chan->padding = data[15];
+    chan->open = true;
+  }
+}
+
+// endpoint 2 writes come in through interrupts of the same priority as the RX path
+void isotp_write(const uint8_t *data, uint32_t len) {
+  if ((len >= 3U) && (data[1] < ISOTP_CHANNEL_CNT)) {
+    uint8_t ch = data[1];
+    isotp_channel_t *chan = &isotp_channels[ch];
+    if (data[2] == ISOTP_OP_CONFIG) {
+      if (len >= ISOTP_CONFIG_SIZE) {
+        isotp_config(chan, data);
+      }
+    } else if (data[2] == ISOTP_OP_CLOSE) {
+      chan->open = false;
+      chan->tx_state = ISOTP_STATE_IDLE;
+      chan->rx_state = ISOTP_STATE_IDLE;
+    } else if ((len >= 5U) && chan->open && ((chan->tx_state == ISOTP_STATE_IDLE) || (chan->tx_state == ISOTP_STATE_STAGING))) {
+      if (chan->rx_state != ISOTP_STATE_IDLE) {
+        // a segmented PDU is coming in
+        chan->tx_state = ISOTP_STATE_IDLE;
+        isotp_error(ch, ISOTP_ERROR_BUSY);
+      } else {
+        uint32_t offset = data[3] | ((uint32_t)data[4] << 8U);
+        uint32_t cnt = MIN(len - 5U, ISOTP_PDU_SIZE_MAX - MIN(offset, ISOTP_PDU_SIZE_MAX));
+        (void)memcpy(&chan->buf[MIN(offset, ISOTP_PDU_SIZE_MAX)], &data[5], cnt);
+        chan->tx_state = ISOTP_STATE_STAGING;
+        if ((data[2] == ISOTP_OP_SEND) && ((offset + cnt) > 0U)) {
+          isotp_tx_start(ch, chan, (uint16_t)(offset + cnt));
+        }
+      }
+    } else {
+    }
+    isotp_run();
+  }
+}
+
+static void isotp_rx_fc(uint8_t ch, isotp_channel_t *chan, const CANPacket_t *to_push) {
+  if ((chan->tx_state == ISOTP_STATE_WAIT_FC) && (GET_LEN(to_push) >= 3U)) {
+    uint8_t status = to_push->data[0] & 0xFU;
+    if (status == ISOTP_FC_CTS) {
+      chan->tx_block_left = to_push->data[1];
+      chan->tx_stmin = isotp_stmin_us(to_push->data[2]);
+      chan->tx_state = ISOTP_STATE_SEND_CF;
+      chan->tx_deadline = microsecond_timer_get();
+    } else if (status == ISOTP_FC_WAIT) {
+      chan->tx_deadline = microsecond_timer_get() + ISOTP_TIMEOUT;
+    } else {
+      chan->tx_state = ISOTP_STATE_IDLE;
+      isotp_error(ch, ISOTP_ERROR_OVERFLOW);
+    }
+  }
+}
+
+static void isotp_rx_done(uint8_t ch, isotp_channel_t *chan, const uint8_t *data, uint16_t len) {
+  chan->rx_state = ISOTP_STATE_IDLE;
+  if (!isotp_event(ch, ISOTP_EVENT_RX, data, len)) {
+    isotp_error(ch, ISOTP_ERROR_STREAM_FULL);
+  }
+}
+
+static void isotp_rx_frame(uint8_t ch, isotp_channel_t *chan, const CANPacket_t *to_push) {
+  uint8_t len = GET_LEN(to_push);
+  uint8_t pci = to_push->data[0] & 0xF0U;
+  if ((pci == ISOTP_PCI_SF) && (len >= 1U)) {
+    uint8_t sf_len = to_push->data[0] & 0xFU;
+    if ((sf_len > 0U) && (sf_len < len)) {
+      // a new PDU replaces one that was still coming in, it doesn't need the buffer
+      isotp_rx_done(ch, chan, &to_push->data[1], sf_len);
+    }
+  } else if ((pci == ISOTP_PCI_FF) && (len == 8U)) {
+    uint16_t ff_len = (uint16_t)(((to_push->data[0] & 0xFU) << 8U) | to_push->data[1]);
+    if ((ff_len > 7U) && (chan->tx_state != ISOTP_STATE_IDLE)) {
+      // the buffer holds a PDU that's staged or going out
+      isotp_send_fc(chan, ISOTP_FC_OVERFLOW);
+      isotp_error(ch, ISOTP_ERROR_BUSY);
+    } else if (ff_len > 7U) {
+      chan->rx_len = ff_len;
+      chan->rx_pos = 6U;
+      chan->rx_sn = 1U;
+      chan->rx_block_cnt = 0U;
+      (void)memcpy(chan->buf, &to_push->data[2], 6U);
+      chan->rx_state = ISOTP_STATE_WAIT_CF;
+      chan->rx_deadline = microsecond_timer_get() + ISOTP_TIMEOUT;
+      isotp_send_fc(chan, ISOTP_FC_CTS);
+    }
+  } else if ((pci == ISOTP_PCI_CF) && (len >= 2U) && (chan->rx_state == ISOTP_STATE_WAIT_CF)) {
+    if ((to_push->data[0] & 0xFU) != chan->rx_sn) {
+      chan->rx_state = ISOTP_STATE_IDLE;
+      isotp_error(ch, ISOTP_ERROR_SEQUENCE);
+    } else {
+      uint16_t cnt = MIN((uint16_t)(len - 1U), chan->rx_len - chan->rx_pos);
+      (void)memcpy(&chan->buf[chan->rx_pos], &to_push->data[1], cnt);
+      chan->rx_pos += cnt;
+      chan->rx_sn = (chan->rx_sn + 1U) & 0xFU;
+      chan->rx_deadline = microsecond_timer_get() + ISOTP_TIMEOUT;
+      if (chan->rx_pos >= chan->rx_len) {
+        isotp_rx_done(ch, chan, chan->buf, chan->rx_len);
+      } else if (chan->block_size > 0U) {
+        chan->rx_block_cnt += 1U;
+        if (chan->rx_block_cnt >= chan->block_size) {
+          chan->rx_block_cnt = 0U;
+          isotp_send_fc(chan, ISOTP_FC_CTS);
+        }
+      } else {
+      }
+    }
+  } else if (pci == ISOTP_PCI_FC) {
+    isotp_rx_fc(ch, chan, to_push);
+  } else {
+  }
+}
+
+// called for every frame queued for the host, returns whether a channel took it
+bool isotp_rx(const CANPacket_t *to_push) {
+  bool ret = false;
+  if ((to_push->returned == 0U) && (to_push->rejected == 0U)) {
+    for (uint8_t ch = 0U; ch < ISOTP_CHANNEL_CNT; ch++) {
+      isotp_channel_t *chan = &isotp_channels[ch];
+      if (chan->open && (chan->bus == to_push->bus) && (chan->rx_id == to_push->addr) &&
+          (((chan->flags & ISOTP_FLAG_EXTENDED) != 0U) == (to_push->extended != 0U))) {
+        isotp_rx_frame(ch, chan, to_push);
+        ret = true;
+        break;
+      }
+    }
+    if (ret) {
+      isotp_run();
+    }
+  }
+  return ret;
+}
+
+static void isotp_send_cf(uint8_t ch, isotp_channel_t *chan, uint32_t now) {
+  if (can_tx_queued(chan->bus) >= ISOTP_TX_QUEUE_DEPTH) {
+    // let the bus catch up first
+    chan->tx_deadline = now + ISOTP_GRANULARITY;
+  } else {
+    uint8_t frame[8];
+    uint8_t cnt = (uint8_t)MIN(7U, (uint32_t)chan->tx_len - chan->tx_pos);
+    frame[0] = ISOTP_PCI_CF | chan->tx_sn;
+    (void)memcpy(&frame[1], &chan->buf[chan->tx_pos], cnt);
+    if (!isotp_send_frame(chan, frame, cnt + 1U)) {
+      chan->tx_state = ISOTP_STATE_IDLE;
+      isotp_error(ch, ISOTP_ERROR_BLOCKED);
+    } else {
+      chan->tx_pos += cnt;
+      chan->tx_sn = (chan->tx_sn + 1U) & 0xFU;
+      if (chan->tx_pos >= chan->tx_len) {
+        chan->tx_state = ISOTP_STATE_IDLE;
+        (void)isotp_event(ch, ISOTP_EVENT_TX_DONE, NULL, 0U);
+      } else if (chan->tx_block_left == 1U) {
+        // end of the block
+        chan->tx_state = ISOTP_STATE_WAIT_FC;
+        chan->tx_deadline = now + ISOTP_TIMEOUT;
+      } else {
+        chan->tx_block_left -= (chan->tx_block_left > 0U) ? 1U : 0U;
+        chan->tx_deadline = now + MAX(chan->tx_stmin, ISOTP_GRANULARITY);
+      }
+    }
+  }
+}
+
+// a staged PDU has no deadline
+static bool isotp_tx_waiting(const isotp_channel_t *chan) {
+  return (chan->tx_state == ISOTP_STATE_WAIT_FC) || (chan->tx_state == ISOTP_STATE_SEND_CF);
+}
+
+// handles everything that's due and sets up the timer compare for the next deadline
+void isotp_run(void) {
+  bool pending = true;
+  while (pending) {
+    uint32_t now = microsecond_timer_get();
+    uint32_t next_ts = 0U;
+    bool any = false;
+
+    for (uint8_t ch = 0U; ch < ISOTP_CHANNEL_CNT; ch++) {
+      isotp_channel_t *chan = &isotp_channels[ch];
+      if (isotp_tx_waiting(chan)) {
+        if (((int32_t)(now - chan->tx_deadline) + (int32_t)ISOTP_GRANULARITY) > 0) {
+          if (chan->tx_state == ISOTP_STATE_SEND_CF) {
+            isotp_send_cf(ch, chan, now);
+          } else {
+            chan->tx_state = ISOTP_STATE_IDLE;
+            isotp_error(ch, ISOTP_ERROR_TIMEOUT_FC);
+          }
+        }
+      }
+      if ((chan->rx_state == ISOTP_STATE_WAIT_CF) && (((int32_t)(now - chan->rx_deadline) + (int32_t)ISOTP_GRANULARITY) > 0)) {
+        chan->rx_state = ISOTP_STATE_IDLE;
+        isotp_error(ch, ISOTP_ERROR_TIMEOUT_CF);
+      }
+
+      if (isotp_tx_waiting(chan) && (!any || ((int32_t)(chan->tx_deadline - next_ts) < 0))) {
+        next_ts = chan->tx_deadline;
+        any = true;
+      }
+      if ((chan->rx_state != ISOTP_STATE_IDLE) && (!any || ((int32_t)(chan->rx_deadline - next_ts) < 0))) {
+        next_ts = chan->rx_deadline;
+        any = true;
+      }
+    }
+
+    if (any) {
+      MICROSECOND_TIMER->CCR3 = next_ts;
+      MICROSECOND_TIMER->DIER |= TIM_DIER_CC3IE;
+    } else {
+      MICROSECOND_TIMER->DIER &= ~TIM_DIER_CC3IE;
+    }
+    // the compare only fires on an exact match, go again if the next deadline passed meanwhile
+    pending = any && ((int32_t)(microsecond_timer_get() - next_ts) >= 0);
+  }
+}
+
+void isotp_irq_handler(void) {
+  // status bits are rc_w0
+  MICROSECOND_TIMER->SR = (uint32_t)~TIM_SR_CC3IF;
+  isotp_run();
+}
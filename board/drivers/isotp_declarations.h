@@ -0,0 +1,93 @@
+#pragma once
+
+// ********************* ISO-TP channels *********************
+// ISO 15765-2 transport over classic CAN frames with normal addressing. The firmware
+// segments and reassembles PDUs and handles flow control and its timing, so only whole
+// PDUs cross USB/SPI. Every frame sent still goes through the safety TX hook. Frames
+// with a channel's RX ID on its bus are taken by the channel and aren't queued for the
+// host. The host sets up channels over endpoint 2 (selector byte ISOTP_EP2_SELECTOR):
+//   [selector, channel, ISOTP_OP_CONFIG, flags, bus, tx_id, rx_id, stmin, block_size, padding]
+//   [selector, channel, ISOTP_OP_DATA or ISOTP_OP_SEND, offset, payload bytes...]
+//   [selector, channel, ISOTP_OP_CLOSE]
+// Words and the offset are little endian. A PDU is staged and goes out once the chunk
+// with ISOTP_OP_SEND comes in. stmin and block_size are what the channel asks for in
+// its flow control frames. Received PDUs and the outcome of sends are read from the
+// event stream, records of [channel, ISOTP_EVENT_*, length, data...].
+// A channel has one PDU buffer, so it's half duplex: a PDU that's staged or going out
+// and a segmented one coming in exclude each other, single frames always go through.
+// RAM: 4 channels of 4,140 bytes and the 8,192 byte stream are 24,752 bytes of .bss, in
+// the 128K of DTCM on H7 and in the 128K of SRAM1 below the stack on F4.
+#define ISOTP_EP2_SELECTOR 0x84U
+#define ISOTP_CHANNEL_CNT 4U
+#define ISOTP_PDU_SIZE_MAX 4095U
+#define ISOTP_STREAM_SIZE 8192U
+#define ISOTP_TIMEOUT 1000000U // us, N_Bs and N_Cr
+// deadlines this close together are handled by the same interrupt
+#define ISOTP_GRANULARITY 100U // us
+#define ISOTP_INTERRUPT_RATE (1000000U / ISOTP_GRANULARITY)
+// consecutive frames wait for the bus' TX queue to drain down to this
+#define ISOTP_TX_QUEUE_DEPTH 2U
+
+#define ISOTP_OP_CONFIG 0U
+#define ISOTP_OP_DATA 1U
+#define ISOTP_OP_SEND 2U
+#define ISOTP_OP_CLOSE 3U
+#define ISOTP_CONFIG_SIZE 16U
+
+#define ISOTP_FLAG_EXTENDED 0x1U // 29 bit IDs
+#define ISOTP_FLAG_PADDING 0x2U  // pad frames to 8 bytes
+
+#define ISOTP_EVENT_RX 0U      // a PDU was received
+#define ISOTP_EVENT_TX_DONE 1U // the staged PDU is out
+#define ISOTP_EVENT_ERROR 2U   // one ISOTP_ERROR_* byte
+#define ISOTP_EVENT_HEAD_SIZE 4U
+
+#define ISOTP_ERROR_TIMEOUT_FC 0U  // no flow control frame in time
+#define ISOTP_ERROR_TIMEOUT_CF 1U  // no consecutive frame in time
+#define ISOTP_ERROR_SEQUENCE 2U    // consecutive frame out of sequence
+#define ISOTP_ERROR_OVERFLOW 3U    // the receiver can't take a PDU this long
+#define ISOTP_ERROR_BLOCKED 4U     // the safety model didn't allow a frame
+#define ISOTP_ERROR_STREAM_FULL 5U // received PDUs were dropped, the host didn't read them out
+#define ISOTP_ERROR_BUSY 6U        // the PDU buffer is taken by the other direction, the PDU was dropped
+
+#define ISOTP_STATE_IDLE 0U
+#define ISOTP_STATE_WAIT_FC 1U
+#define ISOTP_STATE_SEND_CF 2U
+#define ISOTP_STATE_WAIT_CF 3U
+#define ISOTP_STATE_STAGING 4U // a PDU is being uploaded
+
+typedef struct {
+  bool open;
+  uint8_t flags;
+  uint8_t bus;
+  uint32_t tx_id;
+  uint32_t rx_id;
+  uint8_t stmin;
+  uint8_t block_size;
+  uint8_t padding;
+
+  uint8_t tx_state;
+  uint16_t tx_len;
+  uint16_t tx_pos;
+  uint8_t tx_sn;
+  uint8_t tx_block_left; // consecutive frames until the next flow control, 0 for no limit
+  uint32_t tx_stmin;     // us
+  uint32_t tx_deadline;
+
+  uint8_t rx_state;
+  uint16_t rx_len;
+  uint16_t rx_pos;
+  uint8_t rx_sn;
+  uint8_t rx_block_cnt;
+  uint32_t rx_deadline;
+
+  // the PDU being staged or sent, or the one coming in
+  uint8_t buf[ISOTP_PDU_SIZE_MAX];
+} isotp_channel_t;
+
+extern isotp_channel_t isotp_channels[ISOTP_CHANNEL_CNT];
+
+void isotp_write(const uint8_t *data, uint32_t len);
+uint32_t isotp_read(uint8_t *dst, uint32_t max_len);
+void isotp_run(void);
+void isotp_irq_handler(void);
@@ -11,6 +11,13 @@ void microsecond_timer_init(void) {
   MICROSECOND_TIMER->EGR = TIM_EGR_UG;
 }
 
+// compare channel 1 interrupts the periodic CAN TX scheduler, channel 2 the CAN burst playback,
+// channel 3 the ISO-TP channels and channel 4 the CAN TX shapers and FDCAN RX interrupt coalescing
+void microsecond_timer_irq_init(void) {
+  MICROSECOND_TIMER->SR = 0U;
+  NVIC_EnableIRQ(MICROSECOND_TIMER_IRQ);
+}
+
 uint32_t microsecond_timer_get(void) {
   return MICROSECOND_TIMER->CNT;
 }
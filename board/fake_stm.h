@@ -9,9 +9,15 @@
 #define ALLOW_DEBUG
 #define PANDA
 
+#define CAN_TX_BUF_CNT_DEFAULT 1U
+#define CAN_TX_BUF_CNT_MAX 1U
+
 #define ENTER_CRITICAL() 0
 #define EXIT_CRITICAL() 0
 
+// tests run the queues across real threads, so use a full fence
+#define __DMB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 void print(const char *a) {
   printf("%s", a);
 }
@@ -22,8 +28,27 @@ void puth(unsigned int i) {
 
 typedef struct {
   uint32_t CNT;
+  uint32_t CCR1;
+  uint32_t CCR2;
+  uint32_t CCR3;
+  uint32_t CCR4;
+  uint32_t DIER;
+  uint32_t SR;
 } TIM_TypeDef;
 
+#define TIM_DIER_CC1IE (1U << 1)
+#define TIM_SR_CC1IF (1U << 1)
+#define TIM_DIER_CC2IE (1U << 2)
+#define TIM_SR_CC2IF (1U << 2)
+#define TIM_DIER_CC3IE (1U << 3)
+#define TIM_SR_CC3IF (1U << 3)
+#define TIM_DIER_CC4IE (1U << 4)
+#define TIM_SR_CC4IF (1U << 4)
+
+// the bottom half is run by hand
+#define CAN_RX_SWI_IRQ 0
+#define NVIC_SetPendingIRQ(irq) UNUSED(irq)
+
 TIM_TypeDef timer;
 TIM_TypeDef *MICROSECOND_TIMER = &timer;
 uint32_t microsecond_timer_get(void);
@@ -33,6 +33,8 @@
 #define FAULT_SIREN_MALFUNCTION             (1UL << 25)
 #define FAULT_HEARTBEAT_LOOP_WATCHDOG       (1UL << 26)
 #define FAULT_INTERRUPT_RATE_SOUND_DMA      (1UL << 27)
+#define FAULT_INTERRUPT_RATE_TIM2           (1UL << 28)
+#define FAULT_INTERRUPT_RATE_CAN_RX_SWI     (1UL << 29)
 
 // Permanent faults
 #define PERMANENT_FAULTS 0U
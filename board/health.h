@@ -30,7 +30,7 @@ struct __attribute__((packed)) health_t {
   uint8_t som_reset_triggered;
 };
 
-#define CAN_HEALTH_PACKET_VERSION 5
+#define CAN_HEALTH_PACKET_VERSION 14
 typedef struct __attribute__((packed)) {
   uint8_t bus_off;
   uint32_t bus_off_cnt;
@@ -58,4 +58,26 @@ typedef struct __attribute__((packed)) {
   uint32_t irq1_call_rate;
   uint32_t irq2_call_rate;
   uint32_t can_core_reset_cnt;
+  uint32_t total_rx_overflow_cnt; // Messages dropped because the bus' RX queue to the host was full
+  uint32_t total_tx_overflow_cnt; // Messages from the host dropped because the bus' TX queue was full
+  uint16_t bus_load_100ms; // 0.1 %, estimated from the frames on the bus over the last 100 ms
+  uint16_t bus_load_1s; // 0.1 %, over the last second
+  uint16_t bus_load_100ms_peak;
+  uint16_t bus_load_1s_peak;
+  uint16_t irq0_max_time; // us, longest run of the IRQ handler over the last second
+  uint16_t irq1_max_time;
+  uint16_t irq2_max_time;
+  uint16_t rx_bottom_half_max_time; // us, longest run of the deferred RX work (shared by all buses) over the last second
+  uint32_t total_rx_fifo1_cnt; // Messages received through Rx FIFO 1, also counted in total_rx_cnt
+  uint32_t total_rx_fifo1_lost_cnt; // Rx FIFO 1 message lost due to FIFO full condition
+  uint16_t rx_max_latency; // us, longest from reading a frame out of the hardware to the safety hook since the last read
+  uint16_t rx_fifo1_max_latency; // us, the same for frames from Rx FIFO 1
+  uint32_t total_tx_replaced_cnt; // Messages from the host that replaced a queued one with the same ID
+  uint32_t total_tx_stale_cnt; // Messages from the host dropped from the TX queue past their deadline
+  uint16_t tx_queue_used; // Messages in the bus' normal priority TX queue
+  uint16_t tx_hp_queue_used; // Messages in the bus' high priority TX queue
+  uint32_t total_tx_hp_overflow_cnt; // Messages from the host dropped because the bus' high priority TX queue was full
+  uint32_t total_tx_shaped_cnt; // Messages held back by the bus' TX shaper
+  uint32_t tx_shaper_max_delay; // us, longest the TX shaper held a message back since the last read
+  uint32_t total_tx_event_lost_cnt; // Messages whose TX event was lost, their echoes come back failed
 } can_health_t;
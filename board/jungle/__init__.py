@@ -125,7 +125,7 @@ class PandaJungle(Panda):
 
   # Returns tuple with health packet version and CAN packet/USB packet version
   def get_packets_versions(self):
-    dat = self._handle.controlRead(PandaJungle.REQUEST_IN, 0xdd, 0, 0, 3)
+    dat = self._handle.controlRead(PandaJungle.REQUEST_IN, 0xdd, PandaJungle.CAN_PACKET_VERSION, 0, 3)
     if dat and len(dat) == 3:
       a = struct.unpack("BBB", dat)
       return (a[0], a[1], a[2])
@@ -20,6 +20,7 @@
 #else
   #include "board/drivers/bxcan.h"
 #endif
+#include "board/drivers/can_burst.h"
 
 #include "board/obj/gitversion.h"
 
@@ -56,16 +57,21 @@ void tick_handler(void) {
     if (generated_can_traffic) {
       for (int i = 0; i < 3; i++) {
         if (can_health[i].transmit_error_cnt >= 128) {
-          (void)llcan_init(CANIF_FROM_CAN_NUM(i));
+          (void)can_init(i);
         }
       }
     }
 
+    // nothing else lets host writes through once a stuck TX queue timed out
+    refresh_can_tx_slots_available();
+
     // decimated to 1Hz
     if ((loop_counter % 8) == 0U) {
       #ifdef DEBUG
         print("** blink ");
-        print("rx:"); puth4(can_rx_q.r_ptr); print("-"); puth4(can_rx_q.w_ptr); print("  ");
+        print("rx1:"); puth4(can_rx1_q.r_ptr); print("-"); puth4(can_rx1_q.w_ptr); print("  ");
+        print("rx2:"); puth4(can_rx2_q.r_ptr); print("-"); puth4(can_rx2_q.w_ptr); print("  ");
+        print("rx3:"); puth4(can_rx3_q.r_ptr); print("-"); puth4(can_rx3_q.w_ptr); print("  ");
         print("tx1:"); puth4(can_tx1_q.r_ptr); print("-"); puth4(can_tx1_q.w_ptr); print("  ");
         print("tx2:"); puth4(can_tx2_q.r_ptr); print("-"); puth4(can_tx2_q.w_ptr); print("  ");
         print("tx3:"); puth4(can_tx3_q.r_ptr); print("-"); puth4(can_tx3_q.w_ptr); print("\n");
@@ -114,7 +120,6 @@ void tick_handler(void) {
         *(uint16_t *) &pkt.data[0] = current_board->get_sbu_mV(i + 1U, SBU1);
         *(uint16_t *) &pkt.data[2] = current_board->get_sbu_mV(i + 1U, SBU2);
         pkt.data[4] = (ignition_bitmask >> i) & 1U;
-        can_set_checksum(&pkt);
         can_send(&pkt, 0U, false);
       }
     }
@@ -171,6 +176,10 @@ int main(void) {
   REGISTER_INTERRUPT(TICK_TIMER_IRQ, tick_handler, 10U, FAULT_INTERRUPT_RATE_TICK)
   tick_timer_init();
 
+  // CAN burst playback
+  REGISTER_INTERRUPT(MICROSECOND_TIMER_IRQ, can_burst_irq_handler, CAN_BURST_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_TIM2)
+  microsecond_timer_irq_init();
+
 #ifdef DEBUG
   print("DEBUG ENABLED\n");
 #endif
@@ -212,9 +221,11 @@ int main(void) {
           to_send.bus = i % 3U;
           to_send.data_len_code = i % 8U;
           (void)memcpy(to_send.data, "\xff\xff\xff\xff\xff\xff\xff\xff", dlc_to_len[to_send.data_len_code]);
-          can_set_checksum(&to_send);
 
+          // the queues are lock-free for ISRs only, we're in thread context here
+          ENTER_CRITICAL();
           can_send(&to_send, to_send.bus, true);
+          EXIT_CRITICAL();
         }
       }
 
@@ -88,16 +88,26 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       break;
     // **** 0xc2: CAN health stats
     case 0xc2:
-      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= USBPACKET_MAX_SIZE);
+      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= CONTROL_RESP_MAX_SIZE);
       if (req->param1 < 3U) {
         update_can_health_pkt(req->param1, 0U);
+        can_bus_load_update(req->param1);
         can_health[req->param1].can_speed = (bus_config[req->param1].can_speed / 10U);
         can_health[req->param1].can_data_speed = (bus_config[req->param1].can_data_speed / 10U);
         can_health[req->param1].canfd_enabled = bus_config[req->param1].canfd_enabled;
         can_health[req->param1].brs_enabled = bus_config[req->param1].brs_enabled;
         can_health[req->param1].canfd_non_iso = bus_config[req->param1].canfd_non_iso;
+        uint8_t bus = BUS_NUM_FROM_CAN_NUM(req->param1);
+        if (bus < PANDA_BUS_CNT) {
+          can_health[req->param1].tx_queue_used = can_slots_used(can_queues[bus]);
+          can_health[req->param1].tx_hp_queue_used = can_slots_used(can_hp_queues[bus]);
+        }
         resp_len = sizeof(can_health[req->param1]);
         (void)memcpy(resp, &can_health[req->param1], resp_len);
+        // latency peaks are since the last read
+        can_health[req->param1].rx_max_latency = 0U;
+        can_health[req->param1].rx_fifo1_max_latency = 0U;
+        can_health[req->param1].tx_shaper_max_delay = 0U;
       }
       break;
     // **** 0xc3: fetch MCU UID
@@ -180,10 +190,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         current_board->set_can_mode(CAN_MODE_NORMAL);
       }
       break;
-    // **** 0xdd: get healthpacket and CANPacket versions
+    // **** 0xdd: get healthpacket and CANPacket versions, param1 is the newest CANPacket version the host speaks
     case 0xdd:
       resp[0] = JUNGLE_HEALTH_PACKET_VERSION;
-      resp[1] = CAN_PACKET_VERSION;
+      resp[1] = comms_can_set_packet_version(req->param1);
       resp[2] = CAN_HEALTH_PACKET_VERSION;
       resp_len = 3;
       break;
@@ -207,14 +217,25 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       can_loopback = (req->param1 > 0U);
       can_init_all();
       break;
+    // **** 0xef: CAN TX credits, free normal then high priority TX queue slots per bus. A stuck bus has none
+    case 0xef:
+      for (uint8_t bus = 0U; bus < PANDA_BUS_CNT; bus++) {
+        bool stalled = can_tx_stalled(bus);
+        uint32_t credits = stalled ? 0U : can_slots_empty(can_queues[bus]);
+        uint32_t hp_credits = stalled ? 0U : can_slots_empty(can_hp_queues[bus]);
+        WORD_TO_BYTE_ARRAY(&resp[bus * 4U], credits);
+        WORD_TO_BYTE_ARRAY(&resp[(PANDA_BUS_CNT + bus) * 4U], hp_credits);
+      }
+      resp_len = PANDA_BUS_CNT * 8U;
+      break;
     // **** 0xf1: Clear CAN ring buffer.
     case 0xf1:
       if (req->param1 == 0xFFFFU) {
         print("Clearing CAN Rx queue\n");
-        can_clear(&can_rx_q);
+        comms_can_rx_clear();
       } else if (req->param1 < PANDA_BUS_CNT) {
         print("Clearing CAN Tx queue\n");
-        can_clear(can_queues[req->param1]);
+        can_tx_clear(req->param1);
       } else {
         print("Clearing CAN CAN ring buffer failed: wrong bus number\n");
       }
@@ -249,6 +270,16 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         UNUSED(ret);
       }
       break;
+    // **** 0xfa: CAN burst playback, param1 is the CAN_BURST_OP_* and param2 its argument
+    case 0xfa:
+      can_burst_control(req->param1, req->param2);
+      break;
+    // **** 0xfb: CAN burst playback stats
+    case 0xfb:
+      COMPILE_TIME_ASSERT(sizeof(can_burst_stats_t) <= CONTROL_RESP_MAX_SIZE);
+      resp_len = sizeof(can_burst_stats_t);
+      (void)memcpy(resp, (uint8_t*)&can_burst_stats, resp_len);
+      break;
     // **** 0xfc: set CAN FD non-ISO mode
     case 0xfc:
       if ((req->param1 < PANDA_CAN_CNT) && current_board->has_canfd) {
@@ -257,6 +288,12 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         UNUSED(ret);
       }
       break;
+    // **** 0xfd: change-only RX on bus param1, param2 is the refresh interval in ms, 0 turns it off
+    case 0xfd:
+      if (req->param1 < PANDA_BUS_CNT) {
+        can_delta_set(req->param1, req->param2);
+      }
+      break;
     default:
       print("NO HANDLER ");
       puth(req->request);
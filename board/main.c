@@ -21,6 +21,9 @@
 #else
   #include "drivers/bxcan.h"
 #endif
+#include "drivers/can_periodic.h"
+#include "drivers/can_burst.h"
+#include "drivers/isotp.h"
 
 #include "power_saving.h"
 
@@ -73,6 +76,9 @@ void set_safety_mode(uint16_t mode, uint16_t param) {
   }
   safety_tx_blocked = 0;
   safety_rx_invalid = 0;
+  // nothing keeps sending from a schedule set up for another safety mode
+  can_periodic_clear();
+  can_burst_control(CAN_BURST_OP_STOP, 0U);
 
   switch (mode_copy) {
     case SAFETY_SILENT:
@@ -125,6 +131,23 @@ bool is_car_safety_mode(uint16_t mode) {
          (mode != SAFETY_ELM327);
 }
 
+// the compare channels of the microsecond timer share its interrupt
+static void microsecond_timer_handler(void) {
+  uint32_t pending = MICROSECOND_TIMER->SR & MICROSECOND_TIMER->DIER;
+  if ((pending & TIM_SR_CC1IF) != 0U) {
+    can_periodic_irq_handler();
+  }
+  if ((pending & TIM_SR_CC2IF) != 0U) {
+    can_burst_irq_handler();
+  }
+  if ((pending & TIM_SR_CC3IF) != 0U) {
+    isotp_irq_handler();
+  }
+  if ((pending & TIM_SR_CC4IF) != 0U) {
+    can_timer_irq_handler();
+  }
+}
+
 // ***************************** main code *****************************
 
 // cppcheck-suppress unusedFunction ; used in headers not included in cppcheck
@@ -160,6 +183,9 @@ static void tick_handler(void) {
     simple_watchdog_kick();
     sound_tick();
 
+    // nothing else lets host writes through once a stuck TX queue timed out
+    refresh_can_tx_slots_available();
+
     // re-init everything that uses harness status
     if (harness.status != prev_harness_status) {
       prev_harness_status = harness.status;
@@ -183,7 +209,9 @@ static void tick_handler(void) {
       }
       #ifdef DEBUG
         print("** blink ");
-        print("rx:"); puth4(can_rx_q.r_ptr); print("-"); puth4(can_rx_q.w_ptr); print("  ");
+        print("rx1:"); puth4(can_rx1_q.r_ptr); print("-"); puth4(can_rx1_q.w_ptr); print("  ");
+        print("rx2:"); puth4(can_rx2_q.r_ptr); print("-"); puth4(can_rx2_q.w_ptr); print("  ");
+        print("rx3:"); puth4(can_rx3_q.r_ptr); print("-"); puth4(can_rx3_q.w_ptr); print("  ");
         print("tx1:"); puth4(can_tx1_q.r_ptr); print("-"); puth4(can_tx1_q.w_ptr); print("  ");
         print("tx2:"); puth4(can_tx2_q.r_ptr); print("-"); puth4(can_tx2_q.w_ptr); print("  ");
         print("tx3:"); puth4(can_tx3_q.r_ptr); print("-"); puth4(can_tx3_q.w_ptr); print("\n");
@@ -349,6 +377,11 @@ int main(void) {
   REGISTER_INTERRUPT(TICK_TIMER_IRQ, tick_handler, 10U, FAULT_INTERRUPT_RATE_TICK)
   tick_timer_init();
 
+  // periodic CAN TX scheduler, CAN burst playback, ISO-TP and the CAN drivers' deadlines.
+  // Each compare channel fires at most once per its granularity, 60k/s together at worst
+  REGISTER_INTERRUPT(MICROSECOND_TIMER_IRQ, microsecond_timer_handler, CAN_PERIODIC_INTERRUPT_RATE + CAN_BURST_INTERRUPT_RATE + ISOTP_INTERRUPT_RATE + CAN_TIMER_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_TIM2)
+  microsecond_timer_irq_init();
+
 #ifdef DEBUG
   print("DEBUG ENABLED\n");
 #endif
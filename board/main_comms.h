@@ -58,6 +58,19 @@ void comms_endpoint2_write(const uint8_t *data, uint32_t len) {
         }
       }
     }
+  } else if ((len != 0U) && (data[0] == CAN_FILTER_EP2_SELECTOR)) {
+    can_filter_write(data, len);
+  } else if ((len != 0U) && (data[0] == CAN_ROUTE_EP2_SELECTOR)) {
+    can_route_write(data, len);
+  } else if ((len != 0U) && (data[0] == CAN_PERIODIC_EP2_SELECTOR)) {
+    can_periodic_write(data, len);
+  } else if ((len != 0U) && (data[0] == CAN_SUB_EP2_SELECTOR)) {
+    can_sub_write(data, len);
+  } else if ((len != 0U) && (data[0] == ISOTP_EP2_SELECTOR)) {
+    isotp_write(data, len);
+  } else if ((len != 0U) && (data[0] == CAN_TX_PRIO_EP2_SELECTOR)) {
+    can_tx_prio_write(data, len);
+  } else {
   }
 }
 
@@ -74,6 +87,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
 #endif
 
   switch (req->request) {
+    // **** 0xa0: read the ISO-TP event stream
+    case 0xa0:
+      resp_len = isotp_read(resp, MIN(req->length, CONTROL_RESP_MAX_SIZE));
+      break;
     // **** 0xa8: get microsecond timer
     case 0xa8:
       time = microsecond_timer_get();
@@ -97,6 +114,18 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       resp[1] = ((fan_state.rpm & 0xFF00U) >> 8U);
       resp_len = 2;
       break;
+    // **** 0xb3: activate the first param1 uploaded TX priority ranges
+    case 0xb3:
+      if (req->param1 <= CAN_TX_PRIO_CNT_MAX) {
+        can_tx_prios_apply(req->param1);
+      }
+      break;
+    // **** 0xb4: set the TX shaper of bus param1 & 0xFF, param1 >> 8 is the CAN_TX_SHAPER_* unit and param2 the rate, 0 turns it off
+    case 0xb4:
+      if (((req->param1 & 0xFFU) < PANDA_BUS_CNT) && ((req->param1 >> 8U) <= CAN_TX_SHAPER_KBPS)) {
+        can_tx_shaper_set(req->param1 & 0xFFU, req->param1 >> 8U, req->param2);
+      }
+      break;
     // **** 0xc0: reset communications
     case 0xc0:
       comms_can_reset();
@@ -108,16 +137,26 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       break;
     // **** 0xc2: CAN health stats
     case 0xc2:
-      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= USBPACKET_MAX_SIZE);
+      COMPILE_TIME_ASSERT(sizeof(can_health_t) <= CONTROL_RESP_MAX_SIZE);
       if (req->param1 < 3U) {
         update_can_health_pkt(req->param1, 0U);
+        can_bus_load_update(req->param1);
         can_health[req->param1].can_speed = (bus_config[req->param1].can_speed / 10U);
         can_health[req->param1].can_data_speed = (bus_config[req->param1].can_data_speed / 10U);
         can_health[req->param1].canfd_enabled = bus_config[req->param1].canfd_enabled;
         can_health[req->param1].brs_enabled = bus_config[req->param1].brs_enabled;
         can_health[req->param1].canfd_non_iso = bus_config[req->param1].canfd_non_iso;
+        uint8_t bus = BUS_NUM_FROM_CAN_NUM(req->param1);
+        if (bus < PANDA_BUS_CNT) {
+          can_health[req->param1].tx_queue_used = can_slots_used(can_queues[bus]);
+          can_health[req->param1].tx_hp_queue_used = can_slots_used(can_hp_queues[bus]);
+        }
         resp_len = sizeof(can_health[req->param1]);
         (void)memcpy(resp, (uint8_t*)(&can_health[req->param1]), resp_len);
+        // latency peaks are since the last read
+        can_health[req->param1].rx_max_latency = 0U;
+        can_health[req->param1].rx_fifo1_max_latency = 0U;
+        can_health[req->param1].tx_shaper_max_delay = 0U;
       }
       break;
     // **** 0xc3: fetch MCU UID
@@ -125,10 +164,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       (void)memcpy(resp, ((uint8_t *)UID_BASE), 12);
       resp_len = 12;
       break;
-    // **** 0xc4: get interrupt call rate
+    // **** 0xc4: get interrupt call rate, or its worst time in us over the last second with param2 = 1
     case 0xc4:
       if (req->param1 < NUM_INTERRUPTS) {
-        uint32_t load = interrupts[req->param1].call_rate;
+        uint32_t load = (req->param2 == 1U) ? interrupts[req->param1].max_duration : interrupts[req->param1].call_rate;
         resp[0] = (load & 0x000000FFU);
         resp[1] = ((load & 0x0000FF00U) >> 8U);
         resp[2] = ((load & 0x00FF0000U) >> 16U);
@@ -200,12 +239,31 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         (void)memcpy(resp, &code[code_len + 64], resp_len);
       }
       break;
+    // **** 0xd5: set CAN RX interrupt coalescing, param1 is the bus | watermark << 8, param2 the timeout in us
+    case 0xd5:
+      {
+        uint8_t bus_number = req->param1 & 0xFFU;
+        uint8_t rx_watermark = (req->param1 >> 8U) & 0xFFU;
+        if ((bus_number < PANDA_BUS_CNT) && ((rx_watermark == 0U) || (req->param2 >= CAN_RX_COALESCE_TIMEOUT_MIN))) {
+          bus_config[bus_number].rx_watermark = rx_watermark;
+          bus_config[bus_number].rx_coalesce_timeout = req->param2;
+          bool ret = can_init(CAN_NUM_FROM_BUS_NUM(bus_number));
+          UNUSED(ret);
+        }
+      }
+      break;
     // **** 0xd6: get version
     case 0xd6:
       COMPILE_TIME_ASSERT(sizeof(gitversion) <= USBPACKET_MAX_SIZE);
       (void)memcpy(resp, gitversion, sizeof(gitversion));
       resp_len = sizeof(gitversion) - 1U;
       break;
+    // **** 0xd7: how bus param1 reports frames that went out, param2 is one of CAN_TX_REPORT_*
+    case 0xd7:
+      if (req->param1 < PANDA_BUS_CNT) {
+        can_tx_report_set(req->param1, req->param2);
+      }
+      break;
     // **** 0xd8: reset ST
     case 0xd8:
       NVIC_SystemReset();
@@ -227,10 +285,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
     case 0xdc:
       set_safety_mode(req->param1, (uint16_t)req->param2);
       break;
-    // **** 0xdd: get healthpacket and CANPacket versions
+    // **** 0xdd: get healthpacket and CANPacket versions, param1 is the newest CANPacket version the host speaks
     case 0xdd:
       resp[0] = HEALTH_PACKET_VERSION;
-      resp[1] = CAN_PACKET_VERSION;
+      resp[1] = comms_can_set_packet_version(req->param1);
       resp[2] = CAN_HEALTH_PACKET_VERSION;
       resp_len = 3;
       break;
@@ -321,14 +379,79 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
     case 0xe8:
       bus_config[req->param1].canfd_auto = req->param2 > 0U;
       break;
+    // **** 0xe9: set CAN RX queue weight for the drain to the host
+    case 0xe9:
+      if ((req->param1 < CAN_RX_QUEUES_ARRAY_SIZE) && (req->param2 > 0U) && (req->param2 <= 0xFFU)) {
+        can_rx_weight[req->param1] = req->param2;
+      }
+      break;
+    // **** 0xea: set CAN TX order, by CAN ID priority or in queue order
+    case 0xea:
+      if (req->param1 < PANDA_BUS_CNT) {
+        bus_config[req->param1].tx_id_priority = (req->param2 != 0U);
+        bool ret = can_init(CAN_NUM_FROM_BUS_NUM(req->param1));
+        UNUSED(ret);
+      }
+      break;
+    // **** 0xeb: set number of hardware TX buffers, on FDCAN the rest is used for RX
+    case 0xeb:
+      if ((req->param1 < PANDA_BUS_CNT) && (req->param2 > 0U) && (req->param2 <= CAN_TX_BUF_CNT_MAX)) {
+        bus_config[req->param1].tx_buf_cnt = req->param2;
+        bool ret = can_init(CAN_NUM_FROM_BUS_NUM(req->param1));
+        UNUSED(ret);
+      }
+      break;
+    // **** 0xec: apply the first param2 & 0xFF uploaded CAN filters, bit 8 rejects frames no filter accepts
+    case 0xec:
+      if ((req->param1 < PANDA_BUS_CNT) && ((req->param2 & 0xFFU) <= CAN_FILTER_CNT_MAX)) {
+        can_filter_config[req->param1].cnt = req->param2 & 0xFFU;
+        can_filter_config[req->param1].reject_default = ((req->param2 >> 8U) & 1U) != 0U;
+        bool ret = can_init(CAN_NUM_FROM_BUS_NUM(req->param1));
+        UNUSED(ret);
+      }
+      break;
+    // **** 0xed: activate the first param1 uploaded CAN routes
+    case 0xed:
+      if (req->param1 <= CAN_ROUTE_CNT_MAX) {
+        can_routes_apply(req->param1);
+        // forwarded buses can't be filtered, re-evaluate the ones that are
+        for (uint8_t bus = 0U; bus < PANDA_BUS_CNT; bus++) {
+          if ((can_filter_config[bus].cnt > 0U) || can_filter_config[bus].reject_default) {
+            bool ret = can_init(CAN_NUM_FROM_BUS_NUM(bus));
+            UNUSED(ret);
+          }
+        }
+      }
+      break;
+    // **** 0xee: CAN route hit counters
+    case 0xee:
+      COMPILE_TIME_ASSERT(sizeof(can_route_hits) <= CONTROL_RESP_MAX_SIZE);
+      resp_len = can_route_cnt * sizeof(can_route_hits[0]);
+      (void)memcpy(resp, (uint8_t*)can_route_hits, resp_len);
+      break;
+    // **** 0xef: CAN TX credits, free normal then high priority TX queue slots per bus. A stuck bus has none
+    case 0xef:
+      for (uint8_t bus = 0U; bus < PANDA_BUS_CNT; bus++) {
+        bool stalled = can_tx_stalled(bus);
+        uint32_t credits = stalled ? 0U : can_slots_empty(can_queues[bus]);
+        uint32_t hp_credits = stalled ? 0U : can_slots_empty(can_hp_queues[bus]);
+        WORD_TO_BYTE_ARRAY(&resp[bus * 4U], credits);
+        WORD_TO_BYTE_ARRAY(&resp[(PANDA_BUS_CNT + bus) * 4U], hp_credits);
+      }
+      resp_len = PANDA_BUS_CNT * 8U;
+      break;
+    // **** 0xf0: run the periodic CAN TX slots in the mask param1 | param2 << 16, stop the others
+    case 0xf0:
+      can_periodic_set_running(req->param1 | ((uint32_t)req->param2 << 16U));
+      break;
     // **** 0xf1: Clear CAN ring buffer.
     case 0xf1:
       if (req->param1 == 0xFFFFU) {
         print("Clearing CAN Rx queue\n");
-        can_clear(&can_rx_q);
+        comms_can_rx_clear();
       } else if (req->param1 < PANDA_BUS_CNT) {
         print("Clearing CAN Tx queue\n");
-        can_clear(can_queues[req->param1]);
+        can_tx_clear(req->param1);
       } else {
         print("Clearing CAN CAN ring buffer failed: wrong bus number\n");
       }
@@ -378,6 +501,16 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         UNUSED(ret);
       }
       break;
+    // **** 0xfa: CAN burst playback, param1 is the CAN_BURST_OP_* and param2 its argument
+    case 0xfa:
+      can_burst_control(req->param1, req->param2);
+      break;
+    // **** 0xfb: CAN burst playback stats
+    case 0xfb:
+      COMPILE_TIME_ASSERT(sizeof(can_burst_stats_t) <= CONTROL_RESP_MAX_SIZE);
+      resp_len = sizeof(can_burst_stats_t);
+      (void)memcpy(resp, (uint8_t*)&can_burst_stats, resp_len);
+      break;
     // **** 0xfc: set CAN FD non-ISO mode
     case 0xfc:
       if ((req->param1 < PANDA_CAN_CNT) && current_board->has_canfd) {
@@ -386,6 +519,18 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
         UNUSED(ret);
       }
       break;
+    // **** 0xfd: change-only RX on bus param1, param2 is the refresh interval in ms, 0 turns it off
+    case 0xfd:
+      if (req->param1 < PANDA_BUS_CNT) {
+        can_delta_set(req->param1, req->param2);
+      }
+      break;
+    // **** 0xfe: activate the first param1 uploaded RX subscriptions, buses in the mask param2 only deliver those
+    case 0xfe:
+      if (req->param1 <= CAN_SUB_CNT_MAX) {
+        can_subs_apply(req->param1, (uint8_t)(req->param2 & 0xFFU));
+      }
+      break;
     default:
       print("NO HANDLER ");
       puth(req->request);
@@ -4,7 +4,7 @@
 const uint32_t speeds[SPEEDS_ARRAY_SIZE] = {100U, 200U, 500U, 1000U, 1250U, 2500U, 5000U, 10000U};
 const uint32_t data_speeds[DATA_SPEEDS_ARRAY_SIZE] = {0U}; // No separate data speed, dummy
 
-bool llcan_set_speed(CAN_TypeDef *CANx, uint32_t speed, bool loopback, bool silent) {
+bool llcan_set_speed(CAN_TypeDef *CANx, uint32_t speed, bool loopback, bool silent, bool tx_id_priority) {
   bool ret = true;
 
   // initialization mode
@@ -37,8 +37,8 @@ bool llcan_set_speed(CAN_TypeDef *CANx, uint32_t speed, bool loopback, bool sile
       register_set_bits(&(CANx->BTR), CAN_BTR_SILM);
     }
 
-    // reset
-    register_set(&(CANx->MCR), CAN_MCR_TTCM | CAN_MCR_ABOM, 0x180FFU);
+    // reset, pending mailboxes go out in request order unless ID priority is wanted
+    register_set(&(CANx->MCR), CAN_MCR_TTCM | CAN_MCR_ABOM | (tx_id_priority ? 0U : CAN_MCR_TXFP), 0x180FFU);
 
     timeout_counter = 0U;
     while(((CANx->MSR & CAN_MSR_INAK) == CAN_MSR_INAK)) {
@@ -135,6 +135,6 @@ bool llcan_init(CAN_TypeDef *CANx) {
 }
 
 void llcan_clear_send(CAN_TypeDef *CANx) {
-  CANx->TSR |= CAN_TSR_ABRQ0; // Abort message transmission on error interrupt
+  CANx->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2; // Abort message transmission on error interrupt
   CANx->MSR |= CAN_MSR_ERRI; // Clear error interrupt
 }
@@ -11,6 +11,10 @@
 // 5000 = 500 kbps
 #define can_speed_to_prescaler(x) (CAN_PCLK / CAN_QUANTA * 10U / (x))
 
+// TX mailboxes per bxCAN
+#define CAN_TX_BUF_CNT_DEFAULT 3U
+#define CAN_TX_BUF_CNT_MAX 3U
+
 #define CAN_NAME_FROM_CANIF(CAN_DEV) (((CAN_DEV)==CAN1) ? "CAN1" : (((CAN_DEV) == CAN2) ? "CAN2" : "CAN3"))
 
 void print(const char *a);
@@ -21,7 +25,7 @@ extern const uint32_t speeds[SPEEDS_ARRAY_SIZE];
 #define DATA_SPEEDS_ARRAY_SIZE 1
 extern const uint32_t data_speeds[DATA_SPEEDS_ARRAY_SIZE]; // No separate data speed, dummy
 
-bool llcan_set_speed(CAN_TypeDef *CANx, uint32_t speed, bool loopback, bool silent);
+bool llcan_set_speed(CAN_TypeDef *CANx, uint32_t speed, bool loopback, bool silent, bool tx_id_priority);
 void llcan_irq_disable(const CAN_TypeDef *CANx);
 void llcan_irq_enable(const CAN_TypeDef *CANx);
 bool llcan_init(CAN_TypeDef *CANx);
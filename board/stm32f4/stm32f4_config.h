@@ -20,11 +20,15 @@
 #define TICK_TIMER_IRQ TIM1_BRK_TIM9_IRQn
 #define TICK_TIMER TIM9
 
+#define MICROSECOND_TIMER_IRQ TIM2_IRQn
 #define MICROSECOND_TIMER TIM2
 
 #define INTERRUPT_TIMER_IRQ TIM6_DAC_IRQn
 #define INTERRUPT_TIMER TIM6
 
+// software interrupt for the CAN RX bottom half, the FSMC isn't used
+#define CAN_RX_SWI_IRQ FSMC_IRQn
+
 #define IND_WDG IWDG
 
 #define PROVISION_CHUNK_ADDRESS 0x1FFF79E0U
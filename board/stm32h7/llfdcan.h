@@ -144,7 +144,7 @@ void llcan_irq_enable(const FDCAN_GlobalTypeDef *FDCANx) {
   }
 }
 
-bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
+bool llcan_init(FDCAN_GlobalTypeDef *FDCANx, uint32_t tx_el_cnt, bool tx_queue, uint32_t rx_watermark) {
   uint32_t can_number = CAN_NUM_FROM_CANIF(FDCANx);
   bool ret = fdcan_request_init(FDCANx);
 
@@ -160,36 +160,41 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
     // FD with BRS
     FDCANx->CCCR |= (FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE);
 
-    // Set TX mode to FIFO
-    FDCANx->TXBC &= ~(FDCAN_TXBC_TFQM);
     // Configure TX element data size
     FDCANx->TXESC |= 0x7U << FDCAN_TXESC_TBDS_Pos; // 64 bytes
-    //Configure RX FIFO0 element data size
-    FDCANx->RXESC |= 0x7U << FDCAN_RXESC_F0DS_Pos;
-    // Disable filtering, accept all valid frames received
-    FDCANx->XIDFC &= ~(FDCAN_XIDFC_LSE); // No extended filters
-    FDCANx->SIDFC &= ~(FDCAN_SIDFC_LSS); // No standard filters
-    FDCANx->GFC &= ~(FDCAN_GFC_RRFE); // Accept extended remote frames
-    FDCANx->GFC &= ~(FDCAN_GFC_RRFS); // Accept standard remote frames
-    FDCANx->GFC &= ~(FDCAN_GFC_ANFE); // Accept extended frames to FIFO 0
-    FDCANx->GFC &= ~(FDCAN_GFC_ANFS); // Accept standard frames to FIFO 0
-
-    uint32_t RxFIFO0SA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET);
-    uint32_t TxFIFOSA = RxFIFO0SA + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_SIZE);
-
-    // RX FIFO 0
-    FDCANx->RXF0C |= (FDCAN_RX_FIFO_0_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_RXF0C_F0SA_Pos;
-    FDCANx->RXF0C |= FDCAN_RX_FIFO_0_EL_CNT << FDCAN_RXF0C_F0S_Pos;
-    // RX FIFO 0 switch to non-blocking (overwrite) mode
-    FDCANx->RXF0C |= FDCAN_RXF0C_F0OM;
-
-    // TX FIFO (mode set earlier)
-    FDCANx->TXBC |= (FDCAN_TX_FIFO_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXBC_TBSA_Pos;
-    FDCANx->TXBC |= FDCAN_TX_FIFO_EL_CNT << FDCAN_TXBC_TFQS_Pos;
+    //Configure RX FIFO0 and FIFO1 element data size
+    FDCANx->RXESC |= (0x7U << FDCAN_RXESC_F0DS_Pos) | (0x7U << FDCAN_RXESC_F1DS_Pos);
+    // Filtering is left as is, see llcan_set_filters
+
+    uint32_t TxEventFIFOSA = FDCAN_TX_EVENT_FIFO_SA(can_number);
+    uint32_t TxFIFOSA = FDCAN_TX_FIFO_SA(can_number, tx_el_cnt);
+
+    // RX FIFO 0, in non-blocking (overwrite) mode, with a watermark interrupt when coalescing
+    // written as a whole, the split might have changed since the last init
+    FDCANx->RXF0C = ((FDCAN_RX_FIFO_0_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_RXF0C_F0SA_Pos) |
+                    (FDCAN_RX_FIFO_0_EL_CNT(tx_el_cnt) << FDCAN_RXF0C_F0S_Pos) |
+                    (MIN(rx_watermark, FDCAN_RX_FIFO_0_EL_CNT(tx_el_cnt)) << FDCAN_RXF0C_F0WM_Pos) |
+                    FDCAN_RXF0C_F0OM;
+
+    // RX FIFO 1, non-blocking as well, filled only by elements with FDCAN_FILTER_EC_FIFO1
+    FDCANx->RXF1C = ((FDCAN_RX_FIFO_1_OFFSET(tx_el_cnt) + (can_number * FDCAN_OFFSET_W)) << FDCAN_RXF1C_F1SA_Pos) |
+                    (FDCAN_RX_FIFO_1_EL_CNT << FDCAN_RXF1C_F1S_Pos) |
+                    FDCAN_RXF1C_F1OM;
+
+    // TX event FIFO, frames with their marker and the time they went out
+    FDCANx->TXEFC = ((FDCAN_TX_EVENT_FIFO_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXEFC_EFSA_Pos) |
+                    (FDCAN_TX_EVENT_FIFO_EL_CNT << FDCAN_TXEFC_EFS_Pos);
+    // internal timestamp counter, counting nominal bit times
+    FDCANx->TSCC = (0x0UL << FDCAN_TSCC_TCP_Pos) | (0x1UL << FDCAN_TSCC_TSS_Pos);
+
+    // TX FIFO, or TX queue sending by ID priority
+    FDCANx->TXBC = ((FDCAN_TX_FIFO_OFFSET(tx_el_cnt) + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXBC_TBSA_Pos) |
+                   (tx_el_cnt << FDCAN_TXBC_TFQS_Pos) |
+                   (tx_queue ? FDCAN_TXBC_TFQM : 0U);
 
     // Flush allocated RAM
-    uint32_t EndAddress = TxFIFOSA + (FDCAN_TX_FIFO_EL_CNT * FDCAN_TX_FIFO_EL_SIZE);
-    for (uint32_t RAMcounter = RxFIFO0SA; RAMcounter < EndAddress; RAMcounter += 4U) {
+    uint32_t EndAddress = TxFIFOSA + (tx_el_cnt * FDCAN_TX_FIFO_EL_SIZE);
+    for (uint32_t RAMcounter = TxEventFIFOSA; RAMcounter < EndAddress; RAMcounter += 4U) {
         *(uint32_t *)(RAMcounter) = 0x00000000;
     }
 
@@ -199,11 +204,22 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
     FDCANx->IE &= 0x0U; // Reset all interrupts
     // Messages for INT0
     FDCANx->IE |= FDCAN_IE_RF0NE; // Rx FIFO 0 new message
+    if (rx_watermark > 0U) {
+      FDCANx->IE |= FDCAN_IE_RF0WE; // Rx FIFO 0 watermark reached
+    }
     FDCANx->IE |= FDCAN_IE_PEDE | FDCAN_IE_PEAE | FDCAN_IE_BOE | FDCAN_IE_EPE | FDCAN_IE_RF0LE;
 
     // Messages for INT1 (Only TFE works??)
-    FDCANx->ILS |= FDCAN_ILS_TFEL;
+    FDCANx->ILS |= FDCAN_ILS_TFEL | FDCAN_ILS_TCL;
+    // RX FIFO 1 shares INT1, so its frames don't wait behind FIFO 0
+    FDCANx->ILS |= FDCAN_ILS_RF1NL | FDCAN_ILS_RF1LL;
+    FDCANx->IE |= FDCAN_IE_RF1NE | FDCAN_IE_RF1LE;
     FDCANx->IE |= FDCAN_IE_TFEE; // Tx FIFO empty
+    FDCANx->IE |= FDCAN_IE_TCE; // Tx complete, for the buffers picked in TXBTIE
+    FDCANx->ILS |= FDCAN_ILS_TEFNL | FDCAN_ILS_TEFLL;
+    FDCANx->IE |= FDCAN_IE_TEFNE; // Tx event FIFO new entry, a frame went out
+    FDCANx->IE |= FDCAN_IE_TEFLE; // Tx event FIFO element lost, its echo has to be failed
+    FDCANx->TXBTIE = 0U;
 
     ret = fdcan_exit_init(FDCANx);
     if(!ret) {
@@ -218,10 +234,44 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
   return ret;
 }
 
-void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx) {
+bool llcan_set_filters(FDCAN_GlobalTypeDef *FDCANx, const uint32_t *std_el, uint32_t std_cnt, const uint32_t *ext_el, uint32_t ext_cnt, bool reject) {
+  uint32_t can_number = CAN_NUM_FROM_CANIF(FDCANx);
+  bool ret = fdcan_request_init(FDCANx);
+
+  if (ret) {
+    // Enable config change
+    FDCANx->CCCR |= FDCAN_CCCR_CCE;
+
+    // Filter elements are evaluated in order, the first match wins
+    uint32_t StdFilterSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (FDCAN_STD_FILTER_OFFSET * 4UL);
+    uint32_t ExtFilterSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (FDCAN_EXT_FILTER_OFFSET * 4UL);
+    for (uint32_t i = 0U; i < std_cnt; i++) {
+      *(uint32_t *)(StdFilterSA + (i * 4U)) = std_el[i];
+    }
+    for (uint32_t i = 0U; i < (ext_cnt * 2U); i++) {
+      *(uint32_t *)(ExtFilterSA + (i * 4U)) = ext_el[i];
+    }
+    FDCANx->SIDFC = ((FDCAN_STD_FILTER_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_SIDFC_FLSSA_Pos) | (std_cnt << FDCAN_SIDFC_LSS_Pos);
+    FDCANx->XIDFC = ((FDCAN_EXT_FILTER_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_XIDFC_FLESA_Pos) | (ext_cnt << FDCAN_XIDFC_LSE_Pos);
+
+    // Frames matching no element go to FIFO 0 (0) or get rejected (2), remote frames are always accepted
+    uint32_t non_matching = reject ? 2U : 0U;
+    FDCANx->GFC = (non_matching << FDCAN_GFC_ANFS_Pos) | (non_matching << FDCAN_GFC_ANFE_Pos);
+
+    ret = fdcan_exit_init(FDCANx);
+    if (!ret) {
+      print(CAN_NAME_FROM_CANIF(FDCANx)); print(" set_filters timed out (2)!\n");
+    }
+  } else {
+    print(CAN_NAME_FROM_CANIF(FDCANx)); print(" set_filters timed out (1)!\n");
+  }
+  return ret;
+}
+
+void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint32_t tx_el_cnt, bool tx_queue, uint32_t rx_watermark) {
   // from datasheet: "Transmit cancellation is not intended for Tx FIFO operation."
   // so we need to clear pending transmission manually by resetting FDCAN core
   FDCANx->IR |= 0x3FCFFFFFU; // clear all interrupts
-  bool ret = llcan_init(FDCANx);
+  bool ret = llcan_init(FDCANx, tx_el_cnt, tx_queue, rx_watermark);
   UNUSED(ret);
 }
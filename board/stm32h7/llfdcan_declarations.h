@@ -17,22 +17,60 @@
 #define FDCAN_OFFSET 3384UL // bytes for each FDCAN module, equally
 #define FDCAN_OFFSET_W 846UL // words for each FDCAN module, equally
 
-// FDCAN_RX_FIFO_0_EL_CNT + FDCAN_TX_FIFO_EL_CNT can't exceed 47 elements (47 * 72 bytes = 3,384 bytes) per FDCAN module
+// Filter lists, at the start of each FDCAN module
+// standard elements take 1 word, extended ones 2 words, 3 FIFO elements (54 words) in total
+#define FDCAN_STD_FILTER_CNT 30UL
+#define FDCAN_EXT_FILTER_CNT 12UL
+#define FDCAN_STD_FILTER_OFFSET 0UL
+#define FDCAN_EXT_FILTER_OFFSET (FDCAN_STD_FILTER_OFFSET + FDCAN_STD_FILTER_CNT)
+#define FDCAN_FILTER_W_SIZE (FDCAN_STD_FILTER_CNT + (FDCAN_EXT_FILTER_CNT * 2UL))
+#define FDCAN_FILTER_EL_CNT 3UL
+
+// Filter element fields
+#define FDCAN_FILTER_EC_FIFO0 1UL // store in RX FIFO 0
+#define FDCAN_FILTER_EC_FIFO1 2UL // store in RX FIFO 1
+#define FDCAN_FILTER_EC_REJECT 3UL
+#define FDCAN_STD_FILTER(type, ec, id1, id2) ((((uint32_t)(type)) << 30) | ((ec) << 27) | ((((uint32_t)(id1)) & 0x7FFU) << 16) | (((uint32_t)(id2)) & 0x7FFU))
+#define FDCAN_EXT_FILTER_F0(ec, id1) (((ec) << 29) | (((uint32_t)(id1)) & 0x1FFFFFFFU))
+#define FDCAN_EXT_FILTER_F1(type, id2) ((((uint32_t)(type)) << 30) | (((uint32_t)(id2)) & 0x1FFFFFFFU))
+
+// TX event FIFO, after the filter lists, 2 words per event, in the room of 4 FIFO elements (72 words)
+#define FDCAN_TX_EVENT_FIFO_EL_CNT 32UL // one per TX element at the most, the rest is spare
+#define FDCAN_TX_EVENT_FIFO_EL_W_SIZE 2UL
+#define FDCAN_TX_EVENT_FIFO_ROOM_EL_CNT 4UL
+#define FDCAN_TX_EVENT_FIFO_OFFSET FDCAN_FILTER_W_SIZE
+#define FDCAN_TX_EVENT_FIFO_SA(can_number) (FDCAN_START_ADDRESS + ((can_number) * FDCAN_OFFSET) + (FDCAN_TX_EVENT_FIFO_OFFSET * 4UL))
+
+// FDCAN_RX_FIFO_0_EL_CNT + FDCAN_TX_FIFO_EL_CNT can't exceed 47 elements (47 * 72 bytes = 3,384 bytes) per FDCAN module,
+// minus the room taken by the filter lists, the TX event FIFO and RX FIFO 1
+#define FDCAN_EL_CNT (47UL - FDCAN_FILTER_EL_CNT - FDCAN_TX_EVENT_FIFO_ROOM_EL_CNT - FDCAN_RX_FIFO_1_EL_CNT)
+
+// TX FIFO/queue elements per bus are configurable, whatever is left goes to RX FIFO 0
+#define CAN_TX_BUF_CNT_DEFAULT 8U
+#define CAN_TX_BUF_CNT_MAX 32U
 
 // RX FIFO 0
-#define FDCAN_RX_FIFO_0_EL_CNT 46UL
+#define FDCAN_RX_FIFO_0_EL_CNT(tx_el_cnt) (FDCAN_EL_CNT - (tx_el_cnt))
 #define FDCAN_RX_FIFO_0_HEAD_SIZE 8UL // bytes
 #define FDCAN_RX_FIFO_0_DATA_SIZE 64UL // bytes
 #define FDCAN_RX_FIFO_0_EL_SIZE (FDCAN_RX_FIFO_0_HEAD_SIZE + FDCAN_RX_FIFO_0_DATA_SIZE)
 #define FDCAN_RX_FIFO_0_EL_W_SIZE (FDCAN_RX_FIFO_0_EL_SIZE / 4UL)
-#define FDCAN_RX_FIFO_0_OFFSET 0UL
+#define FDCAN_RX_FIFO_0_OFFSET (FDCAN_TX_EVENT_FIFO_OFFSET + (FDCAN_TX_EVENT_FIFO_ROOM_EL_CNT * FDCAN_RX_FIFO_0_EL_W_SIZE))
+#define FDCAN_RX_FIFO_0_SA(can_number) (FDCAN_START_ADDRESS + ((can_number) * FDCAN_OFFSET) + (FDCAN_RX_FIFO_0_OFFSET * 4UL))
+
+// RX FIFO 1, for the few IDs the host steers onto the fast path, right after RX FIFO 0
+#define FDCAN_RX_FIFO_1_EL_CNT 4UL
+#define FDCAN_RX_FIFO_1_EL_SIZE FDCAN_RX_FIFO_0_EL_SIZE
+#define FDCAN_RX_FIFO_1_EL_W_SIZE FDCAN_RX_FIFO_0_EL_W_SIZE
+#define FDCAN_RX_FIFO_1_OFFSET(tx_el_cnt) (FDCAN_RX_FIFO_0_OFFSET + (FDCAN_RX_FIFO_0_EL_CNT(tx_el_cnt) * FDCAN_RX_FIFO_0_EL_W_SIZE))
+#define FDCAN_RX_FIFO_1_SA(can_number, tx_el_cnt) (FDCAN_START_ADDRESS + ((can_number) * FDCAN_OFFSET) + (FDCAN_RX_FIFO_1_OFFSET(tx_el_cnt) * 4UL))
 
 // TX FIFO
-#define FDCAN_TX_FIFO_EL_CNT 1UL
 #define FDCAN_TX_FIFO_HEAD_SIZE 8UL // bytes
 #define FDCAN_TX_FIFO_DATA_SIZE 64UL // bytes
 #define FDCAN_TX_FIFO_EL_SIZE (FDCAN_TX_FIFO_HEAD_SIZE + FDCAN_TX_FIFO_DATA_SIZE)
-#define FDCAN_TX_FIFO_OFFSET (FDCAN_RX_FIFO_0_OFFSET + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_W_SIZE))
+#define FDCAN_TX_FIFO_OFFSET(tx_el_cnt) (FDCAN_RX_FIFO_1_OFFSET(tx_el_cnt) + (FDCAN_RX_FIFO_1_EL_CNT * FDCAN_RX_FIFO_1_EL_W_SIZE))
+#define FDCAN_TX_FIFO_SA(can_number, tx_el_cnt) (FDCAN_START_ADDRESS + ((can_number) * FDCAN_OFFSET) + (FDCAN_TX_FIFO_OFFSET(tx_el_cnt) * 4UL))
 
 #define CAN_NAME_FROM_CANIF(CAN_DEV) (((CAN_DEV)==FDCAN1) ? "FDCAN1" : (((CAN_DEV) == FDCAN2) ? "FDCAN2" : "FDCAN3"))
 #define CAN_NUM_FROM_CANIF(CAN_DEV) (((CAN_DEV)==FDCAN1) ? 0UL : (((CAN_DEV) == FDCAN2) ? 1UL : 2UL))
@@ -49,5 +87,6 @@ extern const uint32_t data_speeds[DATA_SPEEDS_ARRAY_SIZE];
 bool llcan_set_speed(FDCAN_GlobalTypeDef *FDCANx, uint32_t speed, uint32_t data_speed, bool non_iso, bool loopback, bool silent);
 void llcan_irq_disable(const FDCAN_GlobalTypeDef *FDCANx);
 void llcan_irq_enable(const FDCAN_GlobalTypeDef *FDCANx);
-bool llcan_init(FDCAN_GlobalTypeDef *FDCANx);
-void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx);
+bool llcan_init(FDCAN_GlobalTypeDef *FDCANx, uint32_t tx_el_cnt, bool tx_queue, uint32_t rx_watermark);
+bool llcan_set_filters(FDCAN_GlobalTypeDef *FDCANx, const uint32_t *std_el, uint32_t std_cnt, const uint32_t *ext_el, uint32_t ext_cnt, bool reject);
+void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint32_t tx_el_cnt, bool tx_queue, uint32_t rx_watermark);
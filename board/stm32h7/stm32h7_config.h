@@ -33,11 +33,15 @@ separate IRQs for RX and TX.
 #define TICK_TIMER_IRQ TIM8_BRK_TIM12_IRQn
 #define TICK_TIMER TIM12
 
+#define MICROSECOND_TIMER_IRQ TIM2_IRQn
 #define MICROSECOND_TIMER TIM2
 
 #define INTERRUPT_TIMER_IRQ TIM6_DAC_IRQn
 #define INTERRUPT_TIMER TIM6
 
+// software interrupt for the CAN RX bottom half, the FMC isn't used
+#define CAN_RX_SWI_IRQ FMC_IRQn
+
 #define IND_WDG IWDG1
 
 #define PROVISION_CHUNK_ADDRESS 0x080FFFE0U
@@ -6,6 +6,7 @@ import usb1
 import struct
 import hashlib
 import binascii
+import math
 from functools import wraps, partial
 from itertools import accumulate
 
@@ -21,6 +22,7 @@ from .utils import logger
 __version__ = '0.0.10'
 
 CANPACKET_HEAD_SIZE = 0x6
+CANPACKET_TS_SIZE = 0x4  # v5, microsecond timestamp after the header
 DLC_TO_LEN = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
 LEN_TO_DLC = {length: dlc for (dlc, length) in enumerate(DLC_TO_LEN)}
 PANDA_BUS_CNT = 3
@@ -32,22 +34,31 @@ def calculate_checksum(data):
     res ^= b
   return res
 
-def pack_can_buffer(arr, fd=False):
+def pack_can_buffer(arr, fd=False, timestamps=False):
   snds = [b'']
-  for address, dat, bus in arr:
+  for msg in arr:
+    address, dat, bus = msg[:3]
     assert len(dat) in LEN_TO_DLC
     #logger.debug("  W 0x%x: 0x%s", address, dat.hex())
 
     extended = 1 if address >= 0x800 else 0
     data_len_code = LEN_TO_DLC[len(dat)]
-    header = bytearray(CANPACKET_HEAD_SIZE)
-    word_4b = address << 3 | extended << 2
+    # the timestamp is left zero on TX, except for the offsets of a burst or a deadline
+    header = bytearray(CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE)
+    # TX flags ride in the returned (latest value) and rejected (deadline) bits
+    latest, deadline_ms = 0, 0
+    if timestamps:
+      struct.pack_into("<I", header, CANPACKET_HEAD_SIZE, msg[3])
+    elif len(msg) > 3:
+      latest, deadline_ms = int(msg[3]), msg[4]
+      struct.pack_into("<I", header, CANPACKET_HEAD_SIZE, deadline_ms)
+    word_4b = address << 3 | extended << 2 | latest << 1 | int(deadline_ms > 0)
     header[0] = (data_len_code << 4) | (bus << 1) | int(fd)
     header[1] = word_4b & 0xFF
     header[2] = (word_4b >> 8) & 0xFF
     header[3] = (word_4b >> 16) & 0xFF
     header[4] = (word_4b >> 24) & 0xFF
-    header[5] = calculate_checksum(header[:5] + dat)
+    header[5] = calculate_checksum(header[:5] + header[CANPACKET_HEAD_SIZE:] + dat)
 
     snds[-1] += header + dat
     if len(snds[-1]) > 256: # Limit chunks to 256 bytes
@@ -55,13 +66,14 @@ def pack_can_buffer(arr, fd=False):
 
   return snds
 
-def unpack_can_buffer(dat):
+def unpack_can_buffer(dat, timestamps=False):
   ret = []
+  head_size = CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE
 
-  while len(dat) >= CANPACKET_HEAD_SIZE:
+  while len(dat) >= head_size:
     data_len = DLC_TO_LEN[(dat[0]>>4)]
 
-    header = dat[:CANPACKET_HEAD_SIZE]
+    header = dat[:head_size]
 
     bus = (header[0] >> 1) & 0x7
     address = (header[4] << 24 | header[3] << 16 | header[2] << 8 | header[1]) >> 3
@@ -74,15 +86,19 @@ def unpack_can_buffer(dat):
       bus += 192
 
     # we need more from the next transfer
-    if data_len > len(dat) - CANPACKET_HEAD_SIZE:
+    if data_len > len(dat) - head_size:
       break
 
-    assert calculate_checksum(dat[:(CANPACKET_HEAD_SIZE+data_len)]) == 0, "CAN packet checksum incorrect"
+    assert calculate_checksum(dat[:(head_size+data_len)]) == 0, "CAN packet checksum incorrect"
 
-    data = dat[CANPACKET_HEAD_SIZE:(CANPACKET_HEAD_SIZE+data_len)]
-    dat = dat[(CANPACKET_HEAD_SIZE+data_len):]
+    data = dat[head_size:(head_size+data_len)]
+    dat = dat[(head_size+data_len):]
 
-    ret.append((address, data, bus))
+    if timestamps:
+      # microseconds, wraps around like the panda's timer
+      ret.append((address, data, bus, struct.unpack("<I", header[CANPACKET_HEAD_SIZE:])[0]))
+    else:
+      ret.append((address, data, bus))
 
   return (ret, dat)
 
@@ -127,11 +143,11 @@ class Panda:
   HW_TYPE_TRES = b'\x09'
   HW_TYPE_CUATRO = b'\x0a'
 
-  CAN_PACKET_VERSION = 4
+  CAN_PACKET_VERSION = 5
   HEALTH_PACKET_VERSION = 16
-  CAN_HEALTH_PACKET_VERSION = 5
+  CAN_HEALTH_PACKET_VERSION = 14
   HEALTH_STRUCT = struct.Struct("<IIIIIIIIBBBBBHBBBHfBBHBHHB")
-  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBIIII")
+  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBIIIIIIHHHHHHHHIIHHIIHHIIII")
 
   F4_DEVICES = [HW_TYPE_WHITE_PANDA, HW_TYPE_GREY_PANDA, HW_TYPE_BLACK_PANDA, HW_TYPE_UNO, HW_TYPE_DOS]
   H7_DEVICES = [HW_TYPE_RED_PANDA, HW_TYPE_RED_PANDA_V2, HW_TYPE_TRES, HW_TYPE_CUATRO]
@@ -150,12 +166,49 @@ class Panda:
   HARNESS_STATUS_NORMAL = 1
   HARNESS_STATUS_FLIPPED = 2
 
+  CAN_FILTER_RANGE = 0  # id1 <= ID <= id2
+  CAN_FILTER_DUAL = 1  # ID == id1 or ID == id2
+  CAN_FILTER_MASK = 2  # (ID & id2) == (id1 & id2)
+  CAN_FILTER_CNT_MAX = 16
+  CAN_ROUTE_CNT_MAX = 16
+  CAN_TX_PRIO_CNT_MAX = 16
+  CAN_PERIODIC_CNT_MAX = 32
+  CAN_SUB_CNT_MAX = 128
+  CAN_RX_COALESCE_TIMEOUT_MIN = 50  # us
+
+  ISOTP_CHANNEL_CNT = 4
+  ISOTP_PDU_SIZE_MAX = 4095
+  ISOTP_EVENT_RX = 0
+  ISOTP_EVENT_TX_DONE = 1
+  ISOTP_EVENT_ERROR = 2
+  ISOTP_ERROR_TIMEOUT_FC = 0
+  ISOTP_ERROR_TIMEOUT_CF = 1
+  ISOTP_ERROR_SEQUENCE = 2
+  ISOTP_ERROR_OVERFLOW = 3
+  ISOTP_ERROR_BLOCKED = 4
+  ISOTP_ERROR_STREAM_FULL = 5
+  ISOTP_ERROR_BUSY = 6
+  CAN_BURST_BUFFER_SIZE = 256
+  CAN_DELTA_STATUS_BUS = 4  # bus offset of change-only RX status packets, past the real buses
+  CAN_TX_FAILED_BUS = 128 + 192  # bus offset of echoes of frames dropped by a CAN core reset or a full TX queue, or whose TX event was lost
+  CAN_TX_REPORT_FULL = 0  # echo of every frame sent, with its payload
+  CAN_TX_REPORT_COMPACT = 1  # echo without the payload
+  CAN_TX_REPORT_NONE = 2
+  CAN_TX_DEADLINE_MAX_MS = 60000
+  CAN_TX_SHAPER_FRAMES = 0
+  CAN_TX_SHAPER_KBPS = 1
+  CAN_PERIODIC_CHECKSUM_SUM = 0x4  # seed + all other payload bytes
+  CAN_PERIODIC_CHECKSUM_XOR = 0x8  # seed ^ all other payload bytes
+
   def __init__(self, serial: str | None = None, claim: bool = True, disable_checks: bool = True, can_speed_kbps: int = 500, cli: bool = True):
     self._disable_checks = disable_checks
 
     self._handle: BaseHandle
     self._handle_open = False
     self.can_rx_overflow_buffer = b''
+    self.can_rx_suppressed_cnt = [0, 0, 0]
+    self._can_tx_priorities = []
+    self.isotp_rx_buffer = b''
     self._can_speed_kbps = can_speed_kbps
 
     if cli and serial is None:
@@ -620,6 +673,32 @@ class Panda:
       "irq1_call_rate": a[23],
       "irq2_call_rate": a[24],
       "can_core_reset_count": a[25],
+      "total_rx_overflow_cnt": a[26],
+      "total_tx_overflow_cnt": a[27],
+      # estimated bus utilization in %
+      "bus_load_100ms": a[28] / 10,
+      "bus_load_1s": a[29] / 10,
+      "bus_load_100ms_peak": a[30] / 10,
+      "bus_load_1s_peak": a[31] / 10,
+      # worst case run time of the CAN interrupts over the last second in us
+      "irq0_max_time": a[32],
+      "irq1_max_time": a[33],
+      "irq2_max_time": a[34],
+      "rx_bottom_half_max_time": a[35],
+      "total_rx_fifo1_cnt": a[36],
+      "total_rx_fifo1_lost_cnt": a[37],
+      # worst case from a frame coming in to the safety hook since the last read in us
+      "rx_max_latency": a[38],
+      "rx_fifo1_max_latency": a[39],
+      "total_tx_replaced_cnt": a[40],
+      "total_tx_stale_cnt": a[41],
+      "tx_queue_used": a[42],
+      "tx_hp_queue_used": a[43],
+      "total_tx_hp_overflow_cnt": a[44],
+      "total_tx_shaped_cnt": a[45],
+      # longest a message was held back by the TX shaper since the last read in us
+      "tx_shaper_max_delay": a[46],
+      "total_tx_event_lost_cnt": a[47],
     }
 
   # ******************* control *******************
@@ -649,7 +728,8 @@ class Panda:
 
   # Returns tuple with health packet version and CAN packet/USB packet version
   def get_packets_versions(self):
-    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xdd, 0, 0, 3)
+    # older firmware ignores the CAN packet version we ask for and reports its own
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xdd, Panda.CAN_PACKET_VERSION, 0, 3)
     if dat and len(dat) == 3:
       a = struct.unpack("BBB", dat)
       return (a[0], a[1], a[2])
@@ -708,6 +788,11 @@ class Panda:
     dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc4, int(irqnum), 0, 4)
     return struct.unpack("I", dat)[0]
 
+  def get_interrupt_max_time(self, irqnum):
+    # longest run of the handler in us over the last second
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc4, int(irqnum), 1, 4)
+    return struct.unpack("I", dat)[0]
+
   # ******************* configuration *******************
 
   def set_alternative_experience(self, alternative_experience):
@@ -742,6 +827,193 @@ class Panda:
   def set_canfd_auto(self, bus, auto):
       self._handle.controlWrite(Panda.REQUEST_OUT, 0xe8, bus, int(auto), b'')
 
+  def set_can_rx_weight(self, bus, weight):
+    # share of the link to the host bus gets when several buses are busy, 1-255
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe9, bus, int(weight), b'')
+
+  def set_can_tx_id_priority(self, bus, enable):
+    # frames waiting in the CAN core go out by ID priority instead of in send order
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xea, bus, int(enable), b'')
+
+  def set_can_tx_buffers(self, bus, cnt):
+    # hardware TX buffers kept loaded, up to 3 mailboxes on bxCAN or 32 elements
+    # on FDCAN, where the rest of the message RAM goes to RX
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xeb, bus, int(cnt), b'')
+
+  def set_can_rx_coalescing(self, bus, watermark, timeout_us=200):
+    # FDCAN only: RX interrupts wait until watermark frames are in the FIFO or timeout_us
+    # after the first one, whichever comes first. 0 interrupts on every frame again
+    assert 0 <= watermark <= 0xFF
+    assert watermark == 0 or self.CAN_RX_COALESCE_TIMEOUT_MIN <= timeout_us <= 0xFFFF
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xd5, bus | (watermark << 8), int(timeout_us), b'')
+
+  def set_can_tx_report(self, bus, mode):
+    """Sets how frames sent on a bus come back, one of the CAN_TX_REPORT_* modes.
+    Compact echoes come out of can_recv with an empty payload, frames that never went
+    out (bus + CAN_TX_FAILED_BUS) are reported in every mode."""
+    assert mode in (self.CAN_TX_REPORT_FULL, self.CAN_TX_REPORT_COMPACT, self.CAN_TX_REPORT_NONE)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xd7, bus, mode, b'')
+
+  def set_can_filters(self, bus, filters, reject_default=False):
+    """Programs the hardware acceptance filters of a bus (FDCAN only).
+
+    Args:
+      bus (int): CAN bus.
+      filters (list): (filter_type, id1, id2, extended, reject[, fifo1]) tuples, checked in order.
+        filter_type is one of the CAN_FILTER_* types, reject drops matching frames.
+        fifo1 puts matching frames on the fast path, they reach the safety hooks ahead of the rest.
+      reject_default (bool): drop frames that no filter accepts.
+
+    IDs needed by the safety model are always received, and buses forwarded by the
+    safety model aren't filtered. An empty list without reject_default turns filtering off.
+    fifo1 filters apply in any case, keep them to a few latency critical IDs.
+    """
+    assert len(filters) <= self.CAN_FILTER_CNT_MAX
+    entries = []
+    for ftype, id1, id2, extended, reject, *fifo1 in filters:
+      flags = ftype | (0x4 if extended else 0) | (0x8 if reject else 0) | (0x10 if any(fifo1) else 0)
+      entries.append(struct.pack("<BII", flags, id1, id2))
+    for i in range(0, len(entries), 6):
+      self._handle.bulkWrite(2, bytes([0x80, bus, i]) + b''.join(entries[i:i + 6]))
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xec, bus, len(filters) | (int(reject_default) << 8), b'')
+
+  def set_can_routes(self, routes):
+    """Sets the firmware routing table for received CAN frames.
+
+    Args:
+      routes (list): (src_bus, addr, mask, dst_bus, extended) tuples, the first one matching
+        (ID & mask) == (addr & mask) on src_bus wins. dst_bus None blocks forwarding.
+
+    A route overrides the forwarding of the safety model. Destinations it doesn't forward
+    to are subject to the safety model's TX checks, like frames sent by the host.
+    """
+    assert len(routes) <= self.CAN_ROUTE_CNT_MAX
+    assert all(src_bus < 3 and (dst_bus is None or dst_bus < 3) for src_bus, _, _, dst_bus, _ in routes)
+    entries = [struct.pack("<BBBII", (0x1 if extended else 0) | (0x2 if dst_bus is None else 0), src_bus, dst_bus or 0, addr, mask)
+               for src_bus, addr, mask, dst_bus, extended in routes]
+    for i in range(0, len(entries), 5):
+      self._handle.bulkWrite(2, bytes([0x81, i]) + b''.join(entries[i:i + 5]))
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xed, len(routes), 0, b'')
+
+  def set_can_tx_shaper(self, bus, max_fps=None, max_kbps=None):
+    """Caps the rate frames go out on a bus at, as frames or kbit per second. Frames over
+    the rate wait in the TX queue, the pacing is done on the panda. No rate turns it off."""
+    assert max_fps is None or max_kbps is None
+    if max_kbps is not None:
+      unit, rate = self.CAN_TX_SHAPER_KBPS, max_kbps
+    else:
+      unit, rate = self.CAN_TX_SHAPER_FRAMES, max_fps or 0
+    assert 0 <= rate <= 0xFFFF
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xb4, bus | (unit << 8), int(rate), b'')
+
+  def set_can_tx_priorities(self, ranges):
+    """Sets which frames sent by the host go through the high priority TX queue of their bus.
+
+    Args:
+      ranges (list): (bus, id_lo, id_hi, extended) tuples, frames with an ID in [id_lo, id_hi]
+        on that bus are high priority.
+
+    High priority frames go out ahead of everything queued at normal priority. Keep them
+    to a few IDs, their queue only holds 32 frames per bus.
+    """
+    assert len(ranges) <= self.CAN_TX_PRIO_CNT_MAX
+    entries = [struct.pack("<BBII", 0x1 if extended else 0, bus, id_lo, id_hi) for bus, id_lo, id_hi, extended in ranges]
+    for i in range(0, len(entries), 6):
+      self._handle.bulkWrite(2, bytes([0x85, i]) + b''.join(entries[i:i + 6]))
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xb3, len(ranges), 0, b'')
+    self._can_tx_priorities = list(ranges)
+
+  def get_can_route_hits(self):
+    """Returns how many received frames each active route matched."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xee, 0, 0, 4 * self.CAN_ROUTE_CNT_MAX)
+    return list(struct.unpack(f"<{len(dat) // 4}I", dat))
+
+  def set_rx_subscription(self, subscriptions, subscribed_only=None):
+    """Picks which received CAN messages are delivered, safety and forwarding still see all of them.
+
+    Args:
+      subscriptions (list): (bus, addr, max_hz) tuples, max_hz None delivers every message of that ID.
+      subscribed_only (iterable): buses that drop the IDs not subscribed to, the other buses
+        deliver them as usual. Defaults to the buses with subscriptions.
+    """
+    assert len(subscriptions) <= self.CAN_SUB_CNT_MAX
+    if subscribed_only is None:
+      subscribed_only = {bus for bus, _, _ in subscriptions}
+    entries = [struct.pack("<BBIH", 0x1 if addr >= 0x800 else 0, bus, addr, 0 if max_hz is None else math.ceil(1000 / max_hz))
+               for bus, addr, max_hz in subscriptions]
+    for i in range(0, len(entries), 7):
+      self._handle.bulkWrite(2, bytes([0x83, i]) + b''.join(entries[i:i + 7]))
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfe, len(subscriptions), sum(1 << b for b in set(subscribed_only)), b'')
+
+  def set_can_periodic(self, slot, addr, dat, bus, period_us, *, phase_us=0, counter=None, checksum=None, expire_ms=0, fd=False):
+    """Uploads a message the panda sends on its own every period_us, through the safety model like any other.
+
+    The slot is stopped until it's started with set_can_periodic_running.
+
+    Args:
+      counter (tuple): (byte, shift, bits) of a rolling counter the panda increments every frame.
+      checksum (tuple): (byte, kind, seed), kind is one of the CAN_PERIODIC_CHECKSUM_* types.
+      expire_ms (int): stop sending when the payload isn't updated for this long, 0 never expires.
+    """
+    assert 0 <= slot < self.CAN_PERIODIC_CNT_MAX
+    counter_pos, counter_shift, counter_bits = counter or (0, 0, 0)
+    checksum_pos, checksum_kind, checksum_seed = checksum or (0, 0, 0)
+    flags = (0x1 if addr >= 0x800 else 0) | (0x2 if fd else 0) | checksum_kind
+    self._handle.bulkWrite(2, struct.pack("<BBBBBBIIIBBBBH", 0x82, slot, 0, flags, bus, LEN_TO_DLC[len(dat)], addr, period_us, phase_us,
+                                          counter_pos, (counter_shift << 4) | counter_bits, checksum_pos, checksum_seed, expire_ms))
+    self.update_can_periodic(slot, dat)
+
+  def update_can_periodic(self, slot, dat):
+    """Replaces the payload of a periodic message, it goes out whole from the next frame on."""
+    for i in range(0, max(len(dat), 1), 60):
+      op = 2 if (i + 60) >= len(dat) else 1
+      self._handle.bulkWrite(2, bytes([0x82, slot, op, i]) + dat[i:i + 60])
+
+  def set_can_periodic_running(self, slots):
+    """Runs the periodic messages in the given slots and stops all others."""
+    mask = sum(1 << s for s in slots)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xf0, mask & 0xFFFF, mask >> 16, b'')
+
+  def isotp_open(self, channel, bus, tx_addr, rx_addr, *, stmin=0, block_size=0, padding=None):
+    """Sets up an ISO-TP channel, the panda handles segmentation and flow control.
+
+    Frames from rx_addr on the bus go to the channel instead of can_recv. stmin and
+    block_size are what the panda asks the other side for, padding pads frames to 8 bytes.
+    """
+    assert 0 <= channel < self.ISOTP_CHANNEL_CNT
+    flags = (0x1 if max(tx_addr, rx_addr) >= 0x800 else 0) | (0x2 if padding is not None else 0)
+    self._handle.bulkWrite(2, struct.pack("<BBBBBIIBBB", 0x84, channel, 0, flags, bus, tx_addr, rx_addr, stmin, block_size, padding or 0))
+
+  def isotp_close(self, channel):
+    self._handle.bulkWrite(2, bytes([0x84, channel, 3]))
+
+  def isotp_send(self, channel, dat):
+    """Sends a PDU, the outcome comes in through isotp_recv."""
+    assert 0 < len(dat) <= self.ISOTP_PDU_SIZE_MAX
+    for i in range(0, len(dat), 59):
+      op = 2 if (i + 59) >= len(dat) else 1
+      self._handle.bulkWrite(2, struct.pack("<BBBH", 0x84, channel, op, i) + dat[i:i + 59])
+
+  def isotp_recv(self):
+    """Returns the ISO-TP events since the last call, (channel, ISOTP_EVENT_*, data) each.
+
+    ISOTP_EVENT_RX carries a received PDU, ISOTP_EVENT_ERROR one ISOTP_ERROR_* byte.
+    """
+    while True:
+      dat = self._handle.controlRead(Panda.REQUEST_IN, 0xa0, 0, 0, 0x80)
+      self.isotp_rx_buffer += dat
+      if len(dat) < 0x80:
+        break
+
+    ret = []
+    while len(self.isotp_rx_buffer) >= 4:
+      length = self.isotp_rx_buffer[2] | (self.isotp_rx_buffer[3] << 8)
+      if len(self.isotp_rx_buffer) < 4 + length:
+        break
+      ret.append((self.isotp_rx_buffer[0], self.isotp_rx_buffer[1], bytes(self.isotp_rx_buffer[4:4 + length])))
+      self.isotp_rx_buffer = self.isotp_rx_buffer[4 + length:]
+    return ret
+
   def set_uart_baud(self, uart, rate):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xe4, uart, int(rate / 300), b'')
 
@@ -757,24 +1029,97 @@ class Panda:
   # The panda will NAK CAN writes when there is CAN congestion.
   # libusb will try to send it again, with a max timeout.
   # Timeout is in ms. If set to 0, the timeout is infinite.
+  # A bus whose TX queue is stuck stops being waited for after a while,
+  # frames sent to it are dropped from then on.
   CAN_SEND_TIMEOUT_MS = 10
+  # a burst upload waits for the messages ahead of it to go out
+  CAN_BURST_TIMEOUT_MS = 1000
 
   def can_reset_communications(self):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
 
+  def get_can_tx_credits(self):
+    """Returns the free normal and high priority TX queue slots of each bus, 0 for a bus that's stuck."""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xef, 0, 0, 4 * 3 * 2)
+    credits = list(struct.unpack(f"<{len(dat) // 4}I", dat))
+    return credits[:3], credits[3:]
+
+  def _can_tx_is_priority(self, addr, bus):
+    return any(b == bus and id_lo <= addr <= id_hi and (extended == (addr >= 0x800)) for b, id_lo, id_hi, extended in self._can_tx_priorities)
+
   @ensure_can_packet_version
-  def can_send_many(self, arr, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS):
-    snds = pack_can_buffer(arr, fd=fd)
+  def can_send_many(self, arr, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS, flow_control=False):
+    """Sends CAN messages, (addr, dat, bus) or (addr, dat, bus, latest, deadline_ms) each.
+
+    A latest message replaces one with the same ID that's still queued for the bus and
+    was sent as latest too. A message with a deadline is dropped if it's still queued
+    deadline_ms after it got to the panda, up to CAN_TX_DEADLINE_MAX_MS.
+
+    Messages that don't fit the TX queue of their bus come back from can_recv on
+    bus + CAN_TX_FAILED_BUS. With flow_control, only as many messages are sent to a
+    bus as its TX queues have room for, so a congested bus doesn't hold up the others.
+    The messages that were held back are returned, in order.
+    """
+    held = []
+    if flow_control:
+      credits, hp_credits = self.get_can_tx_credits()
+      send = []
+      for msg in arr:
+        addr, bus = msg[0], msg[2]
+        c = hp_credits if self._can_tx_is_priority(addr, bus) else credits
+        if bus < len(c) and c[bus] > 0:
+          c[bus] -= 1
+          send.append(msg)
+        else:
+          held.append(msg)
+      arr = send
+
+    self._can_write(pack_can_buffer(arr, fd=fd), timeout)
+    return held
+
+  def _can_write(self, snds, timeout):
     for tx in snds:
       while len(tx) > 0:
         bs = self._handle.bulkWrite(3, tx, timeout=timeout)
         tx = tx[bs:]
 
-  def can_send(self, addr, dat, bus, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS):
-    self.can_send_many([[addr, dat, bus]], fd=fd, timeout=timeout)
+  def can_send(self, addr, dat, bus, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS, latest=False, deadline_ms=0):
+    self.can_send_many([[addr, dat, bus, latest, deadline_ms]], fd=fd, timeout=timeout)
+
+  @ensure_can_packet_version
+  def can_send_burst(self, arr, *, start_delay_ms=10, fd=False, timeout=CAN_BURST_TIMEOUT_MS):
+    """Sends CAN messages at fixed times, (addr, dat, bus, offset_us) each.
+
+    The offsets count from the start of playback. The panda buffers the messages
+    and releases them on its own timer, the list is uploaded while it plays so it
+    can be longer than the buffer. The timeout applies to each USB write while the
+    buffer is full, 0 waits forever. Check get_can_burst_stats for late messages.
+    """
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfa, 1, 0, b'')
+    preload, rest = arr[:self.CAN_BURST_BUFFER_SIZE - 1], arr[self.CAN_BURST_BUFFER_SIZE - 1:]
+    self._can_write(pack_can_buffer(preload, fd=fd, timestamps=True), timeout)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfa, 2, start_delay_ms, b'')
+    self._can_write(pack_can_buffer(rest, fd=fd, timestamps=True), timeout)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfa, 3, 0, b'')
+
+  def can_stop_burst(self):
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfa, 0, 0, b'')
+
+  def get_can_burst_stats(self):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xfb, 0, 0, 25)
+    a = struct.unpack("<BIIIIII", dat)
+    return {
+      "state": a[0],
+      "staged_cnt": a[1],
+      "sent_cnt": a[2],
+      "dropped_cnt": a[3],
+      "late_cnt": a[4],
+      "max_late_us": a[5],
+      "underrun_cnt": a[6],
+    }
 
   @ensure_can_packet_version
-  def can_recv(self):
+  def can_recv(self, timestamps=False):
     dat = bytearray()
     while True:
       try:
@@ -783,8 +1128,22 @@ class Panda:
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         logger.error("CAN: BAD RECV, RETRYING")
         time.sleep(0.1)
-    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat)
-    return msgs
+    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat, timestamps)
+
+    # status packets of the change-only RX mode come on buses of their own
+    ret = []
+    for msg in msgs:
+      if self.CAN_DELTA_STATUS_BUS <= msg[2] < self.CAN_DELTA_STATUS_BUS + len(self.can_rx_suppressed_cnt):
+        self.can_rx_suppressed_cnt[msg[2] - self.CAN_DELTA_STATUS_BUS] += struct.unpack("<I", msg[1])[0]
+      else:
+        ret.append(msg)
+    return ret
+
+  def set_can_delta_rx(self, bus, refresh_ms):
+    """Only receive a message when its payload changes, or refresh_ms after it was
+    last received. 0 receives every message again. The number of messages that were
+    held back adds up in can_rx_suppressed_cnt."""
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xfd, bus, int(refresh_ms), b'')
 
   def can_clear(self, bus):
     """Clears all messages from the specified internal CAN ringbuffer as
@@ -7,6 +7,7 @@ from flaky import flaky
 from collections import defaultdict
 
 from opendbc.car.structs import CarParams
+from panda import Panda
 from panda.tests.hitl.conftest import PandaGroup
 from panda.tests.hitl.helpers import time_many_sends, get_random_can_messages, clear_can_buffers
 
@@ -200,3 +201,134 @@ def test_message_integrity(p):
       assert not len(sent_msgs[bus]), f"loop {i}: bus {bus} missing {len(sent_msgs[bus])} messages"
 
   print("Got all messages intact")
+
+def test_tx_order(p, panda_jungle):
+  p.set_safety_mode(CarParams.SafetyModel.allOutput)
+  # descending IDs, so going by ID priority would reorder them
+  to_send = [(0x700 - i, bytes([i]) * 8, 0) for i in range(200)]
+
+  try:
+    for id_priority in (False, True):
+      clear_can_buffers(p)
+      clear_can_buffers(panda_jungle)
+      p.set_can_tx_id_priority(0, id_priority)
+      p.can_send_many(to_send, timeout=0)
+
+      rx = []
+      echo = []
+      start_time = time.monotonic()
+      while (len(rx) < len(to_send) or len(echo) < len(to_send)) and (time.monotonic() - start_time) < 5:
+        rx.extend((m[0], bytes(m[1]), m[2]) for m in panda_jungle.can_recv() if m[2] == 0)
+        echo.extend(m for m in p.can_recv() if m[2] == 0x80)
+
+      assert len(echo) == len(to_send)
+      assert sorted(rx) == sorted(to_send)
+      if not id_priority:
+        assert rx == to_send
+  finally:
+    p.set_can_tx_id_priority(0, False)
+
+def test_can_filters(p, panda_jungle):
+  if p.get_type() not in Panda.H7_DEVICES:
+    pytest.skip("hardware filters are FDCAN only")
+
+  p.set_safety_mode(CarParams.SafetyModel.allOutput)
+  to_send = [(addr, b'\x01' * 8, 1) for addr in (0x100, 0x123, 0x200, 0x2ff, 0x300, 0x7ff)]
+  filters = [
+    (Panda.CAN_FILTER_DUAL, 0x100, 0x123, False, False),
+    (Panda.CAN_FILTER_RANGE, 0x200, 0x2ff, False, False),
+  ]
+
+  try:
+    for reject_default, expected in ((True, (0x100, 0x123, 0x200, 0x2ff)), (False, (0x100, 0x123, 0x200, 0x2ff, 0x300, 0x7ff))):
+      clear_can_buffers(p)
+      clear_can_buffers(panda_jungle)
+      p.set_can_filters(1, filters, reject_default)
+      panda_jungle.can_send_many(to_send, timeout=0)
+
+      time.sleep(0.5)
+      rx = {m[0] for m in p.can_recv() if m[2] == 1}
+      assert rx == set(expected)
+  finally:
+    p.set_can_filters(1, [])
+
+def test_rx_irq_time(p, panda_jungle):
+  # worst case time spent in the CAN RX interrupt with every bus busy. The interrupt only
+  # copies frames out, safety, forwarding and queueing run in the RX bottom half.
+  # Run against a build from before the split for the number to compare with.
+  p.set_safety_mode(CarParams.SafetyModel.allOutput)
+  rx_irq = 0 if p.get_type() in Panda.H7_DEVICES else 1
+  to_send = [(0x100 + i, b"\xaa" * 8, bus) for i in range(100) for bus in (0, 1, 2)]
+
+  irq_max, bottom_half_max = 0, 0
+  start_time = time.monotonic()
+  while time.monotonic() - start_time < 3:
+    panda_jungle.can_send_many(to_send, timeout=0)
+    p.can_recv()
+    for can_number in range(3):
+      health = p.can_health(can_number)
+      irq_max = max(irq_max, health[f"irq{rx_irq}_max_time"])
+      bottom_half_max = max(bottom_half_max, health["rx_bottom_half_max_time"])
+  clear_can_buffers(p)
+  clear_can_buffers(panda_jungle)
+
+  print(f"RX interrupt worst case {irq_max} us, RX bottom half worst case {bottom_half_max} us")
+  assert irq_max < 50
+
+def test_rx_coalescing(p, panda_jungle):
+  if p.get_type() not in Panda.H7_DEVICES:
+    pytest.skip("RX interrupt coalescing is FDCAN only")
+
+  p.set_safety_mode(CarParams.SafetyModel.allOutput)
+  try:
+    for bus in range(3):
+      p.set_can_rx_coalescing(bus, 8)
+
+    # a few frames come in after the timeout, a flood past the watermark in batches
+    for n in (1, 5, 100):
+      clear_can_buffers(p)
+      to_send = [(0x100 + i, b"\xaa" * 8, bus) for i in range(n) for bus in (0, 1, 2)]
+      panda_jungle.can_send_many(to_send, timeout=0)
+      time.sleep(0.5)
+
+      rx = []
+      while len(r := p.can_recv()) > 0:
+        rx += r
+      assert sorted(rx) == sorted(to_send)
+      assert p.health()['faults'] == 0
+  finally:
+    for bus in range(3):
+      p.set_can_rx_coalescing(bus, 0)
+
+def test_tx_irq_time(p, panda_jungle):
+  # worst case time spent in the interrupts that run TX safety checks while every bus is
+  # busy: host writes over USB or SPI and periodic TX from the microsecond timer. Ahead of
+  # a check they only run the safety hooks on the frames staged before it.
+  tim2_irq = 28
+  if p.spi:
+    host_irqs = (58, 59, 84) if p.get_type() in Panda.H7_DEVICES else (58, 59)
+  else:
+    host_irqs = (77,) if p.get_type() in Panda.H7_DEVICES else (67,)
+  p.set_safety_mode(CarParams.SafetyModel.allOutput)
+  to_recv = [(0x100 + i, b"\xaa" * 8, bus) for i in range(100) for bus in (0, 1, 2)]
+  to_send = [(0x300 + i, b"\x55" * 8, bus) for i in range(10) for bus in (0, 1, 2)]
+  try:
+    p.set_can_periodic(0, 0x400, b"\x01" * 8, 0, 1000)
+    p.set_can_periodic_running([0])
+
+    host_max, tim2_max = 0, 0
+    start_time = time.monotonic()
+    while time.monotonic() - start_time < 3:
+      panda_jungle.can_send_many(to_recv, timeout=0)
+      p.can_send_many(to_send, timeout=0)
+      p.can_recv()
+      host_max = max([host_max] + [p.get_interrupt_max_time(irq) for irq in host_irqs])
+      tim2_max = max(tim2_max, p.get_interrupt_max_time(tim2_irq))
+  finally:
+    p.set_can_periodic_running([])
+    clear_can_buffers(p)
+    clear_can_buffers(panda_jungle)
+
+  print(f"host interrupt worst case {host_max} us, microsecond timer interrupt worst case {tim2_max} us")
+  assert host_max < 500
+  assert tim2_max < 100
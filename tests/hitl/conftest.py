@@ -179,6 +179,7 @@ def func_fixture_panda(request, module_panda):
       assert can_health['error_warning'] == 0
       assert can_health['total_rx_lost_cnt'] == 0
       assert can_health['total_tx_lost_cnt'] == 0
+      assert can_health['total_tx_event_lost_cnt'] == 0
       assert can_health['total_error_cnt'] == 0
       assert can_health['total_tx_checksum_error_cnt'] == 0
 
@@ -0,0 +1,17 @@
+#!/usr/bin/env python3
+# Measures the host-side throughput of the lock-free CAN queues, with one
+# producer and one consumer thread moving packets one by one or in batches.
+import argparse
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--count", type=int, default=2_000_000)
+  args = parser.parse_args()
+
+  for batch in (1, 4, 8, 16, 64):
+    rate = lpp.can_ring_benchmark(args.count, batch)
+    print(f"batch {batch:2d}: {rate / 1e6:6.2f}M packets/s")
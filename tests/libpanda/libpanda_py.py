@@ -20,6 +20,7 @@ typedef struct {
   unsigned int addr : 29;
   unsigned char checksum;
   unsigned char data[64];
+  uint32_t timestamp;
 } CANPacket_t;
 """, packed=True)
 
@@ -35,18 +36,151 @@ typedef struct {
   CANPacket_t *elems;
 } can_ring;
 
-extern can_ring *rx_q;
+typedef struct {
+  volatile uint32_t w_ptr;
+  volatile uint32_t r_ptr;
+  uint32_t size;
+  uint8_t *data;
+} can_packed_ring;
+
+extern can_packed_ring *rx1_q;
+extern can_packed_ring *rx2_q;
+extern can_packed_ring *rx3_q;
 extern can_ring *tx1_q;
 extern can_ring *tx2_q;
 extern can_ring *tx3_q;
+extern can_ring *tx1_hp_q;
+extern can_ring *tx2_hp_q;
+extern can_ring *tx3_hp_q;
 
 bool can_pop(can_ring *q, CANPacket_t *elem);
+bool can_tx_pop(uint8_t bus_number, CANPacket_t *to_send);
 bool can_push(can_ring *q, CANPacket_t *elem);
-void can_set_checksum(CANPacket_t *packet);
+uint32_t can_pop_many(can_ring *q, CANPacket_t *elems, uint32_t max_cnt);
+uint32_t can_push_many(can_ring *q, CANPacket_t *elems, uint32_t cnt);
 int comms_can_read(uint8_t *data, uint32_t max_len);
 void comms_can_write(uint8_t *data, uint32_t len);
 void comms_can_reset(void);
 uint32_t can_slots_empty(can_ring *q);
+uint32_t can_slots_used(can_ring *q);
+const CANPacket_t *can_peek(can_ring *q, uint32_t idx);
+void can_commit(can_ring *q, uint32_t cnt);
+void comms_can_rx_clear(void);
+uint8_t comms_can_set_packet_version(uint32_t host_version);
+bool can_packed_push(can_packed_ring *q, CANPacket_t *elem);
+uint32_t can_packed_used(can_packed_ring *q);
+void can_rx_push(CANPacket_t *to_push);
+void can_tx_report_set(uint8_t bus_number, uint8_t mode);
+void can_rx_stage(CANPacket_t *to_push);
+void can_rx_handle(CANPacket_t *to_push, bool fast_path);
+void can_rx_bottom_half(void);
+void can_rx_hooks_catch_up(void);
+extern bool ignition_can;
+void can_delta_set(uint8_t bus_number, uint16_t refresh_ms);
+void can_sub_write(uint8_t *data, uint32_t len);
+void can_subs_apply(uint32_t cnt, uint8_t only_mask);
+extern uint8_t can_rx_weight[3];
+void can_route_write(uint8_t *data, uint32_t len);
+void can_routes_apply(uint32_t cnt);
+void can_forward(CANPacket_t *to_push, uint8_t can_number);
+extern uint32_t can_route_hits[16];
+bool can_tx_stalled(uint8_t bus_number);
+bool can_tx_check_min_slots_free(uint32_t min, uint8_t buses);
+void can_tx_prio_write(uint8_t *data, uint32_t len);
+void can_tx_prios_apply(uint32_t cnt);
+uint32_t can_tx_queued(uint8_t bus_number);
+void can_tx_clear(uint8_t bus_number);
+void can_tx_shaper_set(uint8_t bus_number, uint8_t unit, uint16_t rate);
+void can_timer_irq_handler(void);
+
+typedef struct {
+  uint32_t CNT;
+  uint32_t CCR1;
+  uint32_t CCR2;
+  uint32_t CCR3;
+  uint32_t CCR4;
+  uint32_t DIER;
+  uint32_t SR;
+} TIM_TypeDef;
+extern TIM_TypeDef *MICROSECOND_TIMER;
+
+void can_periodic_write(uint8_t *data, uint32_t len);
+void can_periodic_set_running(uint32_t mask);
+void can_periodic_irq_handler(void);
+
+typedef struct __attribute__((packed)) {
+  uint8_t state;
+  uint32_t staged_cnt;
+  uint32_t sent_cnt;
+  uint32_t dropped_cnt;
+  uint32_t late_cnt;
+  uint32_t max_late;
+  uint32_t underrun_cnt;
+} can_burst_stats_t;
+extern can_burst_stats_t can_burst_stats;
+void can_burst_control(uint32_t op, uint32_t param);
+void can_burst_irq_handler(void);
+
+void isotp_write(uint8_t *data, uint32_t len);
+uint32_t isotp_read(uint8_t *dst, uint32_t max_len);
+void isotp_irq_handler(void);
+
+typedef struct __attribute__((packed)) {
+  uint8_t bus_off;
+  uint32_t bus_off_cnt;
+  uint8_t error_warning;
+  uint8_t error_passive;
+  uint8_t last_error;
+  uint8_t last_stored_error;
+  uint8_t last_data_error;
+  uint8_t last_data_stored_error;
+  uint8_t receive_error_cnt;
+  uint8_t transmit_error_cnt;
+  uint32_t total_error_cnt;
+  uint32_t total_tx_lost_cnt;
+  uint32_t total_rx_lost_cnt;
+  uint32_t total_tx_cnt;
+  uint32_t total_rx_cnt;
+  uint32_t total_fwd_cnt;
+  uint32_t total_tx_checksum_error_cnt;
+  uint16_t can_speed;
+  uint16_t can_data_speed;
+  uint8_t canfd_enabled;
+  uint8_t brs_enabled;
+  uint8_t canfd_non_iso;
+  uint32_t irq0_call_rate;
+  uint32_t irq1_call_rate;
+  uint32_t irq2_call_rate;
+  uint32_t can_core_reset_cnt;
+  uint32_t total_rx_overflow_cnt;
+  uint32_t total_tx_overflow_cnt;
+  uint16_t bus_load_100ms;
+  uint16_t bus_load_1s;
+  uint16_t bus_load_100ms_peak;
+  uint16_t bus_load_1s_peak;
+  uint16_t irq0_max_time;
+  uint16_t irq1_max_time;
+  uint16_t irq2_max_time;
+  uint16_t rx_bottom_half_max_time;
+  uint32_t total_rx_fifo1_cnt;
+  uint32_t total_rx_fifo1_lost_cnt;
+  uint16_t rx_max_latency;
+  uint16_t rx_fifo1_max_latency;
+  uint32_t total_tx_replaced_cnt;
+  uint32_t total_tx_stale_cnt;
+  uint16_t tx_queue_used;
+  uint16_t tx_hp_queue_used;
+  uint32_t total_tx_hp_overflow_cnt;
+  uint32_t total_tx_shaped_cnt;
+  uint32_t tx_shaper_max_delay;
+  uint32_t total_tx_event_lost_cnt;
+} can_health_t;
+extern can_health_t can_health[3];
+void can_bus_load_add(uint8_t can_number, CANPacket_t *pkt, bool brs);
+void can_bus_load_update(uint8_t can_number);
+
+uint32_t can_ring_stress_test(uint32_t cnt, uint32_t batch);
+double can_ring_benchmark(uint32_t cnt, uint32_t batch);
 """)
 
 class CANPacket:
@@ -64,7 +198,6 @@ class Panda(Protocol):
   tx1_q: Any
   tx2_q: Any
   tx3_q: Any
-  def can_set_checksum(self, p: CANPacket) -> None: ...
 
   # safety
   def set_safety_hooks(self, mode: int, param: int) -> int: ...
@@ -82,6 +215,5 @@ def make_CANPacket(addr: int, bus: int, dat):
   ret[0].data_len_code = LEN_TO_DLC[len(dat)]
   ret[0].bus = bus
   ret[0].data = bytes(dat)
-  libpanda.can_set_checksum(ret)
 
   return ret
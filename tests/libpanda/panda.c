@@ -4,6 +4,9 @@
 
 bool can_init(uint8_t can_number) { return true; }
 void process_can(uint8_t can_number) { }
+bool can_tx_direct(uint8_t bus_number, const CANPacket_t *to_send) { return false; }
+#define LED_BLUE 2U
+void led_set(uint8_t color, bool enabled) { }
 //int safety_tx_hook(CANPacket_t *to_send) { return 1; }
 
 typedef struct harness_configuration harness_configuration;
@@ -18,11 +21,136 @@ void can_tx_comms_resume_spi(void) { };
 #include "opendbc/safety/safety.h"
 #include "main_definitions.h"
 #include "drivers/can_common.h"
+#include "drivers/can_periodic.h"
+#include "drivers/can_burst.h"
+#include "drivers/isotp.h"
 
-can_ring *rx_q = &can_rx_q;
+can_packed_ring *rx1_q = &can_rx1_q;
+can_packed_ring *rx2_q = &can_rx2_q;
+can_packed_ring *rx3_q = &can_rx3_q;
 can_ring *tx1_q = &can_tx1_q;
 can_ring *tx2_q = &can_tx2_q;
 can_ring *tx3_q = &can_tx3_q;
+can_ring *tx1_hp_q = &can_tx1_hp_q;
+can_ring *tx2_hp_q = &can_tx2_hp_q;
+can_ring *tx3_hp_q = &can_tx3_hp_q;
 
 #include "comms_definitions.h"
 #include "can_comms.h"
+
+// ********************* queue stress test / benchmark *********************
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define STRESS_BATCH_MAX 64U
+can_buffer(stress_q, 256U)
+
+typedef struct {
+  uint32_t cnt;
+  uint32_t batch;
+  uint32_t errors;
+} ring_stress_args;
+
+// the whole head is compared, padding bits and the checksum byte included
+static void stress_fill(CANPacket_t *pkt, uint32_t seq) {
+  (void)memset(pkt, 0, sizeof(CANPacket_t));
+  pkt->fd = 0U;
+  pkt->bus = seq % 3U;
+  pkt->data_len_code = 8U;
+  pkt->rejected = 0U;
+  pkt->returned = 0U;
+  pkt->extended = 1U;
+  pkt->addr = seq & 0x1FFFFFFFU;
+  for (uint32_t i = 0U; i < 8U; i++) {
+    pkt->data[i] = (seq >> ((i % 4U) * 8U)) & 0xFFU;
+  }
+  pkt->checksum = (uint8_t)(seq * 7U);
+}
+
+static void *stress_producer(void *arg) {
+  ring_stress_args *args = (ring_stress_args *)arg;
+  CANPacket_t pkts[STRESS_BATCH_MAX];
+  uint32_t seq = 0U;
+  while (seq < args->cnt) {
+    uint32_t n = MIN(args->batch, args->cnt - seq);
+    for (uint32_t i = 0U; i < n; i++) {
+      stress_fill(&pkts[i], seq + i);
+    }
+    uint32_t pushed = 0U;
+    while (pushed < n) {
+      if (args->batch == 1U) {
+        pushed += can_push(&can_stress_q, &pkts[pushed]) ? 1U : 0U;
+      } else {
+        pushed += can_push_many(&can_stress_q, &pkts[pushed], n - pushed);
+      }
+      if (pushed < n) {
+        // queue full, let the consumer catch up
+        sched_yield();
+      }
+    }
+    seq += n;
+  }
+  return NULL;
+}
+
+static void *stress_consumer(void *arg) {
+  ring_stress_args *args = (ring_stress_args *)arg;
+  CANPacket_t pkts[STRESS_BATCH_MAX];
+  CANPacket_t expected;
+  uint32_t seq = 0U;
+  while (seq < args->cnt) {
+    uint32_t n;
+    if (args->batch == 1U) {
+      n = can_pop(&can_stress_q, &pkts[0]) ? 1U : 0U;
+    } else {
+      n = can_pop_many(&can_stress_q, pkts, args->batch);
+    }
+    if (n == 0U) {
+      // queue empty, let the producer catch up
+      sched_yield();
+    }
+    for (uint32_t i = 0U; i < n; i++) {
+      stress_fill(&expected, seq);
+      if (memcmp(&expected, &pkts[i], CANPACKET_HEAD_SIZE + 8U) != 0) {
+        args->errors += 1U;
+      }
+      seq += 1U;
+    }
+  }
+  return NULL;
+}
+
+// run a producer and a consumer thread on the same queue, returns the time taken in ns
+static uint64_t ring_stress_run(ring_stress_args *args) {
+  pthread_t producer, consumer;
+  struct timespec start, end;
+
+  can_stress_q.w_ptr = 0U;
+  can_stress_q.r_ptr = 0U;
+  args->errors = 0U;
+  args->batch = MIN(MAX(args->batch, 1U), STRESS_BATCH_MAX);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_create(&consumer, NULL, stress_consumer, args);
+  pthread_create(&producer, NULL, stress_producer, args);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return ((uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL) + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+}
+
+// returns the number of packets that arrived corrupted or out of order
+uint32_t can_ring_stress_test(uint32_t cnt, uint32_t batch) {
+  ring_stress_args args = {.cnt = cnt, .batch = batch, .errors = 0U};
+  (void)ring_stress_run(&args);
+  return args.errors + ((can_stress_q.w_ptr != can_stress_q.r_ptr) ? 1U : 0U);
+}
+
+// returns the throughput in packets per second
+double can_ring_benchmark(uint32_t cnt, uint32_t batch) {
+  ring_stress_args args = {.cnt = cnt, .batch = batch, .errors = 0U};
+  uint64_t ns = ring_stress_run(&args);
+  return (ns > 0U) ? ((double)cnt * 1e9 / (double)ns) : 0.0;
+}
@@ -1,15 +1,17 @@
 #!/usr/bin/env python3
 import random
+import struct
 import unittest
 
 from opendbc.car.structs import CarParams
-from panda import DLC_TO_LEN, USBPACKET_MAX_SIZE, pack_can_buffer, unpack_can_buffer
+from panda import Panda, DLC_TO_LEN, USBPACKET_MAX_SIZE, CANPACKET_HEAD_SIZE, CANPACKET_TS_SIZE, pack_can_buffer, unpack_can_buffer
 from panda.tests.libpanda import libpanda_py
 
 lpp = libpanda_py.libpanda
 
 CHUNK_SIZE = USBPACKET_MAX_SIZE
 TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+RX_QUEUES = (lpp.rx1_q, lpp.rx2_q, lpp.rx3_q)
 
 
 def unpackage_can_msg(pkt):
@@ -31,7 +33,9 @@ def random_can_messages(n, bus=None):
 
 class TestPandaComms(unittest.TestCase):
   def setUp(self):
+    assert lpp.comms_can_set_packet_version(Panda.CAN_PACKET_VERSION) == Panda.CAN_PACKET_VERSION
     lpp.comms_can_reset()
+    lpp.comms_can_rx_clear()
 
   def test_tx_queues(self):
     for bus in range(len(TX_QUEUES)):
@@ -45,12 +49,92 @@ class TestPandaComms(unittest.TestCase):
 
       assert unpackage_can_msg(can_pkt_rx) == message
 
+  def test_tx_queues_many(self):
+    msgs = random_can_messages(100, bus=0)
+    pkts = libpanda_py.ffi.new(f'CANPacket_t[{len(msgs)}]')
+    for i, m in enumerate(msgs):
+      pkts[i] = libpanda_py.make_CANPacket(m[0], m[2], m[1])[0]
+
+    assert lpp.can_push_many(TX_QUEUES[0], pkts, len(msgs)) == len(msgs), "CAN push failed"
+
+    out = libpanda_py.ffi.new(f'CANPacket_t[{len(msgs)}]')
+    popped = 0
+    while popped < len(msgs):
+      n = lpp.can_pop_many(TX_QUEUES[0], out + popped, 7)
+      assert n > 0, "CAN pop failed"
+      popped += n
+    assert lpp.can_pop_many(TX_QUEUES[0], out, 1) == 0
+    assert [unpackage_can_msg(out + i) for i in range(len(msgs))] == msgs
+
+  def test_tx_queue_full(self):
+    q = TX_QUEUES[0]
+    pkts = libpanda_py.ffi.new(f'CANPacket_t[{q.fifo_size}]')
+    assert lpp.can_push_many(q, pkts, q.fifo_size) == q.fifo_size - 1
+    assert lpp.can_slots_empty(q) == 0
+    assert not lpp.can_push(q, pkts)
+    assert lpp.can_pop_many(q, pkts, q.fifo_size) == q.fifo_size - 1
+
+  def test_tx_stalled_bus(self):
+    q = TX_QUEUES[0]
+    pkts = libpanda_py.ffi.new(f'CANPacket_t[{q.fifo_size}]')
+    lpp.MICROSECOND_TIMER.CNT = 0
+    assert lpp.can_push_many(q, pkts, q.fifo_size) == q.fifo_size - 1
+    assert not lpp.can_tx_check_min_slots_free(1, 0b1)
+
+    # a full bus only holds back writes when it's the only one the host is sending on
+    assert lpp.can_tx_check_min_slots_free(1, 0b11)
+    assert lpp.can_tx_check_min_slots_free(1, 0b10)
+    assert lpp.can_tx_check_min_slots_free(1, 0)
+
+    # a full queue that doesn't move stops holding back writes
+    lpp.MICROSECOND_TIMER.CNT = 99999
+    assert not lpp.can_tx_check_min_slots_free(1, 0b1)
+    lpp.MICROSECOND_TIMER.CNT = 100000
+    assert lpp.can_tx_stalled(0)
+    assert lpp.can_tx_check_min_slots_free(1, 0b1)
+
+    # until it gets a frame out again
+    assert lpp.can_pop(q, pkts)
+    assert not lpp.can_tx_stalled(0)
+    assert not lpp.can_tx_check_min_slots_free(2, 0b1)
+
+    lpp.can_pop_many(q, pkts, q.fifo_size)
+    lpp.MICROSECOND_TIMER.CNT = 0
+
+  def test_tx_full_queue_rejects(self):
+    q = TX_QUEUES[1]
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.comms_can_rx_clear()
+    pkts = libpanda_py.ffi.new(f'CANPacket_t[{q.fifo_size}]')
+    assert lpp.can_push_many(q, pkts, q.fifo_size) == q.fifo_size - 1
+
+    # frames for the full bus come back failed, the other bus still takes its frames
+    msgs = [(0x200, b"full", 1), (0x300, b"free", 0)]
+    packed = pack_can_buffer(msgs)
+    for dat in packed:
+      lpp.comms_can_write(dat, len(dat))
+    assert lpp.can_slots_used(TX_QUEUES[0]) == 1
+
+    dat = libpanda_py.ffi.new("uint8_t[256]")
+    rx_len = lpp.comms_can_read(dat, 256)
+    rx, _ = unpack_can_buffer(bytes(dat[0:rx_len]))
+    assert (0x200, b"full", 1 + Panda.CAN_TX_FAILED_BUS) in rx
+
+    lpp.can_tx_clear(0)
+    lpp.can_tx_clear(1)
+    lpp.set_safety_hooks(CarParams.SafetyModel.noOutput, 0)
+
+  def test_ring_threaded_stress(self):
+    for batch in (1, 4, 32):
+      with self.subTest(batch=batch):
+        assert lpp.can_ring_stress_test(200000, batch) == 0
+
   def test_comms_reset_rx(self):
     # store some test messages in the queue
     test_msg = (0x100, b"test", 0)
     for _ in range(100):
       can_pkt_tx = libpanda_py.make_CANPacket(test_msg[0], test_msg[2], test_msg[1])
-      lpp.can_push(lpp.rx_q, can_pkt_tx)
+      lpp.can_rx_push(can_pkt_tx)
 
     # read a small chunk such that we have some overflow
     TINY_CHUNK_SIZE = 6
@@ -75,6 +159,100 @@ class TestPandaComms(unittest.TestCase):
     for m in msgs:
       assert m == test_msg, "message buffer should contain valid test messages"
 
+  def test_comms_rx_clear_partial(self):
+    test_msg = (0x100, b"test", 0)
+    for _ in range(10):
+      lpp.can_rx_push(libpanda_py.make_CANPacket(test_msg[0], test_msg[2], test_msg[1]))
+
+    # start sending the first packet, then clear the queue
+    TINY_CHUNK_SIZE = 6
+    dat = libpanda_py.ffi.new(f"uint8_t[{TINY_CHUNK_SIZE}]")
+    assert lpp.comms_can_read(dat, TINY_CHUNK_SIZE) == TINY_CHUNK_SIZE
+    lpp.comms_can_rx_clear()
+
+    # the partially sent packet still gets completed, the rest is gone
+    rest = libpanda_py.ffi.new("uint8_t[512]")
+    rx_len = lpp.comms_can_read(rest, 512)
+    msgs, overflow = unpack_can_buffer(bytes(dat) + bytes(rest[0:rx_len]))
+    assert msgs == [test_msg]
+    assert len(overflow) == 0
+    assert sum(lpp.can_packed_used(q) for q in RX_QUEUES) == 0
+
+  def test_rx_queue_packed(self):
+    # classic frames only take up their wire size
+    test_msg = (0x100, b"\x01" * 8, 0)
+    pkt = libpanda_py.make_CANPacket(test_msg[0], test_msg[2], test_msg[1])
+    pkt_len = CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE + len(test_msg[1])
+    cnt = 0
+    while lpp.can_packed_push(RX_QUEUES[0], pkt):
+      cnt += 1
+    assert cnt == (RX_QUEUES[0].size - 1) // pkt_len
+    assert lpp.can_packed_used(RX_QUEUES[0]) == cnt * pkt_len
+
+    # everything comes back out, including the packet wrapping around the end
+    dat = libpanda_py.ffi.new("uint8_t[16384]")
+    assert lpp.comms_can_read(dat, 64) == 64
+    overflow = bytes(dat[0:64])
+    assert lpp.can_packed_push(RX_QUEUES[0], pkt)
+    msgs = []
+    while (rx_len := lpp.comms_can_read(dat, 16384)) > 0:
+      new_msgs, overflow = unpack_can_buffer(overflow + bytes(dat[0:rx_len]))
+      msgs.extend(new_msgs)
+    assert len(overflow) == 0
+    assert len(msgs) == cnt + 1
+    assert all(m == test_msg for m in msgs)
+
+  def test_rx_weighted_drain(self):
+    # bus 2 floods, but bus 0 still gets its share of the link
+    for bus, cnt in ((2, 500), (0, 100)):
+      for _ in range(cnt):
+        lpp.can_rx_push(libpanda_py.make_CANPacket(0x100, bus, b"\x01" * 8))
+
+    dat = libpanda_py.ffi.new("uint8_t[16384]")
+    def read_buses(cnt):
+      rx_len = lpp.comms_can_read(dat, cnt * (CANPACKET_HEAD_SIZE + CANPACKET_TS_SIZE + 8))
+      msgs, overflow = unpack_can_buffer(bytes(dat[0:rx_len]))
+      assert len(overflow) == 0
+      return [m[2] for m in msgs]
+
+    buses = read_buses(100)
+    self.assertAlmostEqual(buses.count(0), 50, delta=5)
+    self.assertAlmostEqual(buses.count(2), 50, delta=5)
+
+    try:
+      lpp.can_rx_weight[2] = 3
+      buses = read_buses(100)
+      self.assertAlmostEqual(buses.count(0), 25, delta=5)
+      self.assertAlmostEqual(buses.count(2), 75, delta=5)
+    finally:
+      lpp.can_rx_weight[2] = 1
+
+  def test_rx_timestamps(self):
+    pkt = libpanda_py.make_CANPacket(0x100, 0, b"\x01" * 8)
+    pkt[0].timestamp = 0x12345678
+    lpp.can_rx_push(pkt)
+
+    dat = libpanda_py.ffi.new("uint8_t[64]")
+    rx_len = lpp.comms_can_read(dat, 64)
+    msgs, overflow = unpack_can_buffer(bytes(dat[0:rx_len]), timestamps=True)
+    assert msgs == [(0x100, b"\x01" * 8, 0, 0x12345678)]
+    assert len(overflow) == 0
+
+  def test_packet_version_negotiation(self):
+    try:
+      # hosts from before v5 don't ask for a version and keep getting v4 packets
+      assert lpp.comms_can_set_packet_version(0) == 4
+      lpp.can_rx_push(libpanda_py.make_CANPacket(0x100, 0, b"\x01" * 8))
+      dat = libpanda_py.ffi.new("uint8_t[64]")
+      assert lpp.comms_can_read(dat, 64) == CANPACKET_HEAD_SIZE + 8
+
+      # switching drops what was queued in the old format
+      lpp.can_rx_push(libpanda_py.make_CANPacket(0x100, 0, b"\x01" * 8))
+      assert lpp.comms_can_set_packet_version(Panda.CAN_PACKET_VERSION) == Panda.CAN_PACKET_VERSION
+      assert sum(lpp.can_packed_used(q) for q in RX_QUEUES) == 0
+    finally:
+      lpp.comms_can_set_packet_version(Panda.CAN_PACKET_VERSION)
+
   def test_comms_reset_tx(self):
     # store some test messages in the queue
     test_msg = (0x100, b"test", 0)
@@ -100,6 +278,364 @@ class TestPandaComms(unittest.TestCase):
     for m in queue_msgs:
       assert m == test_msg, "message buffer should contain valid test messages"
 
+  def test_tx_bad_checksum(self):
+    packed = pack_can_buffer([(0x100, b"test", 0)])[0]
+    bad = bytearray(packed)
+    bad[-1] ^= 0x1
+
+    # host packets are checked once on the way in, bad ones never reach a queue
+    lpp.comms_can_write(bytes(bad), len(bad))
+    assert lpp.can_slots_used(TX_QUEUES[0]) == 0
+    lpp.comms_can_write(packed, len(packed))
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    assert lpp.can_pop(TX_QUEUES[0], pkt)
+    assert unpackage_can_msg(pkt) == (0x100, b"test", 0)
+
+  def test_tx_flags(self):
+    lpp.MICROSECOND_TIMER.CNT = 0
+    replaced, stale = lpp.can_health[0].total_tx_replaced_cnt, lpp.can_health[0].total_tx_stale_cnt
+    msgs = [(0x100, b"\x01", 0, True, 0), (0x200, b"\x01", 0), (0x300, b"\x01", 0, False, 5),
+            (0x100, b"\x02", 0, True, 0), (0x400, b"\x01", 0, False, 6)]
+    for buf in pack_can_buffer(msgs):
+      lpp.comms_can_write(buf, len(buf))
+
+    # the latest value keeps the first one's place, frames past their deadline are dropped
+    lpp.MICROSECOND_TIMER.CNT = 5001
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    out = []
+    while lpp.can_tx_pop(0, pkt):
+      out.append(unpackage_can_msg(pkt))
+    assert out == [(0x100, b"\x02", 0), (0x200, b"\x01", 0), (0x400, b"\x01", 0)]
+    assert lpp.can_health[0].total_tx_replaced_cnt == replaced + 1
+    assert lpp.can_health[0].total_tx_stale_cnt == stale + 1
+
+    # once it's out of the queue, the next one is queued again
+    for buf in pack_can_buffer([(0x100, b"\x03", 0, True, 0)]):
+      lpp.comms_can_write(buf, len(buf))
+    assert lpp.can_tx_pop(0, pkt)
+    assert unpackage_can_msg(pkt) == (0x100, b"\x03", 0)
+
+  def test_tx_shaper(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.MICROSECOND_TIMER.CNT = 0
+    lpp.can_health[0].tx_shaper_max_delay = 0
+    shaped = lpp.can_health[0].total_tx_shaped_cnt
+
+    # 1000 frames/s, after idling 4 go back to back
+    lpp.can_tx_shaper_set(0, Panda.CAN_TX_SHAPER_FRAMES, 1000)
+    for buf in pack_can_buffer([(0x100 + i, b"\x01", 0) for i in range(6)]):
+      lpp.comms_can_write(buf, len(buf))
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    assert sum(lpp.can_tx_pop(0, pkt) for _ in range(6)) == 4
+    assert lpp.MICROSECOND_TIMER.CCR4 == 1000
+
+    # then one every ms
+    lpp.MICROSECOND_TIMER.CNT = 1000
+    assert lpp.can_tx_pop(0, pkt)
+    assert not lpp.can_tx_pop(0, pkt)
+    lpp.MICROSECOND_TIMER.CNT = 2000
+    assert lpp.can_tx_pop(0, pkt)
+    assert unpackage_can_msg(pkt) == (0x105, b"\x01", 0)
+    assert lpp.can_health[0].total_tx_shaped_cnt == shaped + 2
+    assert lpp.can_health[0].tx_shaper_max_delay == 1000
+
+    lpp.can_tx_shaper_set(0, Panda.CAN_TX_SHAPER_FRAMES, 0)
+
+  def test_tx_priorities(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+
+    # 0x100-0x10F on bus 0 are high priority
+    data = bytes([0x85, 0]) + struct.pack("<BBII", 0, 0, 0x100, 0x10F)
+    lpp.can_tx_prio_write(data, len(data))
+    lpp.can_tx_prios_apply(1)
+
+    msgs = [(0x200, b"\x01", 0), (0x105, b"\x01", 0), (0x105, b"\x01", 1), (0x300, b"\x01", 0), (0x10F, b"\x01", 0)]
+    for buf in pack_can_buffer(msgs):
+      lpp.comms_can_write(buf, len(buf))
+    assert lpp.can_tx_queued(0) == 4
+    assert lpp.can_slots_used(lpp.tx1_hp_q) == 2
+
+    # the high class always drains first, in order
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    out = []
+    while lpp.can_tx_pop(0, pkt):
+      out.append(unpackage_can_msg(pkt))
+    assert out == [(0x105, b"\x01", 0), (0x10F, b"\x01", 0), (0x200, b"\x01", 0), (0x300, b"\x01", 0)]
+    assert lpp.can_pop(TX_QUEUES[1], pkt)
+    assert unpackage_can_msg(pkt) == (0x105, b"\x01", 1)
+
+    lpp.can_tx_prios_apply(0)
+    for buf in pack_can_buffer([(0x105, b"\x01", 0)]):
+      lpp.comms_can_write(buf, len(buf))
+    assert lpp.can_slots_used(lpp.tx1_hp_q) == 0
+    lpp.can_tx_clear(0)
+
+  def test_can_routes(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+
+    # 0x100-0x10F from bus 1 go to bus 2, 0x200 from bus 1 is never forwarded
+    routes = struct.pack("<BBBII", 0, 1, 2, 0x100, 0x7F0) + struct.pack("<BBBII", 0x2, 1, 0, 0x200, 0x7FF)
+    data = bytes([0x81, 0]) + routes
+    lpp.can_route_write(data, len(data))
+    lpp.can_routes_apply(2)
+
+    for addr in (0x105, 0x200, 0x300):
+      lpp.can_forward(libpanda_py.make_CANPacket(addr, 1, b"route"), 1)
+
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    assert lpp.can_pop(TX_QUEUES[2], pkt)
+    assert unpackage_can_msg(pkt)[:2] == (0x105, b"route")
+    assert all(lpp.can_slots_used(q) == 0 for q in TX_QUEUES)
+    assert list(lpp.can_route_hits[0:2]) == [1, 1]
+
+    lpp.can_routes_apply(0)
+    lpp.can_forward(libpanda_py.make_CANPacket(0x105, 1, b"route"), 1)
+    assert lpp.can_slots_used(TX_QUEUES[2]) == 0
+
+    # routes to or from a bus that doesn't exist never match
+    routes = struct.pack("<BBBII", 0, 1, 3, 0x100, 0x7F0) + struct.pack("<BBBII", 0, 5, 2, 0x100, 0x7F0)
+    data = bytes([0x81, 0]) + routes
+    lpp.can_route_write(data, len(data))
+    lpp.can_routes_apply(2)
+    fwd_cnt = lpp.can_health[1].total_fwd_cnt
+    lpp.can_forward(libpanda_py.make_CANPacket(0x105, 1, b"route"), 1)
+    assert all(lpp.can_slots_used(q) == 0 for q in TX_QUEUES)
+    assert list(lpp.can_route_hits[0:2]) == [0, 0]
+    assert lpp.can_health[1].total_fwd_cnt == fwd_cnt
+    lpp.can_routes_apply(0)
+
+  def test_can_periodic(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.MICROSECOND_TIMER.CNT = 1000
+
+    # 10ms on bus 1, rolling counter in the high nibble of byte 7, sum checksum in byte 0
+    cfg = struct.pack("<BBBBBBIIIBBBBH", 0x82, 0, 0, Panda.CAN_PERIODIC_CHECKSUM_SUM, 1, 8, 0x123, 10000, 500, 7, (4 << 4) | 4, 0, 0x10, 0)
+    lpp.can_periodic_write(cfg, len(cfg))
+    dat = bytes([0x82, 0, 2, 0, 0, 1, 2, 3, 4, 5, 6, 0])
+    lpp.can_periodic_write(dat, len(dat))
+    lpp.can_periodic_set_running(1)
+    assert lpp.MICROSECOND_TIMER.CCR1 == 1500
+
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    for i, now in enumerate((1500, 11500, 21600)):
+      lpp.MICROSECOND_TIMER.CNT = now
+      lpp.can_periodic_irq_handler()
+      assert lpp.can_pop(TX_QUEUES[1], pkt)
+      payload = bytes([0, 1, 2, 3, 4, 5, 6, i << 4])
+      assert unpackage_can_msg(pkt) == (0x123, bytes([(0x10 + sum(payload)) & 0xFF]) + payload[1:], 1)
+      assert lpp.MICROSECOND_TIMER.CCR1 == 11500 + (i * 10000)
+    assert lpp.can_slots_used(TX_QUEUES[1]) == 0
+
+    # more than a period late doesn't send a burst
+    lpp.MICROSECOND_TIMER.CNT = 60000
+    lpp.can_periodic_irq_handler()
+    assert lpp.can_slots_used(TX_QUEUES[1]) == 1
+    assert lpp.MICROSECOND_TIMER.CCR1 == 70000
+    lpp.can_pop(TX_QUEUES[1], pkt)
+
+    lpp.can_periodic_set_running(0)
+    assert (lpp.MICROSECOND_TIMER.DIER & 0x2) == 0
+    lpp.MICROSECOND_TIMER.CNT = 0
+
+  def test_can_periodic_expire(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.MICROSECOND_TIMER.CNT = 1000000
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+
+    # two slots expiring after 50ms, their payloads uploaded interleaved
+    for slot, addr in ((0, 0x123), (1, 0x124)):
+      cfg = struct.pack("<BBBBBBIIIBBBBH", 0x82, slot, 0, 0, 0, 4, addr, 10000, 0, 0, 0, 0, 0, 50)
+      lpp.can_periodic_write(cfg, len(cfg))
+    for dat in ([0x82, 0, 1, 0, 1, 2], [0x82, 1, 1, 0, 5, 6], [0x82, 0, 2, 2, 3, 4], [0x82, 1, 2, 2, 7, 8]):
+      lpp.can_periodic_write(bytes(dat), len(dat))
+    lpp.can_periodic_set_running(0b11)
+
+    # the first frames go out, the slots weren't published long before
+    lpp.MICROSECOND_TIMER.CNT = 1000000
+    lpp.can_periodic_irq_handler()
+    assert lpp.can_pop(TX_QUEUES[0], pkt) and unpackage_can_msg(pkt) == (0x123, b"\x01\x02\x03\x04", 0)
+    assert lpp.can_pop(TX_QUEUES[0], pkt) and unpackage_can_msg(pkt) == (0x124, b"\x05\x06\x07\x08", 0)
+
+    # and stop once they aren't updated for longer than 50ms
+    lpp.MICROSECOND_TIMER.CNT = 1060000
+    lpp.can_periodic_irq_handler()
+    assert lpp.can_slots_used(TX_QUEUES[0]) == 0
+
+    lpp.can_periodic_set_running(0)
+    lpp.MICROSECOND_TIMER.CNT = 0
+
+  def test_can_burst(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.MICROSECOND_TIMER.CNT = 1000
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+
+    def write(msgs):
+      for buf in pack_can_buffer(msgs, timestamps=True):
+        lpp.comms_can_write(buf, len(buf))
+
+    def tx(bus):
+      ret = []
+      while lpp.can_pop(TX_QUEUES[bus], pkt):
+        ret.append(unpackage_can_msg(pkt))
+      return ret
+
+    # staged, nothing goes out before playback
+    lpp.can_burst_control(1, 0)
+    write([(0x100, b"\x00", 0, 0), (0x101, b"\x01", 1, 1000), (0x102, b"\x02", 0, 1020), (0x103, b"\x03", 0, 5000)])
+    assert lpp.can_burst_stats.state == 1 and lpp.can_burst_stats.staged_cnt == 4
+    assert tx(0) == [] and tx(1) == []
+
+    # starts 2ms from now
+    lpp.can_burst_control(2, 2)
+    assert lpp.MICROSECOND_TIMER.CCR2 == 3000
+    lpp.MICROSECOND_TIMER.CNT = 3000
+    lpp.can_burst_irq_handler()
+    assert tx(0) == [(0x100, b"\x00", 0)]
+    assert lpp.MICROSECOND_TIMER.CCR2 == 4000
+
+    # frames due close together go out together
+    lpp.MICROSECOND_TIMER.CNT = 4010
+    lpp.can_burst_irq_handler()
+    assert tx(1) == [(0x101, b"\x01", 1)] and tx(0) == [(0x102, b"\x02", 0)]
+    assert lpp.MICROSECOND_TIMER.CCR2 == 8000
+    assert lpp.can_burst_stats.late_cnt == 0 and lpp.can_burst_stats.max_late == 10
+
+    # late, and then the buffer runs dry before the end of the list
+    lpp.MICROSECOND_TIMER.CNT = 8500
+    lpp.can_burst_irq_handler()
+    assert tx(0) == [(0x103, b"\x03", 0)]
+    assert lpp.can_burst_stats.late_cnt == 1 and lpp.can_burst_stats.max_late == 500
+    assert lpp.can_burst_stats.underrun_cnt == 1
+    assert (lpp.MICROSECOND_TIMER.DIER & 0x4) == 0
+
+    # the upload catches up
+    write([(0x104, b"\x04", 2, 6000)])
+    assert lpp.MICROSECOND_TIMER.CCR2 == 9000 and (lpp.MICROSECOND_TIMER.DIER & 0x4) != 0
+    lpp.can_burst_control(3, 0)
+    assert lpp.can_burst_stats.state == 2
+
+    # CAN writes go to the TX queues again once the list is complete
+    write([(0x200, b"\x05", 2, 0)])
+    assert tx(2) == [(0x200, b"\x05", 2)]
+
+    lpp.MICROSECOND_TIMER.CNT = 9000
+    lpp.can_burst_irq_handler()
+    assert tx(2) == [(0x104, b"\x04", 2)]
+    assert lpp.can_burst_stats.state == 3 and lpp.can_burst_stats.sent_cnt == 5
+    assert lpp.can_burst_stats.underrun_cnt == 1 and lpp.can_burst_stats.dropped_cnt == 0
+
+    lpp.can_burst_control(0, 0)
+    lpp.MICROSECOND_TIMER.CNT = 0
+
+  def test_isotp(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.MICROSECOND_TIMER.CNT = 1000
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+
+    def write(dat):
+      lpp.isotp_write(dat, len(dat))
+
+    def rx(dat):
+      frame = libpanda_py.make_CANPacket(0x7E8, 0, dat)
+      frame[0].timestamp = lpp.MICROSECOND_TIMER.CNT
+      lpp.can_rx_push(frame)
+
+    def tx():
+      ret = []
+      while lpp.can_pop(TX_QUEUES[0], pkt):
+        assert pkt[0].addr == 0x7E0
+        ret.append(unpackage_can_msg(pkt)[1])
+      return ret
+
+    def events():
+      dat = libpanda_py.ffi.new("uint8_t[256]")
+      buf = bytes(dat[0:lpp.isotp_read(dat, 256)])
+      ret = []
+      while len(buf) > 0:
+        length = buf[2] | (buf[3] << 8)
+        ret.append((buf[0], buf[1], buf[4:4 + length]))
+        buf = buf[4 + length:]
+      return ret
+
+    # 0x7E0 -> 0x7E8 on bus 0, padded with 0xAA
+    write(struct.pack("<BBBBBIIBBB", 0x84, 0, 0, 0x2, 0, 0x7E0, 0x7E8, 0, 0, 0xAA))
+
+    # segmented send, the receiver asks for blocks of 2 with 5ms in between
+    pdu = bytes(range(30))
+    write(struct.pack("<BBBH", 0x84, 0, 2, 0) + pdu)
+    assert tx() == [b"\x10\x1e" + pdu[:6]]
+    rx(b"\x30\x02\x05")
+    assert tx() == [b"\x21" + pdu[6:13]]
+    assert lpp.MICROSECOND_TIMER.CCR3 == 6000
+    lpp.MICROSECOND_TIMER.CNT = 6000
+    lpp.isotp_irq_handler()
+    assert tx() == [b"\x22" + pdu[13:20]]
+    rx(b"\x30\x00\x00")
+    lpp.MICROSECOND_TIMER.CNT = 6100
+    lpp.isotp_irq_handler()
+    assert tx() == [b"\x23" + pdu[20:27], b"\x24" + pdu[27:30] + b"\xaa" * 4]
+    assert events() == [(0, Panda.ISOTP_EVENT_TX_DONE, b"")]
+
+    # reassembly, the frames don't go to the host
+    rx(b"\x10\x0a" + pdu[:6])
+    assert tx() == [b"\x30\x00\x00" + b"\xaa" * 5]
+    rx(b"\x21" + pdu[6:10])
+    assert events() == [(0, Panda.ISOTP_EVENT_RX, pdu[:10])]
+    assert lpp.can_packed_used(RX_QUEUES[0]) == 0
+
+    # no flow control
+    write(struct.pack("<BBBH", 0x84, 0, 2, 0) + pdu)
+    tx()
+    lpp.MICROSECOND_TIMER.CNT = 6100 + 1000000
+    lpp.isotp_irq_handler()
+    assert events() == [(0, Panda.ISOTP_EVENT_ERROR, bytes([Panda.ISOTP_ERROR_TIMEOUT_FC]))]
+    assert (lpp.MICROSECOND_TIMER.DIER & 0x8) == 0
+
+    # one buffer per channel, a PDU coming in keeps one from being staged
+    rx(b"\x10\x0a" + pdu[:6])
+    assert tx() == [b"\x30\x00\x00" + b"\xaa" * 5]
+    write(struct.pack("<BBBH", 0x84, 0, 2, 0) + pdu)
+    assert tx() == []
+    rx(b"\x21" + pdu[6:10])
+    assert events() == [(0, Panda.ISOTP_EVENT_ERROR, bytes([Panda.ISOTP_ERROR_BUSY])), (0, Panda.ISOTP_EVENT_RX, pdu[:10])]
+
+    # and a staged one keeps a segmented PDU from coming in, single frames still do
+    write(struct.pack("<BBBH", 0x84, 0, 1, 0) + pdu)
+    rx(b"\x10\x0a" + pdu[:6])
+    assert tx() == [b"\x32\x00\x00" + b"\xaa" * 5]
+    rx(b"\x02\x01\x02")
+    assert events() == [(0, Panda.ISOTP_EVENT_ERROR, bytes([Panda.ISOTP_ERROR_BUSY])), (0, Panda.ISOTP_EVENT_RX, b"\x01\x02")]
+    write(struct.pack("<BBBH", 0x84, 0, 2, len(pdu)))
+    assert tx() == [b"\x10\x1e" + pdu[:6]]
+
+    write(bytes([0x84, 0, 3]))
+    lpp.MICROSECOND_TIMER.CNT = 0
+
+  def test_can_bus_load(self):
+    health = lpp.can_health[0]
+    lpp.MICROSECOND_TIMER.CNT = 0
+    # 123 bits each at 500 kbps
+    classic = libpanda_py.make_CANPacket(0x123, 0, b"\x55" * 8)
+    for _ in range(100):
+      lpp.can_bus_load_add(0, classic, False)
+    lpp.MICROSECOND_TIMER.CNT = 100000
+    lpp.can_bus_load_update(0)
+    assert (health.bus_load_100ms, health.bus_load_1s) == (246, 24)
+
+    # 53 bits at 500 kbps and 613 at 2 Mbps
+    fd = libpanda_py.make_CANPacket(0x18DAF110, 0, b"\x55" * 64)
+    fd[0].fd = 1
+    lpp.can_bus_load_add(0, fd, True)
+    lpp.MICROSECOND_TIMER.CNT = 250000
+    lpp.can_bus_load_update(0)
+    assert (health.bus_load_100ms, health.bus_load_1s) == (4, 25)
+
+    # idle windows count as well
+    lpp.MICROSECOND_TIMER.CNT = 1200000
+    lpp.can_bus_load_update(0)
+    assert (health.bus_load_100ms, health.bus_load_1s) == (0, 0)
+    assert (health.bus_load_100ms_peak, health.bus_load_1s_peak) == (246, 25)
+    lpp.MICROSECOND_TIMER.CNT = 0
 
   def test_can_send_usb(self):
     lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
@@ -125,6 +661,163 @@ class TestPandaComms(unittest.TestCase):
           self.assertEqual(len(queue_msgs), len(msgs))
           self.assertEqual(queue_msgs, msgs)
 
+  def test_can_rx_deferred(self):
+    # received frames and TX echoes wait in staging until the bottom half runs, in order
+    for i in range(10):
+      pkt = libpanda_py.make_CANPacket(0x100 + i, 0, bytes([i]))
+      pkt[0].returned = i % 3 == 0
+      lpp.can_rx_stage(pkt)
+    assert lpp.can_packed_used(RX_QUEUES[0]) == 0
+
+    lpp.can_rx_bottom_half()
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    msgs = unpack_can_buffer(bytes(dat[0:rx_len]))[0]
+    assert msgs == [(0x100 + i, bytes([i]), 128 if i % 3 == 0 else 0) for i in range(10)]
+
+  def test_can_tx_report(self):
+    def run(mode):
+      lpp.can_tx_report_set(0, mode)
+      for i, (returned, rejected) in enumerate([(False, False), (True, False), (True, True)]):
+        pkt = libpanda_py.make_CANPacket(0x100 + i, 0, b"\x01\x02")
+        pkt[0].returned = returned
+        pkt[0].rejected = rejected
+        lpp.can_rx_stage(pkt)
+      lpp.can_rx_bottom_half()
+      dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+      rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+      return unpack_can_buffer(bytes(dat[0:rx_len]))[0]
+
+    assert run(0) == [(0x100, b"\x01\x02", 0), (0x101, b"\x01\x02", 128), (0x102, b"\x01\x02", 320)]
+    # compact echoes leave out the payload, frames that didn't go out are always reported
+    assert run(1) == [(0x100, b"\x01\x02", 0), (0x101, b"", 128), (0x102, b"", 320)]
+    assert run(2) == [(0x100, b"\x01\x02", 0), (0x102, b"", 320)]
+    lpp.can_tx_report_set(0, 0)
+
+  def test_rx_handled_before_tx_check(self):
+    # host writes only go through the safety model once it has seen every frame received before
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.can_rx_stage(libpanda_py.make_CANPacket(0x1F1, 0, b"\x02" + b"\x00" * 7))
+    for buf in pack_can_buffer([(0x200, b"\x01", 0)]):
+      lpp.comms_can_write(buf, len(buf))
+    assert lpp.ignition_can
+
+    # the rest is left to the bottom half, which doesn't run the hooks again
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    assert lpp.comms_can_read(dat, CHUNK_SIZE) == 0
+    lpp.ignition_can = False
+    lpp.can_rx_bottom_half()
+    assert not lpp.ignition_can
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    assert unpack_can_buffer(bytes(dat[0:rx_len]))[0] == [(0x1F1, b"\x02" + b"\x00" * 7, 0)]
+    lpp.can_tx_clear(0)
+
+  def test_can_recv_failed_echo(self):
+    # a frame with ID 0 that never went out isn't taken for a change-only status packet
+    lpp.can_tx_report_set(0, Panda.CAN_TX_REPORT_NONE)
+    pkt = libpanda_py.make_CANPacket(0, 0, b"\x01")
+    pkt[0].returned = 1
+    pkt[0].rejected = 1
+    lpp.can_rx_stage(pkt)
+    lpp.can_rx_bottom_half()
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+
+    class Handle:
+      def bulkRead(self, endpoint, length):
+        return bytes(dat[0:rx_len])
+
+    p = Panda.__new__(Panda)
+    p._handle = Handle()
+    p.can_version = Panda.CAN_PACKET_VERSION
+    p.can_rx_overflow_buffer = b''
+    p.can_rx_suppressed_cnt = [0, 0, 0]
+    assert p.can_recv() == [(0, b"", Panda.CAN_TX_FAILED_BUS)]
+    assert p.can_rx_suppressed_cnt == [0, 0, 0]
+    lpp.can_tx_report_set(0, Panda.CAN_TX_REPORT_FULL)
+
+  def test_can_rx_fast_path(self):
+    # frames from RX FIFO 1 don't wait behind the staged ones
+    for i in range(3):
+      lpp.can_rx_stage(libpanda_py.make_CANPacket(0x100 + i, 0, bytes([i])))
+    lpp.can_rx_handle(libpanda_py.make_CANPacket(0x20, 0, b"\x20"), True)
+
+    lpp.can_rx_bottom_half()
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    msgs = unpack_can_buffer(bytes(dat[0:rx_len]))[0]
+    assert msgs == [(0x20, b"\x20", 0)] + [(0x100 + i, bytes([i]), 0) for i in range(3)]
+
+  def test_can_delta_rx(self):
+    lpp.can_delta_set(0, 100)
+
+    def rx(addr, dat, bus, ts):
+      pkt = libpanda_py.make_CANPacket(addr, bus, dat)
+      pkt[0].timestamp = ts
+      lpp.can_rx_push(pkt)
+
+    def read():
+      dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+      buf = b""
+      while (rx_len := lpp.comms_can_read(dat, CHUNK_SIZE)) > 0:
+        buf += bytes(dat[0:rx_len])
+      return unpack_can_buffer(buf)[0]
+
+    # repeats are held back until the payload changes or the refresh is due, other buses aren't affected
+    for ts in range(0, 100000, 10000):
+      rx(0x100, b"\x01", 0, ts)
+      rx(0x200, bytes([ts // 50000]), 0, ts)
+      rx(0x100, b"\x01", 1, ts)
+    msgs = read()
+    assert [m for m in msgs if m[2] == 0] == [(0x100, b"\x01", 0), (0x200, b"\x00", 0), (0x200, b"\x01", 0)]
+    assert [m for m in msgs if m[2] == 1] == [(0x100, b"\x01", 1)] * 10
+
+    # the count of held back frames goes ahead of the next frame
+    rx(0x100, b"\x01", 0, 100000)
+    assert read() == [(0, struct.pack("<I", 17), Panda.CAN_DELTA_STATUS_BUS), (0x100, b"\x01", 0)]
+
+    # reconfiguring a bus only starts over on that bus
+    lpp.can_delta_set(1, 100)
+    rx(0x100, b"\x01", 1, 100000)
+    rx(0x100, b"\x01", 0, 100000)
+    lpp.can_delta_set(1, 100)
+    rx(0x100, b"\x01", 1, 100000)
+    rx(0x100, b"\x01", 0, 100000)
+    assert read() == [(0x100, b"\x01", 1)] * 2
+    lpp.can_delta_set(1, 0)
+
+    # payloads are compared in full, FD payloads too long to keep are always sent
+    for dat in (b"\x01" * 8, b"\x01" * 7 + b"\x02", b"\x01" * 7 + b"\x02", b"\x01" * 7, b"\x01" * 12, b"\x01" * 12):
+      rx(0x300, dat, 0, 100000)
+    assert read() == [(0x300, b"\x01" * 8, 0), (0x300, b"\x01" * 7 + b"\x02", 0), (0x300, b"\x01" * 7, 0)] + [(0x300, b"\x01" * 12, 0)] * 2
+
+    lpp.can_delta_set(0, 0)
+    rx(0x100, b"\x01", 0, 100001)
+    assert read() == [(0x100, b"\x01", 0)]
+
+  def test_can_rx_subscription(self):
+    # 0x100 on bus 0 at 10Hz, 0x200 on bus 0 as is and everything on bus 1
+    subs = struct.pack("<BBIH", 0, 0, 0x100, 100) + struct.pack("<BBIH", 0, 0, 0x200, 0)
+    lpp.can_sub_write(bytes([0x83, 0]) + subs, 2 + len(subs))
+    lpp.can_subs_apply(2, 0b1)
+
+    for ts in range(0, 200000, 20000):
+      for addr, bus in ((0x100, 0), (0x200, 0), (0x300, 0), (0x100, 1), (0x300, 1)):
+        pkt = libpanda_py.make_CANPacket(addr, bus, b"\x01")
+        pkt[0].timestamp = ts
+        lpp.can_rx_push(pkt)
+
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    buf = b""
+    while (rx_len := lpp.comms_can_read(dat, CHUNK_SIZE)) > 0:
+      buf += bytes(dat[0:rx_len])
+    msgs = unpack_can_buffer(buf)[0]
+    assert [m[0] for m in msgs if m[2] == 0 and m[0] == 0x100] == [0x100] * 2
+    assert [m[0] for m in msgs if m[2] == 0 and m[0] != 0x100] == [0x200] * 10
+    assert len([m for m in msgs if m[2] == 1]) == 20
+
+    lpp.can_subs_apply(0, 0)
+
   def test_can_receive_usb(self):
     msgs = random_can_messages(50000)
     packets = [libpanda_py.make_CANPacket(m[0], m[2], m[1]) for m in msgs]
@@ -133,8 +826,8 @@ class TestPandaComms(unittest.TestCase):
     overflow_buf = b""
     while len(packets) > 0:
       # Push into queue
-      while lpp.can_slots_empty(lpp.rx_q) > 0 and len(packets) > 0:
-        lpp.can_push(lpp.rx_q, packets.pop(0))
+      while len(packets) > 0 and lpp.can_packed_push(RX_QUEUES[min(packets[0].bus, 2)], packets[0]):
+        packets.pop(0)
 
       # Simulate USB bulk IN chunks
       MAX_TRANSFER_SIZE = 16384